@@ -0,0 +1,453 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "../const.h"
+#include "../tools.h"
+
+
+#define _MAX_URLS 8
+
+
+enum _OPT_VALUES {
+	_O_UNIX = 's',
+	_O_CONNECTIONS = 'c',
+	_O_DURATION = 'd',
+	_O_URL = 'u',
+	_O_OUTPUT = 'o',
+	_O_HELP = 'h',
+	_O_VERSION = 'v',
+
+	_O_RECONNECT = 10000,
+	_O_LABEL,
+};
+
+static const char *const _SHORT_OPTS = "hvs:c:d:u:o:";
+static const struct option _LONG_OPTS[] = {
+	{"unix",		required_argument,	NULL,	_O_UNIX},
+	{"connections",	required_argument,	NULL,	_O_CONNECTIONS},
+	{"duration",	required_argument,	NULL,	_O_DURATION},
+	{"url",			required_argument,	NULL,	_O_URL},
+	{"reconnect",	no_argument,		NULL,	_O_RECONNECT},
+	{"output",		required_argument,	NULL,	_O_OUTPUT},
+	{"label",		required_argument,	NULL,	_O_LABEL},
+	{"help",		no_argument,		NULL,	_O_HELP},
+	{"version",		no_argument,		NULL,	_O_VERSION},
+	{NULL, 0, NULL, 0},
+};
+
+typedef struct {
+	pthread_t	tid;
+	int64_t		*samples_ns;
+	size_t		count;
+	size_t		cap;
+	size_t		errors;
+	size_t		bytes;
+	char		*buf;
+	size_t		buf_size;
+} _worker_s;
+
+typedef struct {
+	double		utime; // Seconds
+	double		stime;
+	unsigned	threads;
+	unsigned	rss_kb;
+} _proc_s;
+
+
+static const char *_g_unix_path = "/run/kvmd/fan.sock";
+static unsigned _g_connections = 16;
+static unsigned _g_duration = 10;
+static const char *_g_urls[_MAX_URLS];
+static unsigned _g_urls_count = 0;
+static bool _g_reconnect = false;
+static const char *_g_output_path = NULL;
+static const char *_g_label = "";
+
+static pthread_barrier_t _g_barrier;
+static atomic_bool _g_stop;
+
+
+static void *_worker_thread(void *v_worker);
+static int _connect(const char *path);
+static int _http_get(int fd, const char *url, _worker_s *worker);
+static pid_t _get_peer_pid(void);
+static int _read_proc(pid_t pid, _proc_s *proc);
+static int _compare_int64s(const void *a, const void *b);
+static void _help(void);
+
+
+int main(int argc, char *argv[]) {
+	for (int ch; (ch = getopt_long(argc, argv, _SHORT_OPTS, _LONG_OPTS, NULL)) >= 0;) {
+		switch (ch) {
+			case _O_UNIX:			_g_unix_path = optarg; break;
+			case _O_CONNECTIONS:	_g_connections = strtoul(optarg, NULL, 10); break;
+			case _O_DURATION:		_g_duration = strtoul(optarg, NULL, 10); break;
+			case _O_URL:
+				if (_g_urls_count >= _MAX_URLS) {
+					fprintf(stderr, "Too many URLs, max=%d\n", _MAX_URLS);
+					return 1;
+				}
+				_g_urls[_g_urls_count++] = optarg;
+				break;
+			case _O_RECONNECT:		_g_reconnect = true; break;
+			case _O_OUTPUT:			_g_output_path = optarg; break;
+			case _O_LABEL:			_g_label = optarg; break;
+			case _O_HELP:			_help(); return 0;
+			case _O_VERSION:		puts(VERSION); return 0;
+			default:				return 1;
+		}
+	}
+	if (_g_connections == 0 || _g_duration == 0) {
+		fputs("Invalid --connections or --duration\n", stderr);
+		return 1;
+	}
+	if (_g_urls_count == 0) {
+		_g_urls[_g_urls_count++] = "/state";
+	}
+
+	const pid_t pid = _get_peer_pid();
+	if (pid < 0) {
+		return 1;
+	}
+
+	_proc_s before;
+	if (_read_proc(pid, &before) < 0) {
+		fprintf(stderr, "Can't read /proc/%d, no server stats\n", pid);
+	}
+	unsigned threads_max = before.threads;
+
+	_worker_s *workers;
+	A_CALLOC(workers, _g_connections);
+	assert(!pthread_barrier_init(&_g_barrier, NULL, _g_connections + 1));
+	atomic_init(&_g_stop, false);
+	for (unsigned index = 0; index < _g_connections; ++index) {
+		A_THREAD_CREATE(&workers[index].tid, _worker_thread, &workers[index]);
+	}
+
+	pthread_barrier_wait(&_g_barrier);
+	const int64_t begin_ns = get_now_monotonic_ns();
+	const int64_t end_ns = begin_ns + _g_duration * NS_PER_SEC;
+	for (int64_t now_ns = begin_ns; now_ns < end_ns; now_ns = get_now_monotonic_ns()) {
+		// Sample the server's thread count while it's under the load
+		const int64_t step_ns = 100 * NS_PER_MS;
+		const int64_t sleep_ns = (end_ns - now_ns < step_ns ? end_ns - now_ns : step_ns);
+		const struct timespec ts = {.tv_sec = sleep_ns / NS_PER_SEC, .tv_nsec = sleep_ns % NS_PER_SEC};
+		nanosleep(&ts, NULL);
+		_proc_s proc;
+		if (_read_proc(pid, &proc) == 0 && proc.threads > threads_max) {
+			threads_max = proc.threads;
+		}
+	}
+	atomic_store(&_g_stop, true);
+	for (unsigned index = 0; index < _g_connections; ++index) {
+		A_THREAD_JOIN(workers[index].tid);
+	}
+	const double elapsed = ns_to_sec(get_now_monotonic_ns() - begin_ns);
+	assert(!pthread_barrier_destroy(&_g_barrier));
+
+	_proc_s after;
+	const bool has_proc = (_read_proc(pid, &after) == 0);
+
+	size_t total = 0;
+	size_t errors = 0;
+	size_t bytes = 0;
+	for (unsigned index = 0; index < _g_connections; ++index) {
+		total += workers[index].count;
+		errors += workers[index].errors;
+		bytes += workers[index].bytes;
+	}
+	int64_t *samples_ns;
+	A_CALLOC(samples_ns, total + 1);
+	size_t offset = 0;
+	int64_t sum_ns = 0;
+	for (unsigned index = 0; index < _g_connections; ++index) {
+		_worker_s *const worker = &workers[index];
+		for (size_t sample = 0; sample < worker->count; ++sample) {
+			sum_ns += worker->samples_ns[sample];
+		}
+		memcpy(samples_ns + offset, worker->samples_ns, worker->count * sizeof(int64_t));
+		offset += worker->count;
+		free(worker->samples_ns);
+		free(worker->buf);
+	}
+	free(workers);
+	qsort(samples_ns, total, sizeof(int64_t), _compare_int64s);
+
+#	define PCT_US(_pct) (total > 0 ? (double)samples_ns[(size_t)((total - 1) * (_pct) / 100)] / 1000 : 0)
+	const double rps = total / elapsed;
+	const double avg_us = (total > 0 ? (double)sum_ns / total / 1000 : 0);
+	const double cpu = (has_proc ? (after.utime - before.utime) + (after.stime - before.stime) : 0);
+
+	printf("url=%s", _g_urls[0]);
+	for (unsigned index = 1; index < _g_urls_count; ++index) {
+		printf(",%s", _g_urls[index]);
+	}
+	printf(" connections=%u duration=%.2fs%s\n", _g_connections, elapsed, (_g_reconnect ? " reconnect" : ""));
+	printf("requests=%zu errors=%zu rps=%.0f bytes=%zu\n", total, errors, rps, bytes);
+	printf("latency avg=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+		avg_us, PCT_US(50), PCT_US(90), PCT_US(99), PCT_US(99.9), PCT_US(100));
+	if (has_proc) {
+		printf("server pid=%d cpu=%.2fs (%.0f%%) user=%.2fs sys=%.2fs cpu_per_request=%.1fus"
+			" threads=%u threads_max=%u rss=%ukB\n",
+			pid, cpu, cpu / elapsed * 100, after.utime - before.utime, after.stime - before.stime,
+			(total > 0 ? cpu / total * 1000000 : 0), after.threads, threads_max, after.rss_kb);
+	}
+
+	int retval = 0;
+	if (_g_output_path != NULL) {
+		FILE *const fp = fopen(_g_output_path, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "Can't open '%s': %s\n", _g_output_path, strerror(errno));
+			retval = 1;
+		} else {
+			fprintf(fp, "{\"version\": \"%s\", \"label\": \"%s\", \"urls\": [", VERSION, _g_label);
+			for (unsigned index = 0; index < _g_urls_count; ++index) {
+				fprintf(fp, "%s\"%s\"", (index > 0 ? ", " : ""), _g_urls[index]);
+			}
+			fprintf(fp, "], \"connections\": %u, \"reconnect\": %s, \"duration\": %.3f,"
+				" \"requests\": %zu, \"errors\": %zu, \"rps\": %.1f, \"bytes\": %zu,"
+				" \"latency_us\": {\"avg\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+				_g_connections, (_g_reconnect ? "true" : "false"), elapsed,
+				total, errors, rps, bytes,
+				avg_us, PCT_US(50), PCT_US(90), PCT_US(99), PCT_US(99.9), PCT_US(100));
+			if (has_proc) {
+				fprintf(fp, ", \"server\": {\"cpu\": %.3f, \"user\": %.3f, \"sys\": %.3f, \"cpu_per_request_us\": %.2f,"
+					" \"threads\": %u, \"threads_max\": %u, \"rss_kb\": %u}",
+					cpu, after.utime - before.utime, after.stime - before.stime,
+					(total > 0 ? cpu / total * 1000000 : 0), after.threads, threads_max, after.rss_kb);
+			}
+			fputs("}\n", fp);
+			if (fclose(fp) < 0) {
+				retval = 1;
+			}
+		}
+	}
+#	undef PCT_US
+
+	free(samples_ns);
+	return (retval || total == 0 || errors > 0 ? 1 : 0);
+}
+
+static void *_worker_thread(void *v_worker) {
+	_worker_s *const worker = v_worker;
+	worker->buf_size = 65536;
+	A_CALLOC(worker->buf, worker->buf_size);
+
+	int fd = _connect(_g_unix_path);
+	pthread_barrier_wait(&_g_barrier);
+
+	for (unsigned url = 0; !atomic_load(&_g_stop); url = (url + 1) % _g_urls_count) {
+		const int64_t begin_ns = get_now_monotonic_ns();
+		if (fd < 0 && (fd = _connect(_g_unix_path)) < 0) {
+			worker->errors += 1;
+			usleep(10000);
+			continue;
+		}
+		if (_http_get(fd, _g_urls[url], worker) < 0) {
+			worker->errors += 1;
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		if (_g_reconnect) {
+			close(fd);
+			fd = -1;
+		}
+		if (worker->count == worker->cap) {
+			worker->cap = (worker->cap ? worker->cap * 2 : 65536);
+			assert((worker->samples_ns = realloc(worker->samples_ns, worker->cap * sizeof(int64_t))) != NULL);
+		}
+		worker->samples_ns[worker->count++] = get_now_monotonic_ns() - begin_ns;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	return NULL;
+}
+
+static int _connect(const char *path) {
+	struct sockaddr_un addr = {0};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "UNIX socket path is too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	addr.sun_family = AF_UNIX;
+
+	int fd;
+	assert((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Can't connect to '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	// Don't hang forever on a stuck server
+	const struct timeval tv = {.tv_sec = 5};
+	assert(!setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)));
+	return fd;
+}
+
+static int _http_get(int fd, const char *url, _worker_s *worker) {
+	char req[256];
+	const int req_size = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n",
+		url, (_g_reconnect ? "Connection: close\r\n" : ""));
+	if (req_size >= (int)sizeof(req) || send(fd, req, req_size, MSG_NOSIGNAL) != req_size) {
+		return -1;
+	}
+
+	size_t used = 0;
+	size_t header_size = 0;
+	size_t body_size = 0;
+	while (header_size == 0 || used < header_size + body_size) {
+		if (used >= worker->buf_size - 1) {
+			worker->buf_size *= 2;
+			assert((worker->buf = realloc(worker->buf, worker->buf_size)) != NULL);
+		}
+		const ssize_t got = recv(fd, worker->buf + used, worker->buf_size - used - 1, 0);
+		if (got <= 0) {
+			return -1;
+		}
+		used += got;
+		worker->buf[used] = '\0';
+		if (header_size == 0) {
+			const char *const end = strstr(worker->buf, "\r\n\r\n");
+			if (end != NULL) {
+				const char *const length = strcasestr(worker->buf, "Content-Length:");
+				if (length == NULL || length > end) {
+					return -1;
+				}
+				body_size = strtoul(length + 15, NULL, 10);
+				header_size = end + 4 - worker->buf;
+			}
+		}
+	}
+	worker->bytes += used;
+	return (strncmp(worker->buf, "HTTP/1.1 200", 12) ? -1 : 0);
+}
+
+static pid_t _get_peer_pid(void) {
+	const int fd = _connect(_g_unix_path);
+	if (fd < 0) {
+		return -1;
+	}
+	struct ucred cred;
+	socklen_t cred_size = sizeof(cred);
+	const int retval = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size);
+	close(fd);
+	if (retval < 0) {
+		perror("Can't get the server PID");
+		return -1;
+	}
+	return cred.pid;
+}
+
+static int _read_proc(pid_t pid, _proc_s *proc) {
+	memset(proc, 0, sizeof(*proc));
+	char path[64];
+	char line[1024];
+	static long ticks = 0;
+	if (ticks == 0) {
+		ticks = sysconf(_SC_CLK_TCK);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	const bool ok = (fgets(line, sizeof(line), fp) != NULL);
+	fclose(fp);
+	if (!ok) {
+		return -1;
+	}
+	// The comm field may contain spaces, so the fields are counted after the last ')'
+	const char *ptr = strrchr(line, ')');
+	unsigned long utime;
+	unsigned long stime;
+	long threads;
+	if (ptr == NULL || sscanf(ptr + 2,
+		"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %ld",
+		&utime, &stime, &threads) != 3
+	) {
+		return -1;
+	}
+	proc->utime = (double)utime / ticks;
+	proc->stime = (double)stime / ticks;
+	proc->threads = threads;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if ((fp = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			sscanf(line, "VmRSS: %u", &proc->rss_kb);
+		}
+		fclose(fp);
+	}
+	return 0;
+}
+
+static int _compare_int64s(const void *a, const void *b) {
+	const int64_t x = *(const int64_t *)a;
+	const int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void _help(void) {
+#	define SAY(_msg, ...) printf(_msg "\n", ##__VA_ARGS__)
+	SAY("\nKVMD-FAN-BENCH - HTTP load generator for the KVMD-FAN UNIX socket");
+	SAY("═════════════════════════════════════════════════════════════");
+	SAY("Version: %s; license: GPLv3\n", VERSION);
+	SAY("Usage: kvmd-fan-bench [options]\n");
+	SAY("Runs N keep-alive connections as fast as possible and reports the throughput,");
+	SAY("the latency percentiles and the server CPU time, threads and RSS from /proc");
+	SAY("(the server PID is taken from SO_PEERCRED). Exits with 1 on any request error.\n");
+	SAY("Options:");
+	SAY("════════");
+	SAY("    -s|--unix <path>  ──────── Path to the HTTP UNIX socket. Default: %s.\n", _g_unix_path);
+	SAY("    -c|--connections <N>  ──── Number of concurrent connections. Default: %u.\n", _g_connections);
+	SAY("    -d|--duration <sec>  ───── Test duration. Default: %u.\n", _g_duration);
+	SAY("    -u|--url <url>  ────────── Request URL, can be repeated for a round-robin mix. Default: /state.\n");
+	SAY("    --reconnect  ───────────── Open a new connection for each request.\n");
+	SAY("    -o|--output <path>  ────── Also write the results as a JSON object to this file.\n");
+	SAY("    --label <str>  ─────────── Label for the JSON results, like a commit ID. Default: empty.\n");
+	SAY("    -h|--help  ─────────────── Print this text and exit.\n");
+	SAY("    -v|--version  ──────────── Print version and exit.\n");
+#	undef SAY
+}
@@ -0,0 +1,186 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "control.h"
+
+
+const char *control_check_params(const control_params_s *params) {
+	if (!(
+		0 <= params->temp_rise
+		&& 0 <= params->temp_fall
+		&& params->temp_fall < params->temp_low
+		&& params->temp_low < params->temp_high
+		&& params->temp_high <= 85
+	)) {
+		return "Invalid temp-* config, should be: 0 <= rise, 0 <= fall < low < high <= 85";
+	}
+	if (!(
+		0 <= params->speed_idle
+		&& params->speed_idle <= params->speed_low
+		&& params->speed_low < params->speed_high
+		&& params->speed_high <= params->speed_heat
+		&& params->speed_heat <= 100
+	)) {
+		return "Invalid speed-* config, should be: 0 <= idle <= low < high <= heat <= 100";
+	}
+	if (!(
+		0 <= params->speed_dwell
+		&& params->speed_dwell <= 3600
+		&& 0 <= params->speed_changes
+		&& params->speed_changes <= CONTROL_CHANGES_MAX
+	)) {
+		return "Invalid speed-dwell or speed-changes config, should be: 0 <= dwell <= 3600, 0 <= changes <= 60";
+	}
+	return NULL;
+}
+
+void control_init(control_s *control, float speed_const) {
+	memset(control, 0, sizeof(*control));
+	control->temp_fixed = 0;
+	control->speed = -1;
+	control->speed_const = speed_const;
+	control->mode = "???";
+	control->mode_id = CONTROL_MODE_NONE;
+	control->refresh = false;
+}
+
+void control_refresh(control_s *control) {
+	// Used after the params change, keeps the current speed so there is no spin-up
+	control->refresh = true;
+}
+
+void control_resume(control_s *control, float temp_fixed, float speed) {
+	// Continues after the previous process which has left the fan spinning,
+	// the speed is recalculated on the next step but without a spin-up.
+	control->temp_fixed = temp_fixed;
+	control->speed = speed;
+	control->mode = "= RESUMED =";
+	control->mode_id = CONTROL_MODE_NONE;
+	control->refresh = true;
+}
+
+unsigned control_step(const control_params_s *params, control_s *control, int64_t now_ns, float temp, float speed_const, bool overridden) {
+	unsigned flags = 0;
+
+	if (speed_const != control->speed_const) {
+		control->speed_const = speed_const;
+		flags |= CONTROL_CONST_CHANGED;
+	}
+	if (speed_const < 0) {
+		// The separate thresholds: a small rise can be followed quickly,
+		// while the fall should be significant to slow the fan down.
+		const float delta = temp - control->temp_fixed;
+		if (delta >= params->temp_rise || -delta >= params->temp_fall) {
+			flags |= CONTROL_TEMP_CHANGED;
+		}
+	}
+
+	if (!(flags || control->speed < 0 || control->refresh)) {
+		control->postponed = false; // The temperature has returned to the band
+		return flags;
+	}
+
+	float speed;
+	const char *mode;
+	control_mode_e mode_id;
+	if (speed_const < 0) {
+		if (temp < params->temp_low) {
+			speed = params->speed_idle;
+			mode = "--- IDLE ---";
+			mode_id = CONTROL_MODE_IDLE;
+		} else if (temp > params->temp_high) {
+			speed = params->speed_heat;
+			mode = "!!! HEAT !!!";
+			mode_id = CONTROL_MODE_HEAT;
+		} else {
+			speed = remap(temp, params->temp_low, params->temp_high, params->speed_low, params->speed_high);
+			mode = "= IN-RANGE =";
+			mode_id = CONTROL_MODE_RANGE;
+		}
+	} else {
+		speed = speed_const;
+		mode = (overridden ? "= OVERRIDE =" : "= CONST =");
+		mode_id = (overridden ? CONTROL_MODE_OVERRIDE : CONTROL_MODE_CONST);
+	}
+
+	// Only the regular curve following is limited. The first step, the refresh,
+	// the constant speed, the override and the overheating are applied immediately.
+	// The reference temperature is not updated, so the change is retried on the next step.
+	if (flags == CONTROL_TEMP_CHANGED && !control->refresh && control->speed >= 0 && mode_id != CONTROL_MODE_HEAT && speed != control->speed) {
+		bool suppress = false;
+		if (params->speed_dwell > 0 && now_ns - control->changed_ns < params->speed_dwell * NS_PER_SEC) {
+			if (!control->postponed) {
+				++control->suppressed_dwell;
+			}
+			suppress = true;
+		} else if (params->speed_changes > 0) {
+			unsigned recent = 0;
+			for (unsigned index = 0; index < control->changes_count; ++index) {
+				if (now_ns - control->changes_ns[index] < 60 * NS_PER_SEC) {
+					++recent;
+				}
+			}
+			if (recent >= params->speed_changes) {
+				if (!control->postponed) {
+					++control->suppressed_budget;
+				}
+				suppress = true;
+			}
+		}
+		if (suppress) {
+			control->postponed = true;
+			return flags | CONTROL_SUPPRESSED;
+		}
+	}
+
+	// A raised curve on the refresh doesn't mean that the fan has stopped
+	if (((control->speed < params->speed_idle && !control->refresh) || control->speed <= 0) && speed > 0) {
+		flags |= CONTROL_SPIN_UP;
+	}
+	if (speed != control->speed || (flags & CONTROL_SPIN_UP)) {
+		// The same speed doesn't need the PWM write
+		control->changed_ns = now_ns;
+		control->changes_ns[control->changes_head] = now_ns;
+		control->changes_head = (control->changes_head + 1) % CONTROL_CHANGES_MAX;
+		if (control->changes_count < CONTROL_CHANGES_MAX) {
+			++control->changes_count;
+		}
+		flags |= CONTROL_SPEED_CHANGED;
+	}
+
+	control->temp_fixed = temp;
+	control->speed = speed;
+	control->mode = mode;
+	control->mode_id = mode_id;
+	control->refresh = false;
+	control->postponed = false;
+	return flags;
+}
+
+unsigned control_get_pwm(float speed, unsigned pwm_low, unsigned pwm_high) {
+	if (speed == 0) {
+		return 0;
+	} else if (speed == 100) {
+		return 1024;
+	}
+	return roundf(remap(speed, 0, 100, pwm_low, pwm_high));
+}
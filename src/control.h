@@ -0,0 +1,95 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "tools.h"
+
+
+#define CONTROL_CHANGES_MAX 60 // Per minute
+
+
+typedef struct {
+	float	temp_rise; // Recalculate the speed when the temperature rises by this value
+	float	temp_fall; // The same for the fall, a wider band prevents the flapping
+	float	temp_low;
+	float	temp_high;
+
+	float	speed_idle;
+	float	speed_low;
+	float	speed_high;
+	float	speed_heat;
+	float	speed_spin_up;
+
+	float	speed_dwell; // Minimal seconds at the same speed, 0 to disable
+	float	speed_changes; // Max PWM changes per minute, 0 for unlimited
+} control_params_s;
+
+typedef enum {
+	CONTROL_MODE_NONE = 0, // Before the first step or resumed
+	CONTROL_MODE_IDLE,
+	CONTROL_MODE_RANGE,
+	CONTROL_MODE_HEAT,
+	CONTROL_MODE_CONST,
+	CONTROL_MODE_OVERRIDE,
+	CONTROL_MODES,
+} control_mode_e;
+
+typedef struct {
+	float			temp_fixed;
+	float			speed; // -1 before the first step
+	float			speed_const;
+	const char		*mode;
+	control_mode_e	mode_id;
+	bool			refresh; // Recalculate the speed on the next step even without a significant change
+
+	int64_t			changed_ns; // The last speed change, for the dwell
+	int64_t			changes_ns[CONTROL_CHANGES_MAX]; // The ring of the last changes, for the budget
+	unsigned		changes_head;
+	unsigned		changes_count;
+	bool			postponed; // The current change is already counted as suppressed
+	unsigned		suppressed_dwell;
+	unsigned		suppressed_budget;
+} control_s;
+
+typedef enum {
+	CONTROL_CONST_CHANGED = 1,	// The constant speed or the override has been changed
+	CONTROL_TEMP_CHANGED = 2,	// Significant temperature change, see temp_rise and temp_fall
+	CONTROL_SPEED_CHANGED = 4,	// The speed has been changed, the PWM should be written
+	CONTROL_SPIN_UP = 8,		// The fan is stopped or too slow, spin it up before the new speed
+	CONTROL_SUPPRESSED = 16,	// The change is postponed by the dwell or by the budget
+} control_flag_e;
+
+
+const char *control_check_params(const control_params_s *params);
+
+void control_init(control_s *control, float speed_const);
+void control_refresh(control_s *control);
+void control_resume(control_s *control, float temp_fixed, float speed);
+unsigned control_step(const control_params_s *params, control_s *control, int64_t now_ns, float temp, float speed_const, bool overridden);
+
+unsigned control_get_pwm(float speed, unsigned pwm_low, unsigned pwm_high);
@@ -0,0 +1,331 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "ctl.h"
+
+
+static void *_ctl_thread(void *v_ctl);
+static void _accept_client(ctl_s *ctl);
+static void _close_client(ctl_client_s *client);
+static int _handle_request(ctl_s *ctl, ctl_client_s *client);
+static int _send_history(ctl_s *ctl, int fd, const proto_request_s *req);
+static void _send_state_to_subscribers(ctl_s *ctl);
+static int _send_response(int fd, const proto_response_s *resp, size_t size, int flags);
+static void _init_response(proto_response_s *resp, unsigned cmd, unsigned status);
+
+
+ctl_s *ctl_init(history_s *history, override_s *override, const char *path, bool rm, mode_t mode) {
+	ctl_s *ctl;
+	A_CALLOC(ctl, 1);
+	A_MUTEX_INIT(&ctl->s_mutex);
+	ctl->history = history;
+	ctl->override = override;
+	ctl->fd = -1;
+	ctl->event_fd = -1;
+	for (unsigned index = 0; index < CTL_MAX_CLIENTS; ++index) {
+		ctl->clients[index].fd = -1;
+	}
+	A_CALLOC(ctl->resp, 1);
+	atomic_init(&ctl->stop, true);
+
+	struct sockaddr_un addr = {0};
+
+#	define MAX_SUN_PATH (sizeof(addr.sun_path) - 1)
+
+	if (strlen(path) > MAX_SUN_PATH) {
+		LOG_ERROR("ctl", "UNIX socket path is too long; max=%zu", MAX_SUN_PATH);
+		goto error;
+	}
+
+	strncpy(addr.sun_path, path, MAX_SUN_PATH);
+	addr.sun_family = AF_UNIX;
+
+#   undef MAX_SUN_PATH
+
+	assert((ctl->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0);
+
+	if ((ctl->fd = systemd_get_socket(path, SOCK_SEQPACKET)) >= 0) {
+		// Already bound and listening, the permissions are set by the socket unit
+		LOG_INFO("ctl", "Using UNIX socket '%s' passed by systemd", path);
+	} else {
+		assert((ctl->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) >= 0);
+
+		if (rm && unlink(path) < 0) {
+			if (errno != ENOENT) {
+				LOG_PERROR("ctl", "Can't remove old UNIX socket '%s'", path);
+				goto error;
+			}
+		}
+
+		if (bind(ctl->fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) < 0) {
+			LOG_PERROR("ctl", "Can't bind control to UNIX socket '%s'", path);
+			goto error;
+		}
+		if (mode && chmod(path, mode) < 0) {
+			LOG_PERROR("ctl", "Can't set permissions %o to UNIX socket '%s'", mode, path);
+			goto error;
+		}
+		if (listen(ctl->fd, 16) < 0) {
+			LOG_PERROR("ctl", "Can't listen UNIX socket '%s'", path);
+			goto error;
+		}
+	}
+
+	atomic_store(&ctl->stop, false);
+	A_THREAD_CREATE(&ctl->tid, _ctl_thread, ctl);
+	LOG_INFO("ctl", "Listening control on UNIX socket '%s'", path);
+	return ctl;
+
+	error:
+		ctl_destroy(ctl);
+		return NULL;
+}
+
+void ctl_destroy(ctl_s *ctl) {
+	if (!atomic_load(&ctl->stop)) {
+		atomic_store(&ctl->stop, true);
+		assert(eventfd_write(ctl->event_fd, 1) == 0);
+		A_THREAD_JOIN(ctl->tid);
+	}
+	for (unsigned index = 0; index < CTL_MAX_CLIENTS; ++index) {
+		_close_client(&ctl->clients[index]);
+	}
+	if (ctl->event_fd >= 0) {
+		close(ctl->event_fd);
+	}
+	if (ctl->fd >= 0) {
+		close(ctl->fd);
+	}
+	free(ctl->resp);
+	A_MUTEX_DESTROY(&ctl->s_mutex);
+	free(ctl);
+}
+
+void ctl_set_state(ctl_s *ctl, int64_t now_ns, const state_s *state) {
+	A_MUTEX_LOCK(&ctl->s_mutex);
+	export_fill_state(&ctl->s_state, now_ns, state);
+	ctl->s_has_state = true;
+	A_MUTEX_UNLOCK(&ctl->s_mutex);
+	assert(eventfd_write(ctl->event_fd, 1) == 0);
+}
+
+static void *_ctl_thread(void *v_ctl) {
+	ctl_s *ctl = (ctl_s *)v_ctl;
+	thread_set_name("fan-ctl");
+
+	while (!atomic_load(&ctl->stop)) {
+		struct pollfd fds[CTL_MAX_CLIENTS + 2] = {
+			{.fd = ctl->event_fd, .events = POLLIN},
+			{.fd = ctl->fd, .events = POLLIN},
+		};
+		for (unsigned index = 0; index < CTL_MAX_CLIENTS; ++index) {
+			fds[index + 2].fd = ctl->clients[index].fd; // Negative fds are ignored
+			fds[index + 2].events = POLLIN;
+		}
+
+		if (poll(fds, CTL_MAX_CLIENTS + 2, -1) < 0) {
+			if (errno != EINTR) {
+				LOG_PERROR("ctl", "Can't poll sockets");
+				break;
+			}
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			eventfd_t count;
+			eventfd_read(ctl->event_fd, &count);
+			_send_state_to_subscribers(ctl);
+		}
+		if (fds[1].revents & POLLIN) {
+			_accept_client(ctl);
+		}
+		for (unsigned index = 0; index < CTL_MAX_CLIENTS; ++index) {
+			if (fds[index + 2].revents && fds[index + 2].fd == ctl->clients[index].fd) {
+				if (_handle_request(ctl, &ctl->clients[index]) < 0) {
+					_close_client(&ctl->clients[index]);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+static void _accept_client(ctl_s *ctl) {
+	const int fd = accept4(ctl->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		LOG_PERROR("ctl", "Can't accept client");
+		return;
+	}
+	for (unsigned index = 0; index < CTL_MAX_CLIENTS; ++index) {
+		if (ctl->clients[index].fd < 0) {
+			const struct timeval timeout = {.tv_sec = 1};
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			ctl->clients[index].fd = fd;
+			ctl->clients[index].subscribed = false;
+			return;
+		}
+	}
+	LOG_ERROR("ctl", "Too many clients, max=%u", CTL_MAX_CLIENTS);
+	close(fd);
+}
+
+static void _close_client(ctl_client_s *client) {
+	if (client->fd >= 0) {
+		close(client->fd);
+		client->fd = -1;
+		client->subscribed = false;
+	}
+}
+
+static int _handle_request(ctl_s *ctl, ctl_client_s *client) {
+	proto_request_s req = {0};
+	const ssize_t size = recv(client->fd, &req, sizeof(req), MSG_DONTWAIT);
+	if (size <= 0) {
+		return (size < 0 && errno == EAGAIN ? 0 : -1);
+	}
+
+	proto_response_s *const resp = ctl->resp;
+
+	if (size != sizeof(req) || req.magic != PROTO_MAGIC || req.version != PROTO_VERSION) {
+		_init_response(resp, req.cmd, PROTO_STATUS_BAD_REQUEST);
+		return _send_response(client->fd, resp, PROTO_RESPONSE_SIZE(0), 0);
+	}
+
+	switch (req.cmd) {
+		case PROTO_CMD_GET_STATE:
+			A_MUTEX_LOCK(&ctl->s_mutex);
+			_init_response(resp, req.cmd, (ctl->s_has_state ? PROTO_STATUS_OK : PROTO_STATUS_UNAVAILABLE));
+			resp->state = ctl->s_state;
+			A_MUTEX_UNLOCK(&ctl->s_mutex);
+			return _send_response(client->fd, resp, PROTO_STATE_RESPONSE_SIZE, 0);
+
+		case PROTO_CMD_GET_HISTORY:
+			return _send_history(ctl, client->fd, &req);
+
+		case PROTO_CMD_SET_OVERRIDE:
+			if (req.override.speed > 100 || isnan(req.override.speed)) {
+				_init_response(resp, req.cmd, PROTO_STATUS_BAD_REQUEST);
+			} else {
+				if (req.override.speed < 0) {
+					LOG_INFO("ctl", "Clearing the speed override");
+					override_clear(ctl->override);
+				} else {
+					LOG_INFO("ctl", "Overriding the speed: %.2f%% for %us", req.override.speed, req.override.ttl);
+					override_set(ctl->override, req.override.speed, req.override.ttl * NS_PER_SEC);
+				}
+				_init_response(resp, req.cmd, PROTO_STATUS_OK);
+			}
+			return _send_response(client->fd, resp, PROTO_RESPONSE_SIZE(0), 0);
+
+		case PROTO_CMD_SUBSCRIBE:
+			client->subscribed = true;
+			_init_response(resp, req.cmd, PROTO_STATUS_OK);
+			return _send_response(client->fd, resp, PROTO_RESPONSE_SIZE(0), 0);
+
+		default:
+			_init_response(resp, req.cmd, PROTO_STATUS_BAD_REQUEST);
+			return _send_response(client->fd, resp, PROTO_RESPONSE_SIZE(0), 0);
+	}
+}
+
+static int _send_history(ctl_s *ctl, int fd, const proto_request_s *req) {
+	proto_response_s *const resp = ctl->resp;
+
+	history_point_s *points = NULL;
+	size_t count = 0;
+	if (
+		ctl->history == NULL
+		|| history_get(ctl->history, req->history.res,
+			(req->history.from_ms == INT64_MIN ? -INFINITY : (long double)req->history.from_ms / 1000),
+			(req->history.to_ms == INT64_MAX ? INFINITY : (long double)req->history.to_ms / 1000),
+			&points, &count) < 0
+	) {
+		_init_response(resp, req->cmd, (ctl->history == NULL ? PROTO_STATUS_UNAVAILABLE : PROTO_STATUS_BAD_REQUEST));
+		return _send_response(fd, resp, PROTO_RESPONSE_SIZE(0), 0);
+	}
+
+	int retval = 0;
+	size_t index = 0;
+	do {
+		_init_response(resp, req->cmd, PROTO_STATUS_OK);
+		while (index < count && resp->count < PROTO_MAX_POINTS) {
+			const history_point_s *const point = &points[index];
+			resp->points[resp->count] = (proto_point_s){
+				.ts_ms = llroundl(point->ts * 1000),
+				.temp_min = lroundf(point->temp.min * 100),
+				.temp_max = lroundf(point->temp.max * 100),
+				.temp_avg = lroundf(point->temp.avg * 100),
+				.speed_min = lroundf(point->speed.min * 100),
+				.speed_max = lroundf(point->speed.max * 100),
+				.speed_avg = lroundf(point->speed.avg * 100),
+				.rpm_min = lroundf(fminf(point->rpm.min, UINT16_MAX)),
+				.rpm_max = lroundf(fminf(point->rpm.max, UINT16_MAX)),
+				.rpm_avg = lroundf(fminf(point->rpm.avg, UINT16_MAX)),
+			};
+			++resp->count;
+			++index;
+		}
+		resp->flags = (index < count ? PROTO_FLAG_MORE : 0);
+		if ((retval = _send_response(fd, resp, PROTO_RESPONSE_SIZE(resp->count), 0)) < 0) {
+			break;
+		}
+	} while (index < count);
+
+	free(points);
+	return retval;
+}
+
+static void _send_state_to_subscribers(ctl_s *ctl) {
+	proto_response_s *const resp = ctl->resp;
+	A_MUTEX_LOCK(&ctl->s_mutex);
+	_init_response(resp, PROTO_CMD_GET_STATE, PROTO_STATUS_OK);
+	resp->state = ctl->s_state;
+	A_MUTEX_UNLOCK(&ctl->s_mutex);
+
+	for (unsigned index = 0; index < CTL_MAX_CLIENTS; ++index) {
+		ctl_client_s *const client = &ctl->clients[index];
+		if (client->fd >= 0 && client->subscribed) {
+			// Slow subscribers just miss the update
+			if (_send_response(client->fd, resp, PROTO_STATE_RESPONSE_SIZE, MSG_DONTWAIT) < 0) {
+				if (errno != EAGAIN) {
+					_close_client(client);
+				}
+			}
+		}
+	}
+}
+
+static int _send_response(int fd, const proto_response_s *resp, size_t size, int flags) {
+	if (send(fd, resp, size, flags | MSG_NOSIGNAL) != (ssize_t)size) {
+		return -1;
+	}
+	return 0;
+}
+
+static void _init_response(proto_response_s *resp, unsigned cmd, unsigned status) {
+	resp->magic = PROTO_MAGIC;
+	resp->version = PROTO_VERSION;
+	resp->cmd = cmd;
+	resp->status = status;
+	resp->flags = 0;
+	resp->count = 0;
+}
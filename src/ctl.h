@@ -0,0 +1,79 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#include <pthread.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "systemd.h"
+#include "state.h"
+#include "history.h"
+#include "override.h"
+#include "export.h"
+#include "proto.h"
+
+
+#define CTL_MAX_CLIENTS 16
+
+
+typedef struct {
+	int		fd;
+	bool	subscribed;
+} ctl_client_s;
+
+typedef struct {
+	kvmd_fan_shm_state_s	s_state;
+	bool					s_has_state;
+	pthread_mutex_t			s_mutex;
+
+	history_s			*history;
+	override_s			*override;
+	int					fd;
+	int					event_fd;
+	ctl_client_s		clients[CTL_MAX_CLIENTS];
+	proto_response_s	*resp;
+	pthread_t			tid;
+	atomic_bool			stop;
+} ctl_s;
+
+
+ctl_s *ctl_init(history_s *history, override_s *override, const char *path, bool rm, mode_t mode);
+void ctl_destroy(ctl_s *ctl);
+
+void ctl_set_state(ctl_s *ctl, int64_t now_ns, const state_s *state);
@@ -0,0 +1,123 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <assert.h>
+
+#include "../const.h"
+#include "../tools.h"
+#include "../state.h"
+#include "../history.h"
+#include "../encode.h"
+
+
+static const char *const _SHORT_OPTS = "hv";
+static const struct option _LONG_OPTS[] = {
+	{"help",	no_argument,	NULL,	'h'},
+	{"version",	no_argument,	NULL,	'v'},
+	{NULL, 0, NULL, 0},
+};
+
+
+static uint8_t *_read_all(FILE *fp, size_t *size);
+static void _help(void);
+
+
+int main(int argc, char *argv[]) {
+	for (int ch; (ch = getopt_long(argc, argv, _SHORT_OPTS, _LONG_OPTS, NULL)) >= 0;) {
+		switch (ch) {
+			case 'h': _help(); return 0;
+			case 'v': puts(VERSION); return 0;
+			default: return 1;
+		}
+	}
+
+	size_t size;
+	uint8_t *const data = _read_all(stdin, &size);
+	int retval = 0;
+
+	switch (decode_kind(data, size)) {
+		case ENCODE_KIND_STATE: {
+			int64_t now_ns;
+			state_s state;
+			if (decode_state_binary(data, size, &now_ns, &state) < 0) {
+				goto error;
+			}
+			encode_state_json(stdout, now_ns, &state);
+			break;
+		}
+
+		case ENCODE_KIND_HISTORY: {
+			unsigned res;
+			history_point_s *points;
+			size_t count;
+			if (decode_history_binary(data, size, &res, &points, &count) < 0) {
+				goto error;
+			}
+			encode_history_json(stdout, res, points, count);
+			free(points);
+			break;
+		}
+
+		default: goto error;
+	}
+
+	goto ok;
+	error:
+		fputs("Invalid or truncated input\n", stderr);
+		retval = 1;
+	ok:
+		free(data);
+		return retval;
+}
+
+static uint8_t *_read_all(FILE *fp, size_t *size) {
+	uint8_t *data = NULL;
+	size_t allocated = 0;
+	*size = 0;
+	while (true) {
+		if (*size == allocated) {
+			allocated = (allocated ? allocated * 2 : 65536);
+			assert(data = realloc(data, allocated));
+		}
+		const size_t got = fread(data + *size, 1, allocated - *size, fp);
+		if (got == 0) {
+			break;
+		}
+		*size += got;
+	}
+	return data;
+}
+
+static void _help(void) {
+	printf("\nKVMD-FAN-DECODE - Decode the binary /state and /history responses of KVMD-FAN\n");
+	printf("Version: %s; license: GPLv3\n\n", VERSION);
+	printf("Reads the " ENCODE_MIME_BINARY " payload from stdin and prints the equivalent JSON.\n\n");
+	printf("Example:\n");
+	printf("    curl -s --unix-socket /run/kvmd/fan.sock -H 'Accept: " ENCODE_MIME_BINARY "' \\\n");
+	printf("        'http://localhost/history?res=10' | kvmd-fan-decode\n\n");
+}
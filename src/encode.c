@@ -0,0 +1,374 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "encode.h"
+
+
+// Binary format, all integers are LEB128 varints, signed ones are zigzagged:
+//   - Header: "KFAN", u8 version, u8 kind.
+//   - State: nfields, then nfields signed values (see _STATE_FIELDS).
+//   - History: res, count, nseries, then nseries columns (see _HISTORY_SERIES)
+//     of count signed values, each one is a delta from the previous in the column.
+//     The points are on the grid, so the timestamps are the deltas of the deltas
+//     since version 2, which takes one byte per point instead of three.
+// Temperatures and speeds are fixed-point x100, timestamps are milliseconds.
+// Unknown trailing fields and series are skipped by the decoder.
+
+#define _MAGIC		"KFAN"
+#define _VERSION	2
+#define _HEADER		6
+
+typedef struct {
+	const uint8_t	*data;
+	size_t			size;
+	size_t			pos;
+	unsigned		version;
+} _reader_s;
+
+static const struct {
+	size_t	offset;
+	float	scale;
+} _HISTORY_SERIES[] = {
+	{offsetof(history_point_s, temp.min),	100},
+	{offsetof(history_point_s, temp.max),	100},
+	{offsetof(history_point_s, temp.avg),	100},
+	{offsetof(history_point_s, speed.min),	100},
+	{offsetof(history_point_s, speed.max),	100},
+	{offsetof(history_point_s, speed.avg),	100},
+	{offsetof(history_point_s, rpm.min),	1},
+	{offsetof(history_point_s, rpm.max),	1},
+	{offsetof(history_point_s, rpm.avg),	1},
+};
+
+#define _STATE_FIELDS 21
+#define _HISTORY_SERIES_COUNT (1 + sizeof(_HISTORY_SERIES) / sizeof(_HISTORY_SERIES[0]))
+
+
+static void _write_header(FILE *fp, encode_kind_e kind);
+static void _write_uint(FILE *fp, uint64_t value);
+static void _write_int(FILE *fp, int64_t value);
+static size_t _put_uint(uint8_t *buf, uint64_t value);
+static size_t _put_int(uint8_t *buf, int64_t value);
+
+static int _read_header(_reader_s *reader, encode_kind_e kind);
+static int _read_uint(_reader_s *reader, uint64_t *value);
+static int _read_int(_reader_s *reader, int64_t *value);
+
+static int64_t _fixed(long double value, float scale) {
+	return llroundl(value * scale);
+}
+
+static float _series_get(const history_point_s *point, unsigned series) {
+	return *(const float *)((const char *)point + _HISTORY_SERIES[series].offset);
+}
+
+static void _series_set(history_point_s *point, unsigned series, float value) {
+	*(float *)((char *)point + _HISTORY_SERIES[series].offset) = value;
+}
+
+
+void encode_state_json(FILE *fp, int64_t now_ns, const state_s *state) {
+	char buf[ENCODE_STATE_MAX_SIZE];
+	fwrite(buf, 1, encode_state_json_buf(buf, ENCODE_STATE_MAX_SIZE, now_ns, state), fp);
+}
+
+void encode_state_binary(FILE *fp, int64_t now_ns, const state_s *state) {
+	uint8_t buf[ENCODE_STATE_MAX_SIZE];
+	fwrite(buf, 1, encode_state_binary_buf(buf, ENCODE_STATE_MAX_SIZE, now_ns, state), fp);
+}
+
+size_t encode_state_json_buf(char *buf, size_t size, int64_t now_ns, const state_s *state) {
+	const int len = snprintf(buf, size,
+		"{\"ok\": true, \"result\": {"
+		"\"service\": {\"now_ts\": %.2Lf, \"config_gen\": %u, \"startup\": {\"first_pwm\": %.4Lf, \"ready\": %.4Lf}},"
+		" \"temp\": {\"real\": %.2f, \"fixed\": %.2f, \"health\": \"%s\", \"errors\": %u},"
+		" \"fan\": {\"speed\": %.2f, \"pwm\": %u, \"ok\": %s, \"last_fail_ts\": %.2Lf},"
+		" \"hall\": {\"available\": %s, \"rpm\": %u},"
+		" \"throttle\": {\"available\": %s, \"flags\": %u, \"active\": %s, \"events\": %u, \"duration\": %.2Lf},"
+		" \"suppressed\": {\"dwell\": %u, \"budget\": %u}"
+		"}}\n",
+		ns_to_sec(now_ns),
+		state->config_gen,
+		ns_to_sec(state->startup_pwm_ns),
+		ns_to_sec(state->startup_ready_ns),
+		state->temp_real,
+		state->temp_fixed,
+		temp_health_to_string(state->temp_health),
+		state->temp_errors,
+		state->speed,
+		state->pwm,
+		(state->ok ? "true" : "false"),
+		(state->last_fail_ns < 0 ? -1 : ns_to_sec(state->last_fail_ns)),
+		(state->has_hall ? "true" : "false"),
+		state->rpm,
+		(state->has_throttle ? "true" : "false"),
+		state->throttle_flags,
+		(state->throttle_active ? "true" : "false"),
+		state->throttle_events,
+		ns_to_sec(state->throttle_ns),
+		state->suppressed_dwell,
+		state->suppressed_budget);
+	assert(len > 0 && (size_t)len < size);
+	return len;
+}
+
+size_t encode_state_binary_buf(uint8_t *buf, size_t size, int64_t now_ns, const state_s *state) {
+	// 6 bytes of the header and max 10 bytes per varint
+	assert(size >= _HEADER + 10 * (1 + _STATE_FIELDS));
+	memcpy(buf, _MAGIC, 4);
+	buf[4] = _VERSION;
+	buf[5] = ENCODE_KIND_STATE;
+	size_t pos = _HEADER;
+	pos += _put_uint(buf + pos, _STATE_FIELDS);
+	pos += _put_int(buf + pos, now_ns / NS_PER_MS);
+	pos += _put_int(buf + pos, _fixed(state->temp_real, 100));
+	pos += _put_int(buf + pos, _fixed(state->temp_fixed, 100));
+	pos += _put_int(buf + pos, _fixed(state->speed, 100));
+	pos += _put_int(buf + pos, state->pwm);
+	pos += _put_int(buf + pos, state->rpm);
+	pos += _put_int(buf + pos, state->ok);
+	pos += _put_int(buf + pos, (state->last_fail_ns < 0 ? -1000 : state->last_fail_ns / NS_PER_MS));
+	pos += _put_int(buf + pos, state->has_hall);
+	pos += _put_int(buf + pos, state->config_gen);
+	pos += _put_int(buf + pos, state->startup_pwm_ns / 1000); // Microseconds
+	pos += _put_int(buf + pos, state->startup_ready_ns / 1000);
+	pos += _put_int(buf + pos, state->temp_health);
+	pos += _put_int(buf + pos, state->temp_errors);
+	pos += _put_int(buf + pos, state->has_throttle);
+	pos += _put_int(buf + pos, state->throttle_flags);
+	pos += _put_int(buf + pos, state->throttle_active);
+	pos += _put_int(buf + pos, state->throttle_events);
+	pos += _put_int(buf + pos, state->throttle_ns / NS_PER_MS);
+	pos += _put_int(buf + pos, state->suppressed_dwell);
+	pos += _put_int(buf + pos, state->suppressed_budget);
+	return pos;
+}
+
+void encode_history_json(FILE *fp, unsigned res, const history_point_s *points, size_t count) {
+	fprintf(fp,
+		"{\"ok\": true, \"result\": {\"res\": %u, \"fields\": ["
+		"\"ts\", \"temp_min\", \"temp_max\", \"temp_avg\", "
+		"\"speed_min\", \"speed_max\", \"speed_avg\", "
+		"\"rpm_min\", \"rpm_max\", \"rpm_avg\""
+		"], \"points\": [",
+		res);
+	for (size_t index = 0; index < count; ++index) {
+		const history_point_s *const point = &points[index];
+		fprintf(fp, "%s[%.2Lf, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.0f, %.0f, %.0f]",
+			(index > 0 ? ", " : ""), point->ts,
+			point->temp.min, point->temp.max, point->temp.avg,
+			point->speed.min, point->speed.max, point->speed.avg,
+			point->rpm.min, point->rpm.max, point->rpm.avg);
+	}
+	fputs("]}}\n", fp);
+}
+
+void encode_history_binary(FILE *fp, unsigned res, const history_point_s *points, size_t count) {
+	_write_header(fp, ENCODE_KIND_HISTORY);
+	_write_uint(fp, res);
+	_write_uint(fp, count);
+	_write_uint(fp, _HISTORY_SERIES_COUNT);
+
+	int64_t prev = 0;
+	int64_t prev_delta = 0;
+	for (size_t index = 0; index < count; ++index) {
+		const int64_t value = _fixed(points[index].ts, 1000);
+		_write_int(fp, (value - prev) - prev_delta);
+		prev_delta = value - prev;
+		prev = value;
+	}
+	for (unsigned series = 0; series < _HISTORY_SERIES_COUNT - 1; ++series) {
+		prev = 0;
+		for (size_t index = 0; index < count; ++index) {
+			const int64_t value = _fixed(_series_get(&points[index], series), _HISTORY_SERIES[series].scale);
+			_write_int(fp, value - prev);
+			prev = value;
+		}
+	}
+}
+
+int decode_kind(const uint8_t *data, size_t size) {
+	// The state has the same layout in both versions, the history differs in the timestamps
+	if (size < _HEADER || memcmp(data, _MAGIC, 4) || data[4] < 1 || data[4] > _VERSION) {
+		return -1;
+	}
+	return data[5];
+}
+
+int decode_state_binary(const uint8_t *data, size_t size, int64_t *now_ns, state_s *state) {
+	_reader_s reader = {.data = data, .size = size};
+	if (_read_header(&reader, ENCODE_KIND_STATE) < 0) {
+		return -1;
+	}
+
+	uint64_t nfields;
+	if (_read_uint(&reader, &nfields) < 0) {
+		return -1;
+	}
+
+	int64_t fields[_STATE_FIELDS] = {0};
+	for (uint64_t index = 0; index < nfields; ++index) {
+		int64_t value;
+		if (_read_int(&reader, &value) < 0) {
+			return -1;
+		}
+		if (index < _STATE_FIELDS) {
+			fields[index] = value;
+		}
+	}
+
+	*now_ns = fields[0] * NS_PER_MS;
+	state->temp_real = (float)fields[1] / 100;
+	state->temp_fixed = (float)fields[2] / 100;
+	state->speed = (float)fields[3] / 100;
+	state->pwm = fields[4];
+	state->rpm = fields[5];
+	state->ok = fields[6];
+	state->last_fail_ns = (fields[7] < 0 ? -1 : fields[7] * NS_PER_MS);
+	state->has_hall = fields[8];
+	state->config_gen = fields[9];
+	state->startup_pwm_ns = fields[10] * 1000;
+	state->startup_ready_ns = fields[11] * 1000;
+	state->temp_health = fields[12];
+	state->temp_errors = fields[13];
+	state->has_throttle = fields[14];
+	state->throttle_flags = fields[15];
+	state->throttle_active = fields[16];
+	state->throttle_events = fields[17];
+	state->throttle_ns = fields[18] * NS_PER_MS;
+	state->suppressed_dwell = fields[19];
+	state->suppressed_budget = fields[20];
+	return 0;
+}
+
+int decode_history_binary(const uint8_t *data, size_t size, unsigned *res, history_point_s **points, size_t *count) {
+	_reader_s reader = {.data = data, .size = size};
+	if (_read_header(&reader, ENCODE_KIND_HISTORY) < 0) {
+		return -1;
+	}
+
+	uint64_t tmp_res;
+	uint64_t tmp_count;
+	uint64_t nseries;
+	if (
+		_read_uint(&reader, &tmp_res) < 0
+		|| _read_uint(&reader, &tmp_count) < 0
+		|| _read_uint(&reader, &nseries) < 0
+		|| tmp_count > size // Each value takes at least one byte
+		|| nseries > _HISTORY_SERIES_COUNT + size // Empty columns for zero points still cost the iterations
+	) {
+		return -1;
+	}
+
+	*points = NULL;
+	A_CALLOC(*points, tmp_count + 1);
+
+	for (uint64_t series = 0; series < nseries; ++series) {
+		const bool delta2 = (series == 0 && reader.version >= 2);
+		int64_t value = 0;
+		int64_t delta = 0;
+		for (uint64_t index = 0; index < tmp_count; ++index) {
+			int64_t diff;
+			if (_read_int(&reader, &diff) < 0) {
+				free(*points);
+				*points = NULL;
+				return -1;
+			}
+			delta = (delta2 ? delta + diff : diff);
+			value += delta;
+			history_point_s *const point = &(*points)[index];
+			if (series == 0) {
+				point->ts = (long double)value / 1000;
+			} else if (series < _HISTORY_SERIES_COUNT) {
+				_series_set(point, series - 1, (float)value / _HISTORY_SERIES[series - 1].scale);
+			}
+		}
+	}
+
+	*res = tmp_res;
+	*count = tmp_count;
+	return 0;
+}
+
+static void _write_header(FILE *fp, encode_kind_e kind) {
+	fwrite(_MAGIC, 1, 4, fp);
+	fputc(_VERSION, fp);
+	fputc(kind, fp);
+}
+
+static void _write_uint(FILE *fp, uint64_t value) {
+	uint8_t buf[10];
+	fwrite(buf, 1, _put_uint(buf, value), fp);
+}
+
+static void _write_int(FILE *fp, int64_t value) {
+	uint8_t buf[10];
+	fwrite(buf, 1, _put_int(buf, value), fp);
+}
+
+static size_t _put_uint(uint8_t *buf, uint64_t value) {
+	size_t size = 0;
+	do {
+		buf[size] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+		value >>= 7;
+		++size;
+	} while (value);
+	return size;
+}
+
+static size_t _put_int(uint8_t *buf, int64_t value) {
+	return _put_uint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static int _read_header(_reader_s *reader, encode_kind_e kind) {
+	if (decode_kind(reader->data, reader->size) != (int)kind) {
+		return -1;
+	}
+	reader->pos = _HEADER;
+	reader->version = reader->data[4];
+	return 0;
+}
+
+static int _read_uint(_reader_s *reader, uint64_t *value) {
+	*value = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (reader->pos >= reader->size) {
+			return -1;
+		}
+		const uint8_t byte = reader->data[reader->pos];
+		++reader->pos;
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int _read_int(_reader_s *reader, int64_t *value) {
+	uint64_t raw;
+	if (_read_uint(reader, &raw) < 0) {
+		return -1;
+	}
+	*value = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "tools.h"
+#include "state.h"
+#include "history.h"
+
+
+#define ENCODE_MIME_BINARY "application/x-kvmd-fan"
+
+// Enough for any state in both formats
+#define ENCODE_STATE_MAX_SIZE 1024
+
+typedef enum {
+	ENCODE_KIND_STATE = 1,
+	ENCODE_KIND_HISTORY = 2,
+} encode_kind_e;
+
+
+void encode_state_json(FILE *fp, int64_t now_ns, const state_s *state);
+void encode_state_binary(FILE *fp, int64_t now_ns, const state_s *state);
+
+// Allocation-free variants, return the size of the data
+size_t encode_state_json_buf(char *buf, size_t size, int64_t now_ns, const state_s *state);
+size_t encode_state_binary_buf(uint8_t *buf, size_t size, int64_t now_ns, const state_s *state);
+
+void encode_history_json(FILE *fp, unsigned res, const history_point_s *points, size_t count);
+void encode_history_binary(FILE *fp, unsigned res, const history_point_s *points, size_t count);
+
+int decode_kind(const uint8_t *data, size_t size);
+int decode_state_binary(const uint8_t *data, size_t size, int64_t *now_ns, state_s *state);
+int decode_history_binary(const uint8_t *data, size_t size, unsigned *res, history_point_s **points, size_t *count);
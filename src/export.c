@@ -0,0 +1,121 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "export.h"
+
+
+export_s *export_init(const char *name, mode_t mode) {
+	export_s *export;
+	A_CALLOC(export, 1);
+	assert(export->name = strdup(name));
+
+	int fd = -1;
+	void *ptr = MAP_FAILED;
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT, mode)) < 0) {
+		LOG_PERROR("export", "Can't open shared memory '%s'", name);
+		goto error;
+	}
+	if (fchmod(fd, mode) < 0) { // Bypass umask
+		LOG_PERROR("export", "Can't set permissions %o to shared memory '%s'", mode, name);
+		goto error;
+	}
+	if (ftruncate(fd, sizeof(kvmd_fan_shm_s)) < 0) {
+		LOG_PERROR("export", "Can't resize shared memory '%s'", name);
+		goto error;
+	}
+	if ((ptr = mmap(NULL, sizeof(kvmd_fan_shm_s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		LOG_PERROR("export", "Can't mmap shared memory '%s'", name);
+		goto error;
+	}
+	close(fd);
+
+	export->shm = (kvmd_fan_shm_s *)ptr;
+	memset(export->shm, 0, sizeof(kvmd_fan_shm_s));
+	export->shm->magic = KVMD_FAN_SHM_MAGIC;
+	export->shm->version = KVMD_FAN_SHM_VERSION;
+	atomic_init(&export->shm->seq, 0);
+
+	LOG_INFO("export", "Exporting the state to shared memory '%s'", name);
+	return export;
+
+	error:
+		if (fd >= 0) {
+			close(fd);
+		}
+		export_destroy(export);
+		return NULL;
+}
+
+void export_destroy(export_s *export) {
+	if (export->shm != NULL) {
+		munmap(export->shm, sizeof(kvmd_fan_shm_s));
+		shm_unlink(export->name);
+	}
+	free(export->name);
+	free(export);
+}
+
+int export_set_mode(export_s *export, mode_t mode) {
+	int fd;
+	if ((fd = shm_open(export->name, O_RDWR, 0)) < 0) {
+		LOG_PERROR("export", "Can't open shared memory '%s'", export->name);
+		return -1;
+	}
+	const int retval = fchmod(fd, mode);
+	if (retval < 0) {
+		LOG_PERROR("export", "Can't set permissions %o to shared memory '%s'", mode, export->name);
+	}
+	close(fd);
+	return retval;
+}
+
+void export_set_state(export_s *export, int64_t now_ns, const state_s *state) {
+	kvmd_fan_shm_s *const shm = export->shm;
+	const uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	export_fill_state(&shm->state, now_ns, state);
+
+	atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
+
+void export_fill_state(kvmd_fan_shm_state_s *dest, int64_t now_ns, const state_s *state) {
+	*dest = (kvmd_fan_shm_state_s){
+		.ts_ms = now_ns / NS_PER_MS,
+		.temp_real = state->temp_real,
+		.temp_fixed = state->temp_fixed,
+		.speed = state->speed,
+		.pwm = state->pwm,
+		.rpm = state->rpm,
+		.ok = state->ok,
+		.has_hall = state->has_hall,
+		.has_throttle = state->has_throttle,
+		.throttle_active = state->throttle_active,
+		.last_fail_ts_ms = (state->last_fail_ns < 0 ? -1 : state->last_fail_ns / NS_PER_MS),
+		.throttle_flags = state->throttle_flags,
+		.throttle_events = state->throttle_events,
+		.throttle_ms = state->throttle_ns / NS_PER_MS,
+	};
+}
@@ -0,0 +1,54 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "state.h"
+#include "shm.h"
+
+
+typedef struct {
+	char			*name;
+	kvmd_fan_shm_s	*shm;
+} export_s;
+
+
+export_s *export_init(const char *name, mode_t mode);
+void export_destroy(export_s *export);
+int export_set_mode(export_s *export, mode_t mode);
+
+void export_set_state(export_s *export, int64_t now_ns, const state_s *state);
+void export_fill_state(kvmd_fan_shm_state_s *dest, int64_t now_ns, const state_s *state);
@@ -26,7 +26,7 @@
 static void *_hall_thread(void *v_fan);
 
 
-fan_s *fan_init(unsigned pwm_pin, unsigned pwm_low, unsigned pwm_high, unsigned pwm_soft, int hall_pin, fan_bias_e hall_bias) {
+fan_s *fan_init(unsigned pwm_pin, unsigned pwm_low, unsigned pwm_high, unsigned pwm_soft, sim_s *sim) {
 	assert(pwm_low < pwm_high);
 	assert(pwm_high <= 1024);
 
@@ -36,6 +36,15 @@ fan_s *fan_init(unsigned pwm_pin, unsigned pwm_low, unsigned pwm_high, unsigned
 	fan->pwm_low = pwm_low;
 	fan->pwm_high = pwm_high;
 	fan->pwm_soft = pwm_soft;
+	fan->sim = sim;
+
+	atomic_init(&fan->stop, true);
+	atomic_init(&fan->rpm, 0);
+
+	if (sim != NULL) {
+		LOG_INFO("fan.pwm", "Using the simulated fan for PWM range %u...%u", pwm_low, pwm_high);
+		return fan;
+	}
 
 	LOG_INFO("fan.pwm", "Using pin=%u for PWM range %u...%u", pwm_pin, pwm_low, pwm_high);
 #	ifndef WITH_WIRINGPI_STUB
@@ -46,81 +55,85 @@ fan_s *fan_init(unsigned pwm_pin, unsigned pwm_low, unsigned pwm_high, unsigned
 		pinMode(pwm_pin, PWM_OUTPUT);
 	}
 #	endif
+	return fan;
+}
 
-	atomic_init(&fan->stop, true);
-	atomic_init(&fan->rpm, 0);
-	if (hall_pin >= 0) {
-		LOG_INFO("fan.hall", "Using pin=%d for the Hall sensor", hall_pin);
+int fan_start_hall(fan_s *fan, unsigned hall_pin, fan_bias_e hall_bias) {
+	// Separated from fan_init(), so the PWM can be driven before the rest of the init
+	if (fan->sim != NULL) {
+		return 0;
+	}
 
-#		ifdef HAVE_GPIOD2
-		struct gpiod_chip *chip;
-		if ((chip = gpiod_chip_open("/dev/gpiochip0")) == NULL) {
-			LOG_PERROR("fan.hall", "Can't open GPIO chip");
-			goto error;
-		}
+	LOG_INFO("fan.hall", "Using pin=%u for the Hall sensor", hall_pin);
 
-		struct gpiod_line_settings *line_settings;
-		assert(line_settings = gpiod_line_settings_new());
-		assert(!gpiod_line_settings_set_direction(line_settings, GPIOD_LINE_DIRECTION_INPUT));
-		assert(!gpiod_line_settings_set_edge_detection(line_settings, GPIOD_LINE_EDGE_FALLING));
-		assert(!gpiod_line_settings_set_bias(line_settings,
-			hall_bias == FAN_BIAS_PULL_DOWN ? GPIOD_LINE_BIAS_PULL_DOWN
-			: hall_bias == FAN_BIAS_PULL_UP ? GPIOD_LINE_BIAS_PULL_UP
-			: GPIOD_LINE_BIAS_DISABLED
-		));
-
-		struct gpiod_line_config *line_config;
-		assert(line_config = gpiod_line_config_new());
-		const unsigned offset = hall_pin;
-		assert(!gpiod_line_config_add_line_settings(line_config, &offset, 1, line_settings));
-
-		struct gpiod_request_config *request_config;
-		assert(request_config = gpiod_request_config_new());
-		gpiod_request_config_set_consumer(request_config, "kvmd-fan::hall");
-
-		if ((fan->line = gpiod_chip_request_lines(chip, request_config, line_config)) == NULL) {
-			LOG_PERROR("fan.hall", "Can't request GPIO notification");
-		}
+#	ifdef HAVE_GPIOD2
+	struct gpiod_chip *chip;
+	if ((chip = gpiod_chip_open("/dev/gpiochip0")) == NULL) {
+		LOG_PERROR("fan.hall", "Can't open GPIO chip");
+		goto error;
+	}
 
-		gpiod_request_config_free(request_config);
-		gpiod_line_config_free(line_config);
-		gpiod_line_settings_free(line_settings);
-		gpiod_chip_close(chip);
+	struct gpiod_line_settings *line_settings;
+	assert(line_settings = gpiod_line_settings_new());
+	assert(!gpiod_line_settings_set_direction(line_settings, GPIOD_LINE_DIRECTION_INPUT));
+	assert(!gpiod_line_settings_set_edge_detection(line_settings, GPIOD_LINE_EDGE_FALLING));
+	assert(!gpiod_line_settings_set_bias(line_settings,
+		hall_bias == FAN_BIAS_PULL_DOWN ? GPIOD_LINE_BIAS_PULL_DOWN
+		: hall_bias == FAN_BIAS_PULL_UP ? GPIOD_LINE_BIAS_PULL_UP
+		: GPIOD_LINE_BIAS_DISABLED
+	));
 
-		if (fan->line == NULL) {
-			goto error;
-		}
+	struct gpiod_line_config *line_config;
+	assert(line_config = gpiod_line_config_new());
+	const unsigned offset = hall_pin;
+	assert(!gpiod_line_config_add_line_settings(line_config, &offset, 1, line_settings));
 
-#		else
+	struct gpiod_request_config *request_config;
+	assert(request_config = gpiod_request_config_new());
+	gpiod_request_config_set_consumer(request_config, "kvmd-fan::hall");
 
-		if ((fan->chip = gpiod_chip_open_by_number(0)) == NULL) {
-			LOG_PERROR("fan.hall", "Can't open GPIO chip");
-			goto error;
-		}
-		if ((fan->line = gpiod_chip_get_line(fan->chip, hall_pin)) == NULL) {
-			LOG_PERROR("fan.hall", "Can't get GPIO line");
-			goto error;
-		}
-		int flags;
-		switch (hall_bias) {
-			case FAN_BIAS_PULL_DOWN: flags = GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_DOWN; break;
-			case FAN_BIAS_PULL_UP: flags = GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP; break;
-			default: flags = GPIOD_LINE_REQUEST_FLAG_BIAS_DISABLE;
-		}
-		if (gpiod_line_request_falling_edge_events_flags(fan->line, "kvmd-fan::hall", flags) < 0) {
-			LOG_PERROR("fan.hall", "Can't request GPIO notification");
-			goto error;
-		}
-#		endif
+	if ((fan->line = gpiod_chip_request_lines(chip, request_config, line_config)) == NULL) {
+		LOG_PERROR("fan.hall", "Can't request GPIO notification");
+	}
+
+	gpiod_request_config_free(request_config);
+	gpiod_line_config_free(line_config);
+	gpiod_line_settings_free(line_settings);
+	gpiod_chip_close(chip);
 
-		atomic_store(&fan->stop, false);
-		A_THREAD_CREATE(&fan->tid, _hall_thread, fan);
+	if (fan->line == NULL) {
+		goto error;
 	}
 
-	return fan;
+#	else
+
+	if ((fan->chip = gpiod_chip_open_by_number(0)) == NULL) {
+		LOG_PERROR("fan.hall", "Can't open GPIO chip");
+		goto error;
+	}
+	if ((fan->line = gpiod_chip_get_line(fan->chip, hall_pin)) == NULL) {
+		LOG_PERROR("fan.hall", "Can't get GPIO line");
+		goto error;
+	}
+	int flags;
+	switch (hall_bias) {
+		case FAN_BIAS_PULL_DOWN: flags = GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_DOWN; break;
+		case FAN_BIAS_PULL_UP: flags = GPIOD_LINE_REQUEST_FLAG_BIAS_PULL_UP; break;
+		default: flags = GPIOD_LINE_REQUEST_FLAG_BIAS_DISABLE;
+	}
+	if (gpiod_line_request_falling_edge_events_flags(fan->line, "kvmd-fan::hall", flags) < 0) {
+		LOG_PERROR("fan.hall", "Can't request GPIO notification");
+		goto error;
+	}
+#	endif
+
+	atomic_store(&fan->stop, false);
+	A_THREAD_CREATE(&fan->tid, _hall_thread, fan);
+	fan->hall_started = true;
+	return 0;
+
 	error:
-		fan_destroy(fan);
-		return NULL;
+		return -1;
 }
 
 void fan_destroy(fan_s *fan) {
@@ -143,14 +156,29 @@ void fan_destroy(fan_s *fan) {
 	free(fan);
 }
 
+void fan_set_usage(fan_s *fan, usage_s *usage) {
+	// Before fan_start_hall(), the pointer is read by the Hall thread without locking
+	assert(atomic_load(&fan->stop));
+	fan->usage = usage;
+}
+
+void fan_set_pwm_range(fan_s *fan, unsigned pwm_low, unsigned pwm_high) {
+	// Takes effect with the next fan_set_speed_percent()
+	assert(pwm_low < pwm_high);
+	assert(pwm_high <= 1024);
+	fan->pwm_low = pwm_low;
+	fan->pwm_high = pwm_high;
+	LOG_INFO("fan.pwm", "Using PWM range %u...%u", pwm_low, pwm_high);
+}
+
 unsigned fan_set_speed_percent(fan_s *fan, float speed) {
-	unsigned pwm;
-	if (speed == 0) {
-		pwm = 0;
-	} else if (speed == 100) {
-		pwm = 1024;
-	} else {
-		pwm = roundf(remap(speed, 0, 100, fan->pwm_low, fan->pwm_high));
+	const unsigned pwm = control_get_pwm(speed, fan->pwm_low, fan->pwm_high);
+	if (fan->usage != NULL) {
+		usage_set_duty(fan->usage, (fan->sim != NULL ? sim_get_now_ns(fan->sim) : get_now_monotonic_ns()), pwm / 1024.0);
+	}
+	if (fan->sim != NULL) {
+		sim_set_duty(fan->sim, pwm / 1024.0);
+		return pwm;
 	}
 #	ifndef WITH_WIRINGPI_STUB
 	if (fan->pwm_soft) {
@@ -163,6 +191,9 @@ unsigned fan_set_speed_percent(fan_s *fan, float speed) {
 }
 
 int fan_get_hall_rpm(fan_s *fan) {
+	if (fan->sim != NULL) {
+		return sim_get_hall_rpm(fan->sim);
+	}
 	return atomic_load(&fan->rpm);
 }
 
@@ -170,8 +201,12 @@ static void *_hall_thread(void *v_fan) {
 #	define _MAX_EVENTS 16
 
 	fan_s *fan = (fan_s *)v_fan;
-	long double next_ts = get_now_monotonic() + 1;
+	int64_t window_ns = get_now_monotonic_ns();
 	unsigned pulses = 0;
+	// Kernel timestamps of the edges in the current window. Only the differences are used,
+	// so it doesn't matter which clock the kernel uses for the events.
+	int64_t first_edge_ns = 0;
+	int64_t last_edge_ns = 0;
 
 #	ifdef HAVE_GPIOD2
 	struct gpiod_edge_event_buffer *events;
@@ -180,6 +215,8 @@ static void *_hall_thread(void *v_fan) {
 	struct gpiod_line_event	events[_MAX_EVENTS];
 #	endif
 
+	thread_set_name("fan-hall");
+
 	while (!atomic_load(&fan->stop)) {
 #		ifdef HAVE_GPIOD2
 		int retval = gpiod_line_request_wait_edge_events(fan->line, 100000000);
@@ -187,6 +224,8 @@ static void *_hall_thread(void *v_fan) {
 		const struct timespec timeout = {0, 100000000};
 		int retval = gpiod_line_event_wait(fan->line, &timeout);
 #		endif
+		STATS_BEGIN(begin_ns);
+		STATS_INC(STATS_HALL_WAKEUPS, 1);
 		if (retval < 0) {
 			LOG_PERROR("fan.hall", "Can't wait events");
 			atomic_store(&fan->rpm, -1);
@@ -202,16 +241,39 @@ static void *_hall_thread(void *v_fan) {
 				atomic_store(&fan->rpm, -1);
 				break;
 			}
+			for (int index = 0; index < retval; ++index) {
+#				ifdef HAVE_GPIOD2
+				const int64_t edge_ns = gpiod_edge_event_get_timestamp_ns(gpiod_edge_event_buffer_get_event(events, index));
+#				else
+				const int64_t edge_ns = (int64_t)events[index].ts.tv_sec * NS_PER_SEC + events[index].ts.tv_nsec;
+#				endif
+				if (pulses == 0) {
+					first_edge_ns = edge_ns;
+				}
+				last_edge_ns = edge_ns;
+				++pulses;
+			}
+			STATS_INC(STATS_HALL_EDGES, retval);
+			if (fan->usage != NULL) {
+				usage_add_pulses(fan->usage, retval);
+			}
 		} // retval == 0 for zero new events
 
-		long double now_ts = get_now_monotonic();
-		if (now_ts > next_ts) {
-			atomic_store(&fan->rpm, pulses * 30);
+		const int64_t now_ns = get_now_monotonic_ns();
+		if (now_ns - window_ns >= NS_PER_SEC) {
+			// Two pulses per revolution. Measure the period between the edges when possible,
+			// it doesn't depend on the wakeup jitter of this thread.
+			int rpm;
+			if (pulses >= 2 && last_edge_ns > first_edge_ns) {
+				rpm = (pulses - 1) * 30 * NS_PER_SEC / (last_edge_ns - first_edge_ns);
+			} else {
+				rpm = pulses * 30 * NS_PER_SEC / (now_ns - window_ns);
+			}
+			atomic_store(&fan->rpm, rpm);
 			pulses = 0;
-			next_ts = now_ts + 1;
-		} else {
-			pulses += retval;
+			window_ns = now_ns;
 		}
+		STATS_END(STATS_HALL_WALL, begin_ns);
 
 		usleep(10000);
 	}
@@ -39,6 +39,10 @@
 #include "const.h"
 #include "tools.h"
 #include "logging.h"
+#include "stats.h"
+#include "sim.h"
+#include "control.h"
+#include "usage.h"
 
 
 typedef enum {
@@ -53,6 +57,9 @@ typedef struct {
 	unsigned	pwm_high;
 	unsigned	pwm_soft;
 
+	sim_s		*sim; // Replaces PWM and Hall if not NULL
+	usage_s		*usage; // Optional accounting, see fan_set_usage()
+
 	// Hall sensor
 #	ifdef HAVE_GPIOD2
 	struct gpiod_line_request	*line;
@@ -61,14 +68,18 @@ typedef struct {
 	struct gpiod_line			*line;
 #	endif
 
+	bool		hall_started; // The tid is valid, the simulated fan has no thread
 	pthread_t	tid;
 	atomic_int	rpm;
 	atomic_bool	stop;
 } fan_s;
 
 
-fan_s *fan_init(unsigned pwm_pin, unsigned pwm_low, unsigned pwm_high, unsigned pwm_soft, int hall_pin, fan_bias_e hall_bias);
+fan_s *fan_init(unsigned pwm_pin, unsigned pwm_low, unsigned pwm_high, unsigned pwm_soft, sim_s *sim);
 void fan_destroy(fan_s *fan);
+int fan_start_hall(fan_s *fan, unsigned hall_pin, fan_bias_e hall_bias);
 
+void fan_set_usage(fan_s *fan, usage_s *usage);
+void fan_set_pwm_range(fan_s *fan, unsigned pwm_low, unsigned pwm_high);
 unsigned fan_set_speed_percent(fan_s *fan, float speed);
 int fan_get_hall_rpm(fan_s *fan);
@@ -0,0 +1,413 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <assert.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../const.h"
+#include "../state.h"
+#include "../history.h"
+#include "../encode.h"
+#include "../proto.h"
+
+
+enum _OPT_VALUES {
+	_O_SOCKET = 's',
+	_O_HELP = 'h',
+	_O_VERSION = 'v',
+
+	_O_RES = 10000,
+	_O_FROM,
+	_O_TO,
+	_O_COUNT,
+	_O_HTTP,
+};
+
+static const char *const _SHORT_OPTS = "hvs:";
+static const struct option _LONG_OPTS[] = {
+	{"socket",	required_argument,	NULL,	_O_SOCKET},
+	{"res",		required_argument,	NULL,	_O_RES},
+	{"from",	required_argument,	NULL,	_O_FROM},
+	{"to",		required_argument,	NULL,	_O_TO},
+	{"count",	required_argument,	NULL,	_O_COUNT},
+	{"http",	required_argument,	NULL,	_O_HTTP},
+	{"help",	no_argument,		NULL,	_O_HELP},
+	{"version",	no_argument,		NULL,	_O_VERSION},
+	{NULL, 0, NULL, 0},
+};
+
+static const char *_g_socket_path = "/run/kvmd/fan-ctl.sock";
+static const char *_g_http_path = NULL;
+static unsigned _g_res = 1;
+static int64_t _g_from_ms = INT64_MIN;
+static int64_t _g_to_ms = INT64_MAX;
+static unsigned _g_count = 10000;
+
+
+static int _cmd_state(int fd);
+static int _cmd_history(int fd);
+static int _cmd_override(int fd, int argc, char *argv[]);
+static int _cmd_subscribe(int fd);
+static int _cmd_bench(int fd);
+
+static int _connect(const char *path, int type);
+static int _request(int fd, const proto_request_s *req, proto_response_s *resp);
+static int _http_get(int fd, const char *url, char *buf, size_t size);
+static void _print_state(const kvmd_fan_shm_state_s *shm_state);
+static void _print_latency(const char *name, double *samples, unsigned count);
+static double _get_now_us(void);
+static int _compare_doubles(const void *a, const void *b);
+static void _help(void);
+
+
+int main(int argc, char *argv[]) {
+	for (int ch; (ch = getopt_long(argc, argv, _SHORT_OPTS, _LONG_OPTS, NULL)) >= 0;) {
+		switch (ch) {
+			case _O_SOCKET:		_g_socket_path = optarg; break;
+			case _O_RES:		_g_res = strtoul(optarg, NULL, 10); break;
+			case _O_FROM:		_g_from_ms = llroundl(strtold(optarg, NULL) * 1000); break;
+			case _O_TO:			_g_to_ms = llroundl(strtold(optarg, NULL) * 1000); break;
+			case _O_COUNT:		_g_count = strtoul(optarg, NULL, 10); break;
+			case _O_HTTP:		_g_http_path = optarg; break;
+			case _O_HELP:		_help(); return 0;
+			case _O_VERSION:	puts(VERSION); return 0;
+			default:			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		_help();
+		return 1;
+	}
+	const char *const cmd = argv[optind];
+
+	const int fd = _connect(_g_socket_path, SOCK_SEQPACKET);
+	if (fd < 0) {
+		return 1;
+	}
+
+	int retval;
+	if (!strcmp(cmd, "state")) {
+		retval = _cmd_state(fd);
+	} else if (!strcmp(cmd, "history")) {
+		retval = _cmd_history(fd);
+	} else if (!strcmp(cmd, "override")) {
+		retval = _cmd_override(fd, argc - optind - 1, argv + optind + 1);
+	} else if (!strcmp(cmd, "subscribe")) {
+		retval = _cmd_subscribe(fd);
+	} else if (!strcmp(cmd, "bench")) {
+		retval = _cmd_bench(fd);
+	} else {
+		fprintf(stderr, "Unknown command: %s\n", cmd);
+		retval = -1;
+	}
+
+	close(fd);
+	return (retval < 0 ? 1 : 0);
+}
+
+static int _cmd_state(int fd) {
+	const proto_request_s req = {.magic = PROTO_MAGIC, .version = PROTO_VERSION, .cmd = PROTO_CMD_GET_STATE};
+	proto_response_s resp;
+	if (_request(fd, &req, &resp) < 0) {
+		return -1;
+	}
+	_print_state(&resp.state);
+	return 0;
+}
+
+static int _cmd_history(int fd) {
+	const proto_request_s req = {
+		.magic = PROTO_MAGIC, .version = PROTO_VERSION, .cmd = PROTO_CMD_GET_HISTORY,
+		.history = {.res = _g_res, .from_ms = _g_from_ms, .to_ms = _g_to_ms},
+	};
+	proto_response_s *resp;
+	A_CALLOC(resp, 1);
+
+	history_point_s *points = NULL;
+	size_t count = 0;
+	int retval = 0;
+
+	if (_request(fd, &req, resp) < 0) {
+		goto error;
+	}
+	while (true) {
+		assert(points = realloc(points, (count + resp->count) * sizeof(history_point_s) + 1));
+		for (unsigned index = 0; index < resp->count; ++index) {
+			const proto_point_s *const src = &resp->points[index];
+			points[count] = (history_point_s){
+				.ts = (long double)src->ts_ms / 1000,
+				.temp = {(float)src->temp_min / 100, (float)src->temp_max / 100, (float)src->temp_avg / 100},
+				.speed = {(float)src->speed_min / 100, (float)src->speed_max / 100, (float)src->speed_avg / 100},
+				.rpm = {src->rpm_min, src->rpm_max, src->rpm_avg},
+			};
+			++count;
+		}
+		if (!(resp->flags & PROTO_FLAG_MORE)) {
+			break;
+		}
+		if (recv(fd, resp, sizeof(proto_response_s), 0) <= 0) {
+			perror("Can't receive history");
+			goto error;
+		}
+	}
+	encode_history_json(stdout, _g_res, points, count);
+
+	goto ok;
+	error:
+		retval = -1;
+	ok:
+		free(points);
+		free(resp);
+		return retval;
+}
+
+static int _cmd_override(int fd, int argc, char *argv[]) {
+	if (argc < 1) {
+		fputs("Usage: override <speed> [<ttl>] | override clear\n", stderr);
+		return -1;
+	}
+	proto_request_s req = {.magic = PROTO_MAGIC, .version = PROTO_VERSION, .cmd = PROTO_CMD_SET_OVERRIDE};
+	if (!strcmp(argv[0], "clear")) {
+		req.override.speed = -1;
+	} else {
+		req.override.speed = strtof(argv[0], NULL);
+		req.override.ttl = (argc > 1 ? strtoul(argv[1], NULL, 10) : 0);
+	}
+	proto_response_s resp;
+	return _request(fd, &req, &resp);
+}
+
+static int _cmd_subscribe(int fd) {
+	const proto_request_s req = {.magic = PROTO_MAGIC, .version = PROTO_VERSION, .cmd = PROTO_CMD_SUBSCRIBE};
+	proto_response_s resp;
+	if (_request(fd, &req, &resp) < 0) {
+		return -1;
+	}
+	while (recv(fd, &resp, sizeof(resp), 0) > 0) {
+		_print_state(&resp.state);
+		fflush(stdout);
+	}
+	return 0;
+}
+
+static int _cmd_bench(int fd) {
+	if (_g_count == 0) {
+		return -1;
+	}
+	double *samples;
+	A_CALLOC(samples, _g_count);
+	int retval = 0;
+
+	const proto_request_s req = {.magic = PROTO_MAGIC, .version = PROTO_VERSION, .cmd = PROTO_CMD_GET_STATE};
+	proto_response_s resp;
+	for (unsigned index = 0; index < _g_count; ++index) {
+		const double begin_us = _get_now_us();
+		if (_request(fd, &req, &resp) < 0) {
+			goto error;
+		}
+		samples[index] = _get_now_us() - begin_us;
+	}
+	_print_latency("seqpacket", samples, _g_count);
+
+	if (_g_http_path != NULL) {
+		const int http_fd = _connect(_g_http_path, SOCK_STREAM);
+		if (http_fd < 0) {
+			goto error;
+		}
+		char buf[4096];
+		for (unsigned index = 0; index < _g_count; ++index) {
+			const double begin_us = _get_now_us();
+			if (_http_get(http_fd, "/state", buf, sizeof(buf)) < 0) {
+				close(http_fd);
+				goto error;
+			}
+			samples[index] = _get_now_us() - begin_us;
+		}
+		close(http_fd);
+		_print_latency("http", samples, _g_count);
+	}
+
+	goto ok;
+	error:
+		retval = -1;
+	ok:
+		free(samples);
+		return retval;
+}
+
+static int _connect(const char *path, int type) {
+	struct sockaddr_un addr = {0};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "UNIX socket path is too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	addr.sun_family = AF_UNIX;
+
+	int fd;
+	assert((fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) >= 0);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Can't connect to '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int _request(int fd, const proto_request_s *req, proto_response_s *resp) {
+	if (send(fd, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req)) {
+		perror("Can't send request");
+		return -1;
+	}
+	const ssize_t size = recv(fd, resp, sizeof(*resp), 0);
+	if (size < (ssize_t)PROTO_RESPONSE_SIZE(0)) {
+		fputs("Can't receive response\n", stderr);
+		return -1;
+	}
+	if (resp->magic != PROTO_MAGIC || resp->version != PROTO_VERSION || resp->cmd != req->cmd) {
+		fputs("Invalid response\n", stderr);
+		return -1;
+	}
+	switch (resp->status) {
+		case PROTO_STATUS_OK: return 0;
+		case PROTO_STATUS_UNAVAILABLE: fputs("Data is not available yet\n", stderr); return -1;
+		default: fputs("Bad request\n", stderr); return -1;
+	}
+}
+
+static int _http_get(int fd, const char *url, char *buf, size_t size) {
+	char req[256];
+	const int req_size = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", url);
+	if (send(fd, req, req_size, MSG_NOSIGNAL) != req_size) {
+		return -1;
+	}
+
+	size_t used = 0;
+	const char *body = NULL;
+	size_t body_size = 0;
+	while (body == NULL || used < (size_t)(body - buf) + body_size) {
+		if (used >= size - 1) {
+			return -1;
+		}
+		const ssize_t got = recv(fd, buf + used, size - used - 1, 0);
+		if (got <= 0) {
+			return -1;
+		}
+		used += got;
+		buf[used] = '\0';
+		if (body == NULL) {
+			const char *const end = strstr(buf, "\r\n\r\n");
+			if (end != NULL) {
+				const char *const length = strcasestr(buf, "Content-Length:");
+				if (length == NULL || length > end) {
+					return -1;
+				}
+				body_size = strtoul(length + 15, NULL, 10);
+				body = end + 4;
+			}
+		}
+	}
+	return (strncmp(buf, "HTTP/1.1 200", 12) ? -1 : 0);
+}
+
+static void _print_state(const kvmd_fan_shm_state_s *shm_state) {
+	const state_s state = {
+		.temp_real = shm_state->temp_real,
+		.temp_fixed = shm_state->temp_fixed,
+		.speed = shm_state->speed,
+		.pwm = shm_state->pwm,
+		.rpm = shm_state->rpm,
+		.ok = shm_state->ok,
+		.last_fail_ns = (shm_state->last_fail_ts_ms < 0 ? -1 : shm_state->last_fail_ts_ms * NS_PER_MS),
+		.has_hall = shm_state->has_hall,
+		.has_throttle = shm_state->has_throttle,
+		.throttle_flags = shm_state->throttle_flags,
+		.throttle_active = shm_state->throttle_active,
+		.throttle_events = shm_state->throttle_events,
+		.throttle_ns = shm_state->throttle_ms * NS_PER_MS,
+	};
+	encode_state_json(stdout, shm_state->ts_ms * NS_PER_MS, &state);
+}
+
+static void _print_latency(const char *name, double *samples, unsigned count) {
+	double sum = 0;
+	for (unsigned index = 0; index < count; ++index) {
+		sum += samples[index];
+	}
+	qsort(samples, count, sizeof(double), _compare_doubles);
+	printf("%-10s requests=%u avg=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n",
+		name, count, sum / count,
+		samples[count / 2], samples[count * 9 / 10], samples[count * 99 / 100], samples[count - 1]);
+}
+
+static double _get_now_us(void) {
+	struct timespec ts;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (double)ts.tv_sec * 1000000 + (double)ts.tv_nsec / 1000;
+}
+
+static int _compare_doubles(const void *a, const void *b) {
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void _help(void) {
+#	define SAY(_msg, ...) printf(_msg "\n", ##__VA_ARGS__)
+	SAY("\nKVMD-FANCTL - Control client for the KVMD-FAN binary protocol");
+	SAY("══════════════════════════════════════════════════════════");
+	SAY("Version: %s; license: GPLv3\n", VERSION);
+	SAY("Usage: kvmd-fanctl [options] <command>\n");
+	SAY("Commands:");
+	SAY("═════════");
+	SAY("    state  ──────────────────── Print the current state.\n");
+	SAY("    history  ────────────────── Print the history, see --res, --from and --to.\n");
+	SAY("    override <speed> [<ttl>]  ─ Override the fan speed for ttl seconds (0 = forever).\n");
+	SAY("    override clear  ─────────── Return the control to the daemon.\n");
+	SAY("    subscribe  ──────────────── Print the state after each loop iteration.\n");
+	SAY("    bench  ──────────────────── Measure the state request latency, see --count and --http.\n");
+	SAY("Options:");
+	SAY("════════");
+	SAY("    -s|--socket <path>  ─ Path to the control socket. Default: %s.\n", _g_socket_path);
+	SAY("    --res <sec>  ──────── History resolution: 1, 10 or 300. Default: %u.\n", _g_res);
+	SAY("    --from <ts>  ──────── History range start in the daemon's monotonic time. Default: unlimited.\n");
+	SAY("    --to <ts>  ────────── History range end. Default: unlimited.\n");
+	SAY("    --count <N>  ──────── Number of bench requests. Default: %u.\n", _g_count);
+	SAY("    --http <path>  ────── Also bench HTTP /state on this UNIX socket. Default: disabled.\n");
+	SAY("    -h|--help  ────────── Print this text and exit.\n");
+	SAY("    -v|--version  ─────── Print version and exit.\n");
+#	undef SAY
+}
@@ -0,0 +1,167 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "handover.h"
+
+
+// A small binary file written on a clean exit and consumed on the next start.
+// The timestamp is monotonic, so it's valid only within the same boot,
+// which is checked by the kernel's boot_id. The file is written to a temporary
+// one and renamed, so the reader sees either the whole state or nothing.
+
+#define _MAGIC		"KFHO"
+#define _VERSION	1
+
+typedef struct {
+	char		magic[4];
+	uint32_t	version;
+	char		boot_id[40];
+	int64_t		ts_ns; // get_now_monotonic_ns()
+	float		speed;
+	float		temp_fixed;
+	uint32_t	pwm;
+	uint32_t	reserved;
+} _file_s;
+
+
+static int _get_boot_id(char *boot_id, size_t size);
+
+
+int handover_save(const char *path, const handover_s *handover) {
+	char *tmp_path = NULL;
+	int fd = -1;
+	int retval = 0;
+
+	_file_s file = {
+		.version = _VERSION,
+		.ts_ns = get_now_monotonic_ns(),
+		.speed = handover->speed,
+		.temp_fixed = handover->temp_fixed,
+		.pwm = handover->pwm,
+	};
+	memcpy(file.magic, _MAGIC, 4);
+	if (_get_boot_id(file.boot_id, sizeof(file.boot_id)) < 0) {
+		LOG_ERROR("handover", "Can't read the boot ID");
+		goto error;
+	}
+
+	A_ASPRINTF(tmp_path, "%s.tmp", path);
+	if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		LOG_PERROR("handover", "Can't create the state file");
+		goto error;
+	}
+	if (write(fd, &file, sizeof(file)) != sizeof(file)) {
+		LOG_PERROR("handover", "Can't write the state file");
+		goto error;
+	}
+	close(fd);
+	fd = -1;
+	if (rename(tmp_path, path) < 0) {
+		LOG_PERROR("handover", "Can't rename the state file");
+		goto error;
+	}
+	LOG_INFO("handover", "Saved the state for the next start: speed=%.2f%% (pwm=%u), temp_fixed=%.2f°C",
+		handover->speed, handover->pwm, handover->temp_fixed);
+
+	goto ok;
+	error:
+		retval = -1;
+		if (tmp_path != NULL) {
+			unlink(tmp_path);
+		}
+	ok:
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(tmp_path);
+		return retval;
+}
+
+int handover_load(const char *path, unsigned max_age, handover_s *handover) {
+	int fd = -1;
+	int retval = 0;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT) {
+			LOG_PERROR("handover", "Can't open the state file");
+		} else {
+			LOG_INFO("handover", "There is no state from the previous run");
+		}
+		goto error;
+	}
+	// The state is one-shot: if we crash after the start, the next run shouldn't trust it
+	unlink(path);
+
+	_file_s file;
+	char boot_id[40];
+	if (read(fd, &file, sizeof(file)) != sizeof(file)) {
+		LOG_ERROR("handover", "The state file is truncated, ignored");
+		goto error;
+	}
+	if (memcmp(file.magic, _MAGIC, 4) || file.version != _VERSION) {
+		LOG_ERROR("handover", "The state file has an incompatible format, ignored");
+		goto error;
+	}
+	if (_get_boot_id(boot_id, sizeof(boot_id)) < 0 || strncmp(boot_id, file.boot_id, sizeof(boot_id))) {
+		LOG_INFO("handover", "The state is from the previous boot, ignored");
+		goto error;
+	}
+	const int64_t age_ns = get_now_monotonic_ns() - file.ts_ns;
+	if (age_ns < 0 || age_ns > max_age * NS_PER_SEC) {
+		LOG_INFO("handover", "The state is stale (%.1Lf seconds), ignored", ns_to_sec(age_ns));
+		goto error;
+	}
+	if (!(file.speed >= 0 && file.speed <= 100) || file.pwm > 1024) {
+		LOG_ERROR("handover", "The state file has invalid values, ignored");
+		goto error;
+	}
+
+	handover->speed = file.speed;
+	handover->temp_fixed = file.temp_fixed;
+	handover->pwm = file.pwm;
+	handover->age_ns = age_ns;
+
+	goto ok;
+	error:
+		retval = -1;
+	ok:
+		if (fd >= 0) {
+			close(fd);
+		}
+		return retval;
+}
+
+static int _get_boot_id(char *boot_id, size_t size) {
+	memset(boot_id, 0, size);
+	const int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	const ssize_t len = read(fd, boot_id, size - 1);
+	close(fd);
+	if (len <= 0) {
+		return -1;
+	}
+	boot_id[strcspn(boot_id, "\n")] = '\0';
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "history.h"
+
+
+static void _ring_add(history_ring_s *ring, int64_t ts_ns, float temp, float speed, unsigned rpm);
+static void _ring_flush(history_ring_s *ring);
+static void _value_add(history_value_s *value, float sample, bool first);
+static void _point_finish(history_point_s *dest, const history_point_s *acc, unsigned samples);
+
+
+history_s *history_init(void) {
+	// 1s for 10 minutes, 10s for 24 hours, 5min for 30 days
+	const unsigned layout[HISTORY_RINGS][2] = {{1, 600}, {10, 8640}, {300, 8640}};
+
+	history_s *history;
+	A_CALLOC(history, 1);
+	A_MUTEX_INIT(&history->mutex);
+
+	size_t total = 0;
+	for (unsigned index = 0; index < HISTORY_RINGS; ++index) {
+		history_ring_s *const ring = &history->rings[index];
+		ring->res = layout[index][0];
+		ring->size = layout[index][1];
+		A_CALLOC(ring->points, ring->size);
+		total += ring->size * sizeof(history_point_s);
+	}
+	LOG_INFO("history", "Using %zu bytes for the history", total);
+	return history;
+}
+
+void history_destroy(history_s *history) {
+	for (unsigned index = 0; index < HISTORY_RINGS; ++index) {
+		free(history->rings[index].points);
+	}
+	A_MUTEX_DESTROY(&history->mutex);
+	free(history);
+}
+
+void history_insert(history_s *history, int64_t ts_ns, float temp, float speed, unsigned rpm) {
+	A_MUTEX_LOCK(&history->mutex);
+	for (unsigned index = 0; index < HISTORY_RINGS; ++index) {
+		_ring_add(&history->rings[index], ts_ns, temp, speed, rpm);
+	}
+	A_MUTEX_UNLOCK(&history->mutex);
+}
+
+int history_get(history_s *history, unsigned res, long double from, long double to, history_point_s **points, size_t *count) {
+	const history_ring_s *ring = NULL;
+	for (unsigned index = 0; index < HISTORY_RINGS; ++index) {
+		if (history->rings[index].res == res) {
+			ring = &history->rings[index];
+			break;
+		}
+	}
+	if (ring == NULL) {
+		return -1;
+	}
+
+	*count = 0;
+	A_CALLOC(*points, ring->size + 1);
+
+	A_MUTEX_LOCK(&history->mutex);
+	for (unsigned offset = 0; offset < ring->count; ++offset) {
+		const history_point_s *const point = &ring->points[(ring->head + ring->size - ring->count + offset) % ring->size];
+		if (point->ts >= from && point->ts <= to) {
+			(*points)[*count] = *point;
+			*count += 1;
+		}
+	}
+	if (ring->acc_samples > 0 && ring->acc.ts >= from && ring->acc.ts <= to) {
+		_point_finish(&(*points)[*count], &ring->acc, ring->acc_samples);
+		*count += 1;
+	}
+	A_MUTEX_UNLOCK(&history->mutex);
+	return 0;
+}
+
+static void _ring_add(history_ring_s *ring, int64_t ts_ns, float temp, float speed, unsigned rpm) {
+	const int64_t res_ns = ring->res * NS_PER_SEC;
+	const long double point_ts = ns_to_sec(ts_ns - (ts_ns % res_ns + res_ns) % res_ns);
+	if (ring->acc_samples > 0 && ring->acc.ts != point_ts) {
+		_ring_flush(ring);
+	}
+	const bool first = (ring->acc_samples == 0);
+	ring->acc.ts = point_ts;
+	_value_add(&ring->acc.temp, temp, first);
+	_value_add(&ring->acc.speed, speed, first);
+	_value_add(&ring->acc.rpm, rpm, first);
+	ring->acc_samples += 1;
+}
+
+static void _ring_flush(history_ring_s *ring) {
+	_point_finish(&ring->points[ring->head], &ring->acc, ring->acc_samples);
+	ring->head = (ring->head + 1) % ring->size;
+	if (ring->count < ring->size) {
+		ring->count += 1;
+	}
+	ring->acc_samples = 0;
+}
+
+static void _value_add(history_value_s *value, float sample, bool first) {
+	if (first) {
+		value->min = value->max = value->avg = sample;
+	} else {
+		value->min = fminf(value->min, sample);
+		value->max = fmaxf(value->max, sample);
+		value->avg += sample;
+	}
+}
+
+static void _point_finish(history_point_s *dest, const history_point_s *acc, unsigned samples) {
+	*dest = *acc;
+	dest->temp.avg /= samples;
+	dest->speed.avg /= samples;
+	dest->rpm.avg /= samples;
+}
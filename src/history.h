@@ -0,0 +1,74 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <pthread.h>
+
+#include "tools.h"
+#include "logging.h"
+
+
+#define HISTORY_RINGS 3
+
+
+typedef struct {
+	float	min;
+	float	max;
+	float	avg;
+} history_value_s;
+
+typedef struct {
+	long double		ts; // Start of the point interval
+	history_value_s	temp;
+	history_value_s	speed;
+	history_value_s	rpm;
+} history_point_s;
+
+typedef struct {
+	unsigned		res; // Seconds per point
+	unsigned		size;
+	history_point_s	*points;
+	unsigned		head;
+	unsigned		count;
+
+	// The current incomplete point, avg fields hold sums
+	history_point_s	acc;
+	unsigned		acc_samples;
+} history_ring_s;
+
+typedef struct {
+	history_ring_s	rings[HISTORY_RINGS];
+	pthread_mutex_t	mutex;
+} history_s;
+
+
+history_s *history_init(void);
+void history_destroy(history_s *history);
+
+void history_insert(history_s *history, int64_t ts_ns, float temp, float speed, unsigned rpm);
+int history_get(history_s *history, unsigned res, long double from, long double to, history_point_s **points, size_t *count);
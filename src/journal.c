@@ -0,0 +1,221 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "journal.h"
+
+
+// The journal is a fixed-size ring of records in a memory-mapped file.
+// Each record is written in place by memcpy() and protected by CRC32,
+// so a torn write after a power loss invalidates only that record.
+// There are no write() calls on the sample path: the kernel writes
+// dirty pages back on its own and we ask it for an async flush
+// once in a while, and for a sync one on a clean exit.
+
+#define _MAGIC			"KFJR"
+#define _VERSION		1
+#define _SYNC_INTERVAL	60
+
+static_assert(sizeof(journal_record_s) == 32, "Unexpected journal record size");
+
+
+static int _recover(journal_s *journal, history_s *history);
+static bool _check_header(const journal_s *journal);
+static uint32_t _crc32(const uint8_t *data, size_t size);
+static uint32_t _record_crc(journal_record_s record);
+static int64_t _get_now_realtime_ms(void);
+
+
+journal_s *journal_init(const char *path, unsigned capacity, history_s *history) {
+	assert(capacity > 0);
+
+	journal_s *journal;
+	A_CALLOC(journal, 1);
+	journal->fd = -1;
+	journal->map = MAP_FAILED;
+	journal->capacity = capacity;
+	journal->map_size = sizeof(journal_header_s) + (size_t)capacity * sizeof(journal_record_s);
+	journal->last_sync_ns = get_now_monotonic_ns();
+
+	LOG_INFO("journal", "Using journal '%s' for %u records ...", path, capacity);
+
+	if ((journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+		LOG_PERROR("journal", "Can't open journal");
+		goto error;
+	}
+
+	struct stat st;
+	if (fstat(journal->fd, &st) < 0) {
+		LOG_PERROR("journal", "Can't stat journal");
+		goto error;
+	}
+	const bool fresh = ((size_t)st.st_size != journal->map_size);
+	if (fresh && ftruncate(journal->fd, journal->map_size) < 0) {
+		LOG_PERROR("journal", "Can't resize journal");
+		goto error;
+	}
+	// A store to a hole on a full filesystem raises SIGBUS in the loop,
+	// so all the blocks are allocated right here. The existing file can be sparse too.
+	{
+		const int retval = posix_fallocate(journal->fd, 0, journal->map_size);
+		if (retval != 0) {
+			errno = retval;
+			LOG_PERROR("journal", "Can't allocate journal");
+			goto error;
+		}
+	}
+
+	if ((journal->map = mmap(NULL, journal->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0)) == MAP_FAILED) {
+		LOG_PERROR("journal", "Can't mmap journal");
+		goto error;
+	}
+	journal->records = (journal_record_s *)(journal->map + sizeof(journal_header_s));
+
+	if (fresh || !_check_header(journal)) {
+		if (!fresh) {
+			LOG_ERROR("journal", "Journal has an incompatible layout, starting a new one");
+		}
+		memset(journal->map, 0, journal->map_size);
+		journal_header_s *const header = (journal_header_s *)journal->map;
+		memcpy(header->magic, _MAGIC, 4);
+		header->version = _VERSION;
+		header->capacity = capacity;
+		header->record_size = sizeof(journal_record_s);
+		msync(journal->map, journal->map_size, MS_ASYNC);
+	} else if (_recover(journal, history) < 0) {
+		goto error;
+	}
+
+	return journal;
+	error:
+		journal_destroy(journal);
+		return NULL;
+}
+
+void journal_destroy(journal_s *journal) {
+	if (journal->map != MAP_FAILED) {
+		msync(journal->map, journal->map_size, MS_SYNC);
+		munmap(journal->map, journal->map_size);
+	}
+	if (journal->fd >= 0) {
+		close(journal->fd);
+	}
+	free(journal);
+}
+
+void journal_write(journal_s *journal, float temp_real, float temp_fixed, float speed, unsigned pwm, unsigned rpm, unsigned flags) {
+	journal->seq += 1;
+	if (journal->seq == 0) { // Overflow, zero is reserved for empty slots
+		journal->seq = 1;
+	}
+
+	journal_record_s record = {
+		.seq = journal->seq,
+		.ts = _get_now_realtime_ms(),
+		.temp_real = lroundf(temp_real * 100),
+		.temp_fixed = lroundf(temp_fixed * 100),
+		.speed = lroundf(speed * 100),
+		.pwm = pwm,
+		.rpm = (rpm > UINT16_MAX ? UINT16_MAX : rpm),
+		.flags = flags,
+	};
+	record.crc = _record_crc(record);
+	journal->records[journal->seq % journal->capacity] = record;
+
+	const int64_t now_ns = get_now_monotonic_ns();
+	if (now_ns - journal->last_sync_ns >= _SYNC_INTERVAL * NS_PER_SEC) {
+		msync(journal->map, journal->map_size, MS_ASYNC);
+		journal->last_sync_ns = now_ns;
+	}
+}
+
+static int _recover(journal_s *journal, history_s *history) {
+	unsigned valid = 0;
+	unsigned broken = 0;
+	for (unsigned index = 0; index < journal->capacity; ++index) {
+		const journal_record_s *const record = &journal->records[index];
+		if (record->seq == 0) {
+			continue;
+		}
+		if (record->crc != _record_crc(*record) || record->seq % journal->capacity != index) {
+			++broken;
+			continue;
+		}
+		if (valid == 0 || (int32_t)(record->seq - journal->seq) > 0) {
+			journal->seq = record->seq;
+		}
+		++valid;
+	}
+	LOG_INFO("journal", "Recovered %u records, %u broken; last seq=%u", valid, broken, journal->seq);
+
+	if (history == NULL || valid == 0) {
+		return 0;
+	}
+
+	// Feed the history from the oldest record to the newest one
+	const uint32_t first_seq = journal->seq - journal->capacity + 1;
+	const int64_t offset_ns = get_now_monotonic_ns() - _get_now_realtime_ms() * NS_PER_MS;
+	for (unsigned count = 0; count < journal->capacity; ++count) {
+		const uint32_t seq = first_seq + count;
+		const journal_record_s *const record = &journal->records[seq % journal->capacity];
+		if (record->seq != seq || record->seq == 0 || record->crc != _record_crc(*record)) {
+			continue;
+		}
+		history_insert(history,
+			record->ts * NS_PER_MS + offset_ns,
+			(float)record->temp_real / 100,
+			(float)record->speed / 100,
+			record->rpm);
+	}
+	return 0;
+}
+
+static bool _check_header(const journal_s *journal) {
+	const journal_header_s *const header = (const journal_header_s *)journal->map;
+	return (
+		!memcmp(header->magic, _MAGIC, 4)
+		&& header->version == _VERSION
+		&& header->capacity == journal->capacity
+		&& header->record_size == sizeof(journal_record_s)
+	);
+}
+
+static uint32_t _crc32(const uint8_t *data, size_t size) {
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t index = 0; index < size; ++index) {
+		crc ^= data[index];
+		for (unsigned bit = 0; bit < 8; ++bit) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static uint32_t _record_crc(journal_record_s record) {
+	record.crc = 0;
+	return _crc32((const uint8_t *)&record, sizeof(record));
+}
+
+static int64_t _get_now_realtime_ms(void) {
+	struct timespec ts;
+	assert(!clock_gettime(CLOCK_REALTIME, &ts));
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,82 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <assert.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "history.h"
+
+
+#define JOURNAL_FLAG_OK			1
+#define JOURNAL_FLAG_CHANGED	2
+#define JOURNAL_FLAG_DEGRADED	4 // The temperature is from a fallback sensor, held or missing
+
+typedef struct {
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	capacity;
+	uint32_t	record_size;
+} journal_header_s;
+
+typedef struct {
+	uint32_t	seq; // Zero for an empty slot
+	uint32_t	crc; // CRC32 of the record with zeroed crc field
+	int64_t		ts; // Realtime in milliseconds
+	int16_t		temp_real; // Fixed-point x100
+	int16_t		temp_fixed;
+	uint16_t	speed; // Fixed-point x100
+	uint16_t	pwm;
+	uint16_t	rpm;
+	uint8_t		flags;
+	uint8_t		reserved[5];
+} journal_record_s;
+
+typedef struct {
+	int					fd;
+	uint8_t				*map;
+	size_t				map_size;
+	journal_record_s	*records;
+	unsigned			capacity;
+	uint32_t			seq;
+	int64_t				last_sync_ns;
+} journal_s;
+
+
+journal_s *journal_init(const char *path, unsigned capacity, history_s *history);
+void journal_destroy(journal_s *journal);
+
+void journal_write(journal_s *journal, float temp_real, float temp_fixed, float speed, unsigned pwm, unsigned rpm, unsigned flags);
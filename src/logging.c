@@ -23,5 +23,357 @@
 #include "logging.h"
 
 
+// The messages are formatted by the caller right into a slot of the bounded
+// lock-free MPSC ring (Vyukov's sequence-per-slot queue) and written to stderr
+// by the dedicated thread using writev(). A full ring drops the message
+// instead of blocking the caller, the drops are reported by the writer.
+
+#define _RING_SIZE		256 // Must be a power of two
+#define _RECORD_SIZE	1024
+#define _BATCH_SIZE		64
+
+typedef struct {
+	atomic_size_t	seq;
+	size_t			size;
+	char			text[_RECORD_SIZE];
+} _record_s;
+
+
 log_level_e log_level;
-pthread_mutex_t log_mutex;
+unsigned log_rate;
+unsigned log_burst;
+bool log_structured;
+
+static _record_s		_g_ring[_RING_SIZE];
+static atomic_size_t	_g_tail;
+static size_t			_g_head;
+static atomic_ulong		_g_dropped;
+static sem_t			_g_sem;
+static atomic_bool		_g_stop;
+static pthread_t		_g_tid;
+static atomic_bool		_g_started = false;
+static bool				_g_broken = false; // Writer thread only
+
+
+static bool _check_limit(log_limit_s *limit, unsigned *suppressed);
+static _record_s *_reserve(size_t *pos);
+static void _publish(_record_s *record, size_t pos, size_t size);
+static void *_writer_thread(UNUSED void *arg);
+static void _flush(void);
+static void _write_all(struct iovec *iov, unsigned count);
+static size_t _format_header(char *text, const char *label, const char *cls);
+static size_t _format_structured(char *text, const char *label, const char *cls, const char *msg, unsigned suppressed);
+static size_t _append(char *dest, size_t offset, const char *src);
+static size_t _append_escaped(char *dest, size_t offset, const char *src);
+static size_t _append_uint(char *dest, size_t offset, unsigned long long value, unsigned min_digits);
+
+
+void log_init(void) {
+	for (size_t index = 0; index < _RING_SIZE; ++index) {
+		atomic_init(&_g_ring[index].seq, index);
+	}
+	atomic_init(&_g_tail, 0);
+	_g_head = 0;
+	atomic_init(&_g_dropped, 0);
+	atomic_init(&_g_stop, false);
+	assert(!sem_init(&_g_sem, 0, 0));
+	A_THREAD_CREATE(&_g_tid, _writer_thread, NULL);
+	atomic_store(&_g_started, true);
+}
+
+void log_destroy(void) {
+	if (atomic_load(&_g_started)) {
+		atomic_store(&_g_stop, true);
+		assert(!sem_post(&_g_sem));
+		A_THREAD_JOIN(_g_tid);
+		assert(!sem_destroy(&_g_sem));
+		atomic_store(&_g_started, false);
+	}
+}
+
+void log_printf(log_limit_s *limit, const char *label, const char *cls, const char *fmt, ...) {
+	unsigned suppressed = 0;
+	if (!_check_limit(limit, &suppressed)) {
+		return;
+	}
+
+	size_t pos;
+	_record_s *const record = _reserve(&pos);
+	if (record == NULL) {
+		return;
+	}
+
+	// Keep the last byte for the newline
+	const size_t max = _RECORD_SIZE - 1;
+	size_t size;
+	va_list args;
+	va_start(args, fmt);
+	if (log_structured) {
+		char msg[_RECORD_SIZE];
+		vsnprintf(msg, _RECORD_SIZE, fmt, args);
+		size = _format_structured(record->text, label, cls, msg, suppressed);
+	} else {
+		size = _format_header(record->text, label, cls);
+		const int msg_size = vsnprintf(record->text + size, max - size, fmt, args);
+		if (msg_size > 0) {
+			size += msg_size;
+		}
+		if (size >= max) {
+			size = max - 1;
+		}
+		if (suppressed > 0) {
+			size += snprintf(record->text + size, max - size, " [suppressed %u messages]", suppressed);
+			if (size >= max) {
+				size = max - 1;
+			}
+		}
+	}
+	va_end(args);
+	record->text[size] = '\n';
+
+	_publish(record, pos, size + 1);
+}
+
+void log_write_signal_safe(const char *label, const char *cls, const char *msg) {
+	size_t pos;
+	_record_s *const record = _reserve(&pos);
+	if (record == NULL) {
+		return;
+	}
+
+	// No stdio here, only async-signal-safe calls
+	size_t size = _format_header(record->text, label, cls);
+	size = _append(record->text, size, msg);
+	record->text[size] = '\n';
+
+	_publish(record, pos, size + 1);
+}
+
+static bool _check_limit(log_limit_s *limit, unsigned *suppressed) {
+	const unsigned rate = log_rate;
+	if (rate == 0) {
+		return true;
+	}
+
+	// No spinning: the RT threads pinned to the same CPU as a preempted
+	// lower-priority caller would wait for it forever. A failed CAS means
+	// that another caller has just updated the state, so it's retried
+	// with the fresh value, and the loop is bounded by the number of the callers.
+	const int64_t interval_ns = 60 * NS_PER_SEC / rate;
+	const int64_t tolerance_ns = (int64_t)((log_burst > 0 ? log_burst : 1) - 1) * interval_ns;
+	const int64_t now_ns = get_now_monotonic_ns();
+
+	int64_t tat_ns = atomic_load_explicit(&limit->tat_ns, memory_order_relaxed);
+	while (true) {
+		const int64_t base_ns = (tat_ns > now_ns ? tat_ns : now_ns);
+		if (base_ns - now_ns > tolerance_ns) {
+			atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+			return false;
+		}
+		if (atomic_compare_exchange_weak_explicit(
+			&limit->tat_ns, &tat_ns, base_ns + interval_ns,
+			memory_order_relaxed, memory_order_relaxed
+		)) {
+			break;
+		}
+	}
+	*suppressed = atomic_exchange_explicit(&limit->suppressed, 0, memory_order_relaxed);
+	return true;
+}
+
+static _record_s *_reserve(size_t *pos) {
+	if (!atomic_load_explicit(&_g_started, memory_order_relaxed)) {
+		return NULL;
+	}
+	size_t tail = atomic_load_explicit(&_g_tail, memory_order_relaxed);
+	while (true) {
+		_record_s *const record = &_g_ring[tail & (_RING_SIZE - 1)];
+		const size_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+		const intptr_t diff = (intptr_t)seq - (intptr_t)tail;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&_g_tail, &tail, tail + 1, memory_order_relaxed, memory_order_relaxed)) {
+				*pos = tail;
+				return record;
+			}
+		} else if (diff < 0) {
+			atomic_fetch_add_explicit(&_g_dropped, 1, memory_order_relaxed);
+			return NULL;
+		} else {
+			tail = atomic_load_explicit(&_g_tail, memory_order_relaxed);
+		}
+	}
+}
+
+static void _publish(_record_s *record, size_t pos, size_t size) {
+	record->size = size;
+	atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+	sem_post(&_g_sem);
+}
+
+static void *_writer_thread(UNUSED void *arg) {
+	thread_set_name("fan-log");
+
+	// SIGPIPE from writev() would be delivered right here, and the handler
+	// logs a message which causes another SIGPIPE. Report it to the process once.
+	sigset_t mask;
+	assert(!sigemptyset(&mask));
+	assert(!sigaddset(&mask, SIGPIPE));
+	assert(!pthread_sigmask(SIG_BLOCK, &mask, NULL));
+
+	while (true) {
+		while (sem_wait(&_g_sem) < 0 && errno == EINTR);
+		_flush();
+		if (atomic_load(&_g_stop)) {
+			_flush(); // Catch the last ones
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void _flush(void) {
+	while (true) {
+		struct iovec iov[_BATCH_SIZE + 1];
+		unsigned count = 0;
+
+		char dropped_buf[128];
+		const unsigned long dropped = atomic_exchange(&_g_dropped, 0);
+		if (dropped > 0) {
+			iov[count].iov_base = dropped_buf;
+			iov[count].iov_len = snprintf(dropped_buf, sizeof(dropped_buf),
+				"-- ERROR [%.03Lf   logging] -- Dropped %lu messages, the log is overloaded\n",
+				get_now_monotonic(), dropped);
+			++count;
+		}
+
+		size_t head = _g_head;
+		for (; count < _BATCH_SIZE + 1; ++head) {
+			_record_s *const record = &_g_ring[head & (_RING_SIZE - 1)];
+			if (atomic_load_explicit(&record->seq, memory_order_acquire) != head + 1) {
+				break;
+			}
+			iov[count].iov_base = record->text;
+			iov[count].iov_len = record->size;
+			++count;
+		}
+
+		if (count == 0) {
+			return;
+		}
+		_write_all(iov, count);
+
+		for (; _g_head < head; ++_g_head) {
+			atomic_store_explicit(&_g_ring[_g_head & (_RING_SIZE - 1)].seq, _g_head + _RING_SIZE, memory_order_release);
+		}
+	}
+}
+
+static void _write_all(struct iovec *iov, unsigned count) {
+	// A pipe or the journald socket can take a part of the batch under load,
+	// the records are released only after the whole batch is written.
+	while (count > 0 && !_g_broken) {
+		const ssize_t written = writev(STDERR_FILENO, iov, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// The inherited stderr can be non-blocking
+				struct pollfd pfd = {.fd = STDERR_FILENO, .events = POLLOUT};
+				poll(&pfd, 1, 1000);
+				continue;
+			}
+			if (errno == EPIPE) {
+				// Nowhere to report, drop this and all further batches
+				_g_broken = true;
+				kill(getpid(), SIGPIPE);
+			}
+			return; // The other errors lose just this batch
+		}
+		size_t left = written;
+		while (count > 0 && left >= iov->iov_len) {
+			left -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + left;
+			iov->iov_len -= left;
+		}
+	}
+}
+
+static size_t _format_header(char *text, const char *label, const char *cls) {
+	// "-- <label> [<sec>.<msec> <class>] -- ", no printf() for the hot path
+	const unsigned long long msec = get_now_monotonic_ns() / NS_PER_MS;
+	size_t size = 0;
+	size = _append(text, size, "-- ");
+	size = _append(text, size, label);
+	size = _append(text, size, " [");
+	size = _append_uint(text, size, msec / 1000, 1);
+	size = _append(text, size, ".");
+	size = _append_uint(text, size, msec % 1000, 3);
+	size = _append(text, size, " ");
+	for (size_t len = strlen(cls); len < 9 && size < _RECORD_SIZE - 2; ++len) {
+		text[size++] = ' ';
+	}
+	size = _append(text, size, cls);
+	size = _append(text, size, "] -- ");
+	return size;
+}
+
+static size_t _format_structured(char *text, const char *label, const char *cls, const char *msg, unsigned suppressed) {
+	// ts=<sec>.<msec> level=<label> class=<class> msg="<escaped>" [suppressed=<N>]
+	const unsigned long long msec = get_now_monotonic_ns() / NS_PER_MS;
+	size_t size = 0;
+	size = _append(text, size, "ts=");
+	size = _append_uint(text, size, msec / 1000, 1);
+	size = _append(text, size, ".");
+	size = _append_uint(text, size, msec % 1000, 3);
+	size = _append(text, size, " level=");
+	for (; *label != '\0' && *label != ' '; ++label) {
+		text[size++] = *label;
+	}
+	size = _append(text, size, " class=");
+	size = _append(text, size, cls);
+	size = _append(text, size, " msg=\"");
+	size = _append_escaped(text, size, msg);
+	size = _append(text, size, "\"");
+	if (suppressed > 0) {
+		size = _append(text, size, " suppressed=");
+		size = _append_uint(text, size, suppressed, 1);
+	}
+	return size;
+}
+
+static size_t _append(char *dest, size_t offset, const char *src) {
+	for (; *src != '\0' && offset < _RECORD_SIZE - 2; ++src, ++offset) {
+		dest[offset] = *src;
+	}
+	return offset;
+}
+
+static size_t _append_escaped(char *dest, size_t offset, const char *src) {
+	for (; *src != '\0' && offset < _RECORD_SIZE - 32; ++src) {
+		switch (*src) {
+			case '"':	offset = _append(dest, offset, "\\\""); break;
+			case '\\':	offset = _append(dest, offset, "\\\\"); break;
+			case '\n':	offset = _append(dest, offset, "\\n"); break;
+			default:	dest[offset++] = *src;
+		}
+	}
+	return offset;
+}
+
+static size_t _append_uint(char *dest, size_t offset, unsigned long long value, unsigned min_digits) {
+	char buf[24];
+	unsigned digits = 0;
+	do {
+		buf[digits++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0 || digits < min_digits);
+	while (digits > 0 && offset < _RECORD_SIZE - 2) {
+		dest[offset++] = buf[--digits];
+	}
+	return offset;
+}
@@ -23,9 +23,20 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
+
+#include <sys/uio.h>
 
 #include <pthread.h>
+#include <semaphore.h>
 
 #include "tools.h"
 
@@ -37,30 +48,35 @@ typedef enum {
 } log_level_e;
 
 
-extern log_level_e log_level;
+// The token bucket as GCRA: the only state is the theoretical arrival time
+// of the next message, so it's updated by CAS without any lock.
+typedef struct {
+	atomic_int_least64_t	tat_ns; // Zero for a fresh call site
+	atomic_uint				suppressed;
+} log_limit_s;
 
-extern pthread_mutex_t log_mutex;
+
+extern log_level_e log_level;
+extern unsigned log_rate; // Messages per minute per call site, 0 for unlimited
+extern unsigned log_burst;
+extern bool log_structured;
 
 
 #define LOGGING_INIT { \
 		log_level = LOG_LEVEL_INFO; \
-		A_MUTEX_INIT(&log_mutex); \
+		log_rate = 0; \
+		log_burst = 10; \
+		log_structured = false; \
+		log_init(); \
 	}
 
-#define LOGGING_DESTROY A_MUTEX_DESTROY(&log_mutex)
+#define LOGGING_DESTROY log_destroy()
 
 
-#define LOG_PRINTF_NOLOCK(_label, _class, _msg, ...) { \
-		fprintf(stderr, "-- " _label " [%.03Lf %9s] -- " _msg, \
-			get_now_monotonic(), _class, ##__VA_ARGS__); \
-		fputc('\n', stderr); \
-		fflush(stderr); \
-	}
-
+// Each call site has its own rate limiter
 #define LOG_PRINTF(_label, _class, _msg, ...) { \
-		A_MUTEX_LOCK(&log_mutex); \
-		LOG_PRINTF_NOLOCK(_label, _class, _msg, ##__VA_ARGS__); \
-		A_MUTEX_UNLOCK(&log_mutex); \
+		static log_limit_s _log_limit; \
+		log_printf(&_log_limit, _label, _class, _msg, ##__VA_ARGS__); \
 	}
 
 #define LOG_ERROR(_class, _msg, ...) { \
@@ -77,8 +93,9 @@ extern pthread_mutex_t log_mutex;
 		LOG_PRINTF("INFO ", _class, _msg, ##__VA_ARGS__); \
 	}
 
-#define LOG_INFO_NOLOCK(_class, _msg, ...) { \
-		LOG_PRINTF_NOLOCK("INFO ", _class, _msg, ##__VA_ARGS__); \
+// Only constant messages, can be used from the signal handlers
+#define LOG_INFO_SIGNAL(_class, _msg) { \
+		log_write_signal_safe("INFO ", _class, _msg); \
 	}
 
 #define LOG_VERBOSE(_class, _msg, ...) { \
@@ -92,3 +109,10 @@ extern pthread_mutex_t log_mutex;
 			LOG_PRINTF("DEBUG", _class, _msg, ##__VA_ARGS__); \
 		} \
 	}
+
+
+void log_init(void);
+void log_destroy(void);
+
+void log_printf(log_limit_s *limit, const char *label, const char *cls, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+void log_write_signal_safe(const char *label, const char *cls, const char *msg);
@@ -24,6 +24,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
 #include <limits.h>
 #include <unistd.h>
 #include <signal.h>
@@ -37,9 +39,26 @@
 
 #include "const.h"
 #include "logging.h"
+#include "state.h"
 #include "temp.h"
+#include "throttle.h"
+#include "thermal.h"
+#include "usage.h"
 #include "fan.h"
+#include "history.h"
+#include "journal.h"
+#include "handover.h"
+#include "export.h"
+#include "override.h"
+#include "ctl.h"
 #include "server.h"
+#include "systemd.h"
+#include "stats.h"
+#include "rt.h"
+#include "sim.h"
+#include "control.h"
+#include "profile.h"
+#include "rules.h"
 
 
 enum _OPT_VALUES {
@@ -58,8 +77,17 @@ enum _OPT_VALUES {
 	_O_HALL_BIAS,
 
 	_O_TEMP_HYST,
+	_O_TEMP_RISE,
+	_O_TEMP_FALL,
 	_O_TEMP_LOW,
 	_O_TEMP_HIGH,
+	_O_TEMP_SENSORS,
+	_O_TEMP_HOLD,
+	_O_TEMP_FAIL_SPEED,
+
+	_O_THROTTLE_PATH,
+	_O_THROTTLE_CPUFREQ,
+	_O_THROTTLE_SPEED,
 
 	_O_SPEED_IDLE,
 	_O_SPEED_LOW,
@@ -67,13 +95,46 @@ enum _OPT_VALUES {
 	_O_SPEED_HEAT,
 	_O_SPEED_SPIN_UP,
 	_O_SPEED_CONST,
+	_O_SPEED_DWELL,
+	_O_SPEED_CHANGES,
+	_O_PROFILE,
 
 	_O_UNIX,
 	_O_UNIX_RM,
 	_O_UNIX_MODE,
 
+	_O_JOURNAL,
+	_O_JOURNAL_SIZE,
+
+	_O_HANDOVER,
+	_O_HANDOVER_TTL,
+
+	_O_USAGE,
+
+	_O_SHM,
+	_O_SHM_MODE,
+
+	_O_CTL,
+	_O_CTL_RM,
+	_O_CTL_MODE,
+
+	_O_RT_POLICY,
+	_O_RT_PRIO,
+	_O_RT_CPU,
+	_O_MLOCK,
+
+	_O_SIM,
+	_O_SIM_SPEED,
+	_O_SIM_DURATION,
+	_O_SIM_AMBIENT,
+	_O_SIM_LOAD,
+	_O_SIM_STALL,
+
 	_O_VERBOSE,
 	_O_DEBUG,
+	_O_LOG_RATE,
+	_O_LOG_BURST,
+	_O_LOG_STRUCTURED,
 };
 
 
@@ -87,8 +148,16 @@ static const struct option _LONG_OPTS[] = {
 	{"hall-bias",		required_argument,	NULL,	_O_HALL_BIAS},
 
 	{"temp-hyst",		required_argument,	NULL,	_O_TEMP_HYST},
+	{"temp-rise",		required_argument,	NULL,	_O_TEMP_RISE},
+	{"temp-fall",		required_argument,	NULL,	_O_TEMP_FALL},
 	{"temp-low",		required_argument,	NULL,	_O_TEMP_LOW},
 	{"temp-high",		required_argument,	NULL,	_O_TEMP_HIGH},
+	{"temp-sensors",	required_argument,	NULL,	_O_TEMP_SENSORS},
+	{"temp-hold",		required_argument,	NULL,	_O_TEMP_HOLD},
+	{"temp-fail-speed",	required_argument,	NULL,	_O_TEMP_FAIL_SPEED},
+	{"throttle-path",	required_argument,	NULL,	_O_THROTTLE_PATH},
+	{"throttle-cpufreq",	required_argument,	NULL,	_O_THROTTLE_CPUFREQ},
+	{"throttle-speed",	required_argument,	NULL,	_O_THROTTLE_SPEED},
 
 	{"speed-idle",		required_argument,	NULL,	_O_SPEED_IDLE},
 	{"speed-low",		required_argument,	NULL,	_O_SPEED_LOW},
@@ -96,15 +165,47 @@ static const struct option _LONG_OPTS[] = {
 	{"speed-heat",		required_argument,	NULL,	_O_SPEED_HEAT},
 	{"speed-spin-up",	required_argument,	NULL,	_O_SPEED_SPIN_UP},
 	{"speed-const",		required_argument,	NULL,	_O_SPEED_CONST},
+	{"speed-dwell",		required_argument,	NULL,	_O_SPEED_DWELL},
+	{"speed-changes",	required_argument,	NULL,	_O_SPEED_CHANGES},
+	{"profile",			required_argument,	NULL,	_O_PROFILE},
 
 	{"unix",			required_argument,	NULL,	_O_UNIX},
 	{"unix-rm",			no_argument,		NULL,	_O_UNIX_RM},
 	{"unix-mode",		required_argument,	NULL,	_O_UNIX_MODE},
 
+	{"journal",			required_argument,	NULL,	_O_JOURNAL},
+	{"journal-size",	required_argument,	NULL,	_O_JOURNAL_SIZE},
+
+	{"handover",		required_argument,	NULL,	_O_HANDOVER},
+	{"handover-ttl",	required_argument,	NULL,	_O_HANDOVER_TTL},
+	{"usage",			required_argument,	NULL,	_O_USAGE},
+
+	{"shm",				required_argument,	NULL,	_O_SHM},
+	{"shm-mode",		required_argument,	NULL,	_O_SHM_MODE},
+
+	{"ctl",				required_argument,	NULL,	_O_CTL},
+	{"ctl-rm",			no_argument,		NULL,	_O_CTL_RM},
+	{"ctl-mode",		required_argument,	NULL,	_O_CTL_MODE},
+
+	{"rt-policy",		required_argument,	NULL,	_O_RT_POLICY},
+	{"rt-prio",			required_argument,	NULL,	_O_RT_PRIO},
+	{"rt-cpu",			required_argument,	NULL,	_O_RT_CPU},
+	{"mlock",			no_argument,		NULL,	_O_MLOCK},
+
+	{"sim",				no_argument,		NULL,	_O_SIM},
+	{"sim-speed",		required_argument,	NULL,	_O_SIM_SPEED},
+	{"sim-duration",	required_argument,	NULL,	_O_SIM_DURATION},
+	{"sim-ambient",		required_argument,	NULL,	_O_SIM_AMBIENT},
+	{"sim-load",		required_argument,	NULL,	_O_SIM_LOAD},
+	{"sim-stall",		required_argument,	NULL,	_O_SIM_STALL},
+
 	{"interval",		required_argument,	NULL,	_O_INTERVAL},
 
 	{"verbose",			no_argument,		NULL,	_O_VERBOSE},
 	{"debug",			no_argument,		NULL,	_O_DEBUG},
+	{"log-rate",		required_argument,	NULL,	_O_LOG_RATE},
+	{"log-burst",		required_argument,	NULL,	_O_LOG_BURST},
+	{"log-structured",	no_argument,		NULL,	_O_LOG_STRUCTURED},
 
 	{"help",			no_argument,		NULL,	_O_HELP},
 	{"version",			no_argument,		NULL,	_O_VERSION},
@@ -120,163 +221,481 @@ static const struct option _LONG_OPTS[] = {
 	{NULL, 0, NULL, 0},
 };
 
-static atomic_bool _g_stop = false;
-static fan_s *_g_fan = NULL;
-static server_s *_g_server = NULL;
+typedef struct {
+	int				pwm_pin;
+	int				pwm_low;
+	int				pwm_high;
+	int				pwm_soft;
+	int				hall_pin;
+	fan_bias_e		hall_bias;
 
-static int _g_pwm_pin = 12;
-static int _g_pwm_low = 0;
-static int _g_pwm_high = 1024;
-static int _g_pwm_soft = 0;
-static int _g_hall_pin = -1;
-static fan_bias_e _g_hall_bias = FAN_BIAS_DISABLED;
+	float			temp_hyst;
+	float			temp_rise; // NAN for temp_hyst
+	float			temp_fall; // NAN for temp_hyst
+	float			temp_low;
+	float			temp_high;
+	char			*temp_sensors; // Comma-separated, the first one is primary
+	int				temp_hold;
+	float			temp_fail_speed;
 
-static float _g_temp_hyst = 3;
-static float _g_temp_low = 45;
-static float _g_temp_high = 75;
+	char			*throttle_path; // "" to disable
+	char			*throttle_cpufreq; // "" to disable
+	float			throttle_speed; // 0 for the monitoring only
 
-static float _g_speed_idle = 25;
-static float _g_speed_low = 25;
-static float _g_speed_high = 75;
-static float _g_speed_heat = 100;
-static float _g_speed_spin_up = 75;
-static float _g_speed_const = -1;
+	float			speed_idle;
+	float			speed_low;
+	float			speed_high;
+	float			speed_heat;
+	float			speed_spin_up;
+	float			speed_const;
+	int				speed_dwell;
+	int				speed_changes;
 
-static float _g_interval = 1;
+	char			*profile; // Initially active profile, "" or "default" for the base params
+	profile_s		profiles[PROFILE_MAX];
+	unsigned		profiles_count;
+	rules_s			rules;
 
-static char *_g_unix_path = NULL;
-static bool _g_unix_rm = false;
-static mode_t _g_unix_mode = 0;
+	float			interval;
 
+	char			*unix_path;
+	bool			unix_rm;
+	mode_t			unix_mode;
 
-static int _load_ini(const char *path);
+	char			*journal_path;
+	int				journal_size;
 
-static void _signal_handler(int signum);
-static void _install_signal_handlers(void);
+	char			*handover_path;
+	int				handover_ttl;
 
-static void _stoppable_sleep(unsigned delay);
+	char			*usage_path;
 
-static int _loop(void);
-static void _help(void);
+	char			*shm_name;
+	mode_t			shm_mode;
 
+	char			*ctl_path;
+	bool			ctl_rm;
+	mode_t			ctl_mode;
 
-int main(int argc, char *argv[]) {
-	int retval = 0;
-	LOGGING_INIT;
-	assert(_g_unix_path = strdup(""));
+	rt_s			rt;
+	bool			mlock;
 
-#define OPT_NUMBER_BASE(_name, _dest, _min, _max, _base) { \
-			errno = 0; char *_end = NULL; int _tmp = strtol(optarg, &_end, _base); \
-			if (errno || *_end || _tmp < _min || _tmp > _max) { \
-				printf("Invalid value for '%s=%s': min=%d, max=%d\n", _name, optarg, (int)_min, (int)_max); \
-				goto error; \
-			} \
-			_dest = _tmp; \
-			break; \
-		}
+	bool			sim_enabled;
+	sim_params_s	sim_params;
+	int				sim_duration;
 
-#	define OPT_NUMBER(_name, _dest, _min, _max) OPT_NUMBER_BASE(_name, _dest, _min, _max, 0)
+	log_level_e		log_level;
+	unsigned		log_rate;
+	unsigned		log_burst;
+	bool			log_structured;
+} _config_s;
 
-	for (int ch; (ch = getopt_long(argc, argv, _SHORT_OPTS, _LONG_OPTS, NULL)) >= 0;) {
-		switch (ch) {
-			case _O_PWM_PIN:		OPT_NUMBER("--pwm-pin",			_g_pwm_pin,			0, 256);
-			case _O_PWM_LOW:		OPT_NUMBER("--pwm-low",			_g_pwm_low,			0, 1024);
-			case _O_PWM_HIGH:		OPT_NUMBER("--pwm-high",		_g_pwm_high,		1, 1024);
-			case _O_PWM_SOFT:		OPT_NUMBER("--pwm-soft",		_g_pwm_soft,		50, 100);
-			case _O_HALL_PIN:		OPT_NUMBER("--hall-pin",		_g_hall_pin,		-1, 256);
-			case _O_HALL_BIAS:		OPT_NUMBER("--hall-bias",		_g_hall_bias,		FAN_BIAS_DISABLED, FAN_BIAS_PULL_UP);
 
-			case _O_TEMP_HYST:		OPT_NUMBER("--temp-hyst",		_g_temp_hyst,		1, 5);
-			case _O_TEMP_LOW:		OPT_NUMBER("--temp-low",		_g_temp_low,		0, 85);
-			case _O_TEMP_HIGH:		OPT_NUMBER("--temp-high",		_g_temp_high,		0, 85);
+static atomic_bool _g_stop = false;
+static atomic_bool _g_reload = false;
+static fan_s *_g_fan = NULL;
+static history_s *_g_history = NULL;
+static journal_s *_g_journal = NULL;
+static export_s *_g_export = NULL;
+static override_s _g_override;
+static profiles_s _g_profiles;
+static ctl_s *_g_ctl = NULL;
+static server_s *_g_server = NULL;
+static sim_s *_g_sim = NULL;
+static temp_s *_g_temp = NULL;
+static throttle_s *_g_throttle = NULL;
+static thermal_s *_g_thermal = NULL;
+static usage_s *_g_usage = NULL;
+
+static int _g_argc = 0;
+static char **_g_argv = NULL;
+static _config_s _g_config;
+static unsigned _g_config_gen = 1;
+static int64_t _g_start_ns = 0; // Real monotonic, for the startup timings
+static int64_t _g_first_pwm_ns = 0;
+
+
+static void _config_init(_config_s *config);
+static void _config_destroy(_config_s *config);
+static void _config_init(_config_s *config) {
+	*config = (_config_s){
+		.pwm_pin = 12,
+		.pwm_low = 0,
+		.pwm_high = 1024,
+		.pwm_soft = 0,
+		.hall_pin = -1,
+		.hall_bias = FAN_BIAS_DISABLED,
+
+		.temp_hyst = 3,
+		.temp_rise = NAN,
+		.temp_fall = NAN,
+		.temp_low = 45,
+		.temp_high = 75,
+		.temp_hold = 10,
+		.temp_fail_speed = 100,
+
+		.throttle_speed = 100,
+
+		.speed_idle = 25,
+		.speed_low = 25,
+		.speed_high = 75,
+		.speed_heat = 100,
+		.speed_spin_up = 75,
+		.speed_const = -1,
+
+		.interval = 1,
+
+		.journal_size = 65536,
+		.handover_ttl = 30,
+		.shm_mode = 0644,
+
+		.rt = {.policy = SCHED_FIFO, .prio = 0, .cpu = -1},
+
+		.log_level = LOG_LEVEL_INFO,
+		.log_rate = 0,
+		.log_burst = 10,
+	};
+	assert(config->temp_sensors = strdup(TEMP_DEFAULT_SENSOR));
+	assert(config->throttle_path = strdup(THROTTLE_DEFAULT_PATH));
+	assert(config->throttle_cpufreq = strdup(THROTTLE_DEFAULT_CPUFREQ));
+	assert(config->unix_path = strdup(""));
+	assert(config->journal_path = strdup(""));
+	assert(config->handover_path = strdup(""));
+	assert(config->usage_path = strdup(""));
+	assert(config->shm_name = strdup(""));
+	assert(config->ctl_path = strdup(""));
+	assert(config->profile = strdup(""));
+	sim_params_init(&config->sim_params);
+}
 
-			case _O_SPEED_IDLE:		OPT_NUMBER("--speed-idle",		_g_speed_idle,		0, 100);
-			case _O_SPEED_LOW:		OPT_NUMBER("--speed-low",		_g_speed_low,		0, 100);
-			case _O_SPEED_HIGH:		OPT_NUMBER("--speed-high",		_g_speed_high,		0, 100);
-			case _O_SPEED_HEAT:		OPT_NUMBER("--speed-heat",		_g_speed_heat,		0, 100);
-			case _O_SPEED_SPIN_UP:	OPT_NUMBER("--speed-spin-up",	_g_speed_spin_up,	0, 100);
-			case _O_SPEED_CONST:	OPT_NUMBER("--speed-const",		_g_speed_const,		-1, 100);
+static void _config_destroy(_config_s *config) {
+	free(config->profile);
+	free(config->ctl_path);
+	free(config->shm_name);
+	free(config->usage_path);
+	free(config->handover_path);
+	free(config->journal_path);
+	free(config->unix_path);
+	free(config->throttle_cpufreq);
+	free(config->throttle_path);
+	free(config->temp_sensors);
+}
 
-			case _O_UNIX:			free(_g_unix_path); assert(_g_unix_path = strdup(optarg)); break;
-			case _O_UNIX_RM:		_g_unix_rm = true; break;
-			case _O_UNIX_MODE:		OPT_NUMBER_BASE("--unix-mode",	_g_unix_mode, INT_MIN, INT_MAX, 8);
+static int _parse_options(int argc, char *argv[], _config_s *config);
+static int _load_ini(_config_s *config, const char *path);
+static int _check_config(_config_s *config);
+static void _apply_logging(const _config_s *config);
+static void _reload(void);
 
-			case _O_INTERVAL:		OPT_NUMBER("--interval",		_g_interval,		1, 10);
+static void _signal_handler(int signum);
+static void _install_signal_handlers(void);
 
-			case _O_CONFIG: 		if (_load_ini(optarg) < 0) { goto error; } break;
+static int _load_ini_profile(_config_s *config, dictionary *ini, const char *path, const char *section);
+static int _load_ini_rule(_config_s *config, dictionary *ini, const char *path, const char *section);
+static control_params_s _get_control_params(const _config_s *config);
+static unsigned _get_events(void);
+static int64_t _now_ns(void);
+static void _stoppable_sleep(unsigned delay);
+static void _stoppable_sleep_until(int64_t deadline_ns, const unsigned *events);
 
-			case _O_VERBOSE:		log_level = LOG_LEVEL_VERBOSE; break;
-			case _O_DEBUG:			log_level = LOG_LEVEL_DEBUG; break;
+static void _loop(const handover_s *handover);
+static void _help(void);
 
-			case _O_HELP:			_help(); goto ok;
-			case _O_VERSION:		puts(VERSION); goto ok;
 
-			case 0: break;
-			default: goto error;
-		}
+int main(int argc, char *argv[]) {
+	_g_start_ns = get_now_monotonic_ns();
+	int retval = 0;
+	LOGGING_INIT;
+#	ifdef WITH_STATS
+	stats_init();
+#	endif
+	override_init(&_g_override);
+	profiles_init(&_g_profiles);
+	_config_init(&_g_config);
+	_g_argc = argc;
+	_g_argv = argv;
+
+	switch (_parse_options(argc, argv, &_g_config)) {
+		case 0: break;
+		case 1: goto ok; // --help or --version
+		default: goto error;
+	}
+	_apply_logging(&_g_config);
+	if (_check_config(&_g_config) < 0) {
+		goto error;
 	}
+	profiles_set(&_g_profiles, _g_config.profiles, _g_config.profiles_count, _g_config.profile);
 
-#	undef OPT_NUMBER
-#	undef OPT_NUMBER_BASE
+	_install_signal_handlers();
 
-	if (_g_pwm_low >= _g_pwm_high) {
-		puts("Invalid PWM config, chould be: low < high");
-		goto error;
+	if (_g_config.sim_enabled) {
+		const sim_params_s *const params = &_g_config.sim_params;
+		_g_sim = sim_init(params);
+		LOG_INFO("sim", "Using the simulated plant: ambient=%.1f°C, R=%.1f...%.1f°C/W, tau=%.0fs; fan: max=%.0frpm, tau=%.1fs",
+			params->ambient, params->r_passive, params->r_active, params->thermal_tau, params->rpm_max, params->fan_tau);
+		if (params->speedup > 0) {
+			LOG_INFO("sim", "Running %.0fx faster than real time", params->speedup);
+		} else {
+			LOG_INFO("sim", "Running as fast as possible");
+		}
 	}
 
-	if (!(
-		0 <= _g_temp_hyst
-		&& _g_temp_hyst < _g_temp_low
-		&& _g_temp_low < _g_temp_high
-		&& _g_temp_high <= 85
-	)) {
-		puts("Invalid temp-* config, should be: 0 <= hyst < low < high <= 85");
+	// The fan is driven as early as possible: before the Hall sensor, the journal recovery
+	// and the servers. It's the saved state from the previous run or the spin-up speed
+	// which is safe enough until the first loop iteration.
+	if ((_g_fan = fan_init(_g_config.pwm_pin, _g_config.pwm_low, _g_config.pwm_high, _g_config.pwm_soft, _g_sim)) == NULL) {
 		goto error;
 	}
+	handover_s handover;
+	const bool resume = (_g_config.handover_path[0] != '\0' && handover_load(_g_config.handover_path, _g_config.handover_ttl, &handover) == 0);
+	{
+		const float speed = (resume ? handover.speed : _g_config.speed_spin_up);
+		const unsigned pwm = fan_set_speed_percent(_g_fan, speed);
+		_g_first_pwm_ns = get_now_monotonic_ns() - _g_start_ns;
+		LOG_INFO("main", "The first PWM write in %.2Lf ms: speed=%.2f%% (pwm=%u)",
+			ns_to_sec(_g_first_pwm_ns) * 1000, speed, pwm);
+	}
+
+	_g_usage = usage_init(_g_config.usage_path, _now_ns());
+	fan_set_usage(_g_fan, _g_usage);
 
-	if (!(
-		0 <= _g_speed_idle
-		&& _g_speed_idle <= _g_speed_low
-		&& _g_speed_low < _g_speed_high
-		&& _g_speed_high <= _g_speed_heat
-		&& _g_speed_heat <= 100
-	)) {
-		puts("Invalid speed-* config, should be: 0 <= idle <= low < high <= heat <= 100");
+	if (_g_config.hall_pin >= 0 && fan_start_hall(_g_fan, _g_config.hall_pin, _g_config.hall_bias) < 0) {
 		goto error;
 	}
 
-	_install_signal_handlers();
+	if (_g_sim == NULL) {
+		_g_temp = temp_init(_g_config.temp_sensors, _g_config.temp_hold);
+		_g_throttle = throttle_init(_g_config.throttle_path, _g_config.throttle_cpufreq);
+		_g_thermal = thermal_init();
+	}
 
-	if ((_g_fan = fan_init(_g_pwm_pin, _g_pwm_low, _g_pwm_high, _g_pwm_soft, _g_hall_pin, _g_hall_bias)) == NULL) {
-		goto error;
+	if (_g_config.unix_path[0] != '\0' || _g_config.ctl_path[0] != '\0') {
+		_g_history = history_init();
 	}
 
-	if (_g_unix_path[0] != '\0') {
-		if ((_g_server = server_init((_g_hall_pin >= 0), _g_unix_path, _g_unix_rm, _g_unix_mode)) == NULL) {
+	if (_g_config.journal_path[0] != '\0') {
+		if ((_g_journal = journal_init(_g_config.journal_path, _g_config.journal_size, _g_history)) == NULL) {
+			// The telemetry is not worth stopping the fan control
+			LOG_ERROR("main", "The journal is disabled until the next reload");
+			free(_g_config.journal_path);
+			assert(_g_config.journal_path = strdup(""));
+		}
+	}
+
+	if (_g_config.shm_name[0] != '\0') {
+		if ((_g_export = export_init(_g_config.shm_name, _g_config.shm_mode)) == NULL) {
 			goto error;
 		}
 	}
 
-	if (_loop() < 0) {
-		goto error;
+	if (_g_config.unix_path[0] != '\0') {
+		if ((_g_server = server_init((_g_config.hall_pin >= 0), _g_history, &_g_override, &_g_profiles, _g_usage, _g_config.unix_path, _g_config.unix_rm, _g_config.unix_mode)) == NULL) {
+			goto error;
+		}
 	}
 
+	if (_g_config.ctl_path[0] != '\0') {
+		if ((_g_ctl = ctl_init(_g_history, &_g_override, _g_config.ctl_path, _g_config.ctl_rm, _g_config.ctl_mode)) == NULL) {
+			goto error;
+		}
+	}
+
+	// After server_init() and ctl_init(), so the HTTP and control threads
+	// inherit the normal scheduling from the main thread.
+	if (_g_fan->hall_started) {
+		rt_apply(_g_fan->tid, "Hall", &_g_config.rt);
+	}
+	rt_apply(pthread_self(), "loop", &_g_config.rt);
+	if (_g_config.mlock) {
+		rt_lock_memory();
+	}
+
+	_loop(resume ? &handover : NULL);
+
 	goto ok;
 	error:
 		retval = 1;
 	ok:
+		if (_g_ctl) {
+			ctl_destroy(_g_ctl);
+		}
 		if (_g_server) {
 			server_destroy(_g_server);
 		}
+		if (_g_export) {
+			export_destroy(_g_export);
+		}
+		if (_g_journal) {
+			journal_destroy(_g_journal);
+		}
+		if (_g_history) {
+			history_destroy(_g_history);
+		}
+		if (_g_thermal) {
+			thermal_destroy(_g_thermal);
+		}
+		if (_g_throttle) {
+			throttle_destroy(_g_throttle);
+		}
+		if (_g_temp) {
+			temp_destroy(_g_temp);
+		}
 		if (_g_fan) {
 			fan_destroy(_g_fan);
 		}
-		free(_g_unix_path);
+		if (_g_usage) {
+			usage_destroy(_g_usage); // After the Hall thread
+		}
+		if (_g_sim) {
+			if (_g_sim->samples > 0) {
+				LOG_INFO("sim", "Simulated %.0Lf seconds: temp min=%.2f°C, avg=%.2Lf°C, max=%.2f°C; avg duty=%.2Lf%%, duty changes=%u",
+					ns_to_sec(_g_sim->now_ns - _g_sim->start_ns),
+					_g_sim->temp_min, _g_sim->temp_sum / _g_sim->samples, _g_sim->temp_max,
+					_g_sim->duty_sum / _g_sim->samples * 100, _g_sim->duty_changes);
+			}
+			sim_destroy(_g_sim);
+		}
+		_config_destroy(&_g_config);
+		profiles_destroy(&_g_profiles);
 		LOGGING_DESTROY;
 		return retval;
 }
 
-static int _load_ini(const char *path) {
+static int _parse_options(int argc, char *argv[], _config_s *config) {
+	int retval = 0;
+
+#define OPT_NUMBER_BASE(_name, _dest, _min, _max, _base) { \
+			errno = 0; char *_end = NULL; int _tmp = strtol(optarg, &_end, _base); \
+			if (errno || *_end || _tmp < _min || _tmp > _max) { \
+				printf("Invalid value for '%s=%s': min=%d, max=%d\n", _name, optarg, (int)_min, (int)_max); \
+				goto error; \
+			} \
+			_dest = _tmp; \
+			break; \
+		}
+
+#	define OPT_NUMBER(_name, _dest, _min, _max) OPT_NUMBER_BASE(_name, _dest, _min, _max, 0)
+
+#	define OPT_FLOAT(_name, _dest, _min, _max) { \
+			errno = 0; char *_end = NULL; const float _tmp = strtof(optarg, &_end); \
+			if (errno || *_end || _end == optarg || !(_tmp >= _min && _tmp <= _max)) { \
+				printf("Invalid value for '%s=%s': min=%d, max=%d\n", _name, optarg, (int)_min, (int)_max); \
+				goto error; \
+			} \
+			_dest = _tmp; \
+			break; \
+		}
+
+	optind = 0; // Full getopt reinitialization for the reload
+	for (int ch; (ch = getopt_long(argc, argv, _SHORT_OPTS, _LONG_OPTS, NULL)) >= 0;) {
+		switch (ch) {
+			case _O_PWM_PIN:		OPT_NUMBER("--pwm-pin",			config->pwm_pin,			0, 256);
+			case _O_PWM_LOW:		OPT_NUMBER("--pwm-low",			config->pwm_low,			0, 1024);
+			case _O_PWM_HIGH:		OPT_NUMBER("--pwm-high",		config->pwm_high,			1, 1024);
+			case _O_PWM_SOFT:		OPT_NUMBER("--pwm-soft",		config->pwm_soft,			50, 100);
+			case _O_HALL_PIN:		OPT_NUMBER("--hall-pin",		config->hall_pin,			-1, 256);
+			case _O_HALL_BIAS:		OPT_NUMBER("--hall-bias",		config->hall_bias,			FAN_BIAS_DISABLED, FAN_BIAS_PULL_UP);
+
+			case _O_TEMP_HYST:		OPT_FLOAT("--temp-hyst",		config->temp_hyst,			0, 20);
+			case _O_TEMP_RISE:		OPT_FLOAT("--temp-rise",		config->temp_rise,			0, 20);
+			case _O_TEMP_FALL:		OPT_FLOAT("--temp-fall",		config->temp_fall,			0, 20);
+			case _O_TEMP_LOW:		OPT_NUMBER("--temp-low",		config->temp_low,			0, 85);
+			case _O_TEMP_HIGH:		OPT_NUMBER("--temp-high",		config->temp_high,			0, 85);
+			case _O_TEMP_SENSORS:	free(config->temp_sensors); assert(config->temp_sensors = strdup(optarg)); break;
+			case _O_TEMP_HOLD:		OPT_NUMBER("--temp-hold",		config->temp_hold,			0, 3600);
+			case _O_TEMP_FAIL_SPEED:	OPT_NUMBER("--temp-fail-speed",	config->temp_fail_speed,	0, 100);
+
+			case _O_THROTTLE_PATH:		free(config->throttle_path); assert(config->throttle_path = strdup(optarg)); break;
+			case _O_THROTTLE_CPUFREQ:	free(config->throttle_cpufreq); assert(config->throttle_cpufreq = strdup(optarg)); break;
+			case _O_THROTTLE_SPEED:		OPT_NUMBER("--throttle-speed",	config->throttle_speed,		0, 100);
+
+			case _O_SPEED_IDLE:		OPT_NUMBER("--speed-idle",		config->speed_idle,			0, 100);
+			case _O_SPEED_LOW:		OPT_NUMBER("--speed-low",		config->speed_low,			0, 100);
+			case _O_SPEED_HIGH:		OPT_NUMBER("--speed-high",		config->speed_high,			0, 100);
+			case _O_SPEED_HEAT:		OPT_NUMBER("--speed-heat",		config->speed_heat,			0, 100);
+			case _O_SPEED_SPIN_UP:	OPT_NUMBER("--speed-spin-up",	config->speed_spin_up,		0, 100);
+			case _O_SPEED_CONST:	OPT_NUMBER("--speed-const",		config->speed_const,		-1, 100);
+			case _O_SPEED_DWELL:	OPT_NUMBER("--speed-dwell",		config->speed_dwell,		0, 3600);
+			case _O_SPEED_CHANGES:	OPT_NUMBER("--speed-changes",	config->speed_changes,		0, CONTROL_CHANGES_MAX);
+
+			case _O_PROFILE:		free(config->profile); assert(config->profile = strdup(optarg)); break;
+
+			case _O_UNIX:			free(config->unix_path); assert(config->unix_path = strdup(optarg)); break;
+			case _O_UNIX_RM:		config->unix_rm = true; break;
+			case _O_UNIX_MODE:		OPT_NUMBER_BASE("--unix-mode",	config->unix_mode, INT_MIN, INT_MAX, 8);
+
+			case _O_JOURNAL:		free(config->journal_path); assert(config->journal_path = strdup(optarg)); break;
+			case _O_JOURNAL_SIZE:	OPT_NUMBER("--journal-size",	config->journal_size,		60, 10000000);
+
+			case _O_HANDOVER:		free(config->handover_path); assert(config->handover_path = strdup(optarg)); break;
+			case _O_HANDOVER_TTL:	OPT_NUMBER("--handover-ttl",	config->handover_ttl,		1, 3600);
+
+			case _O_USAGE:			free(config->usage_path); assert(config->usage_path = strdup(optarg)); break;
+
+			case _O_SHM:			free(config->shm_name); assert(config->shm_name = strdup(optarg)); break;
+			case _O_SHM_MODE:		OPT_NUMBER_BASE("--shm-mode",	config->shm_mode, INT_MIN, INT_MAX, 8);
+
+			case _O_CTL:			free(config->ctl_path); assert(config->ctl_path = strdup(optarg)); break;
+			case _O_CTL_RM:			config->ctl_rm = true; break;
+			case _O_CTL_MODE:		OPT_NUMBER_BASE("--ctl-mode",	config->ctl_mode, INT_MIN, INT_MAX, 8);
+
+			case _O_RT_POLICY:
+				if ((config->rt.policy = rt_parse_policy(optarg)) < 0) {
+					printf("Invalid value for '--rt-policy=%s': should be fifo or rr\n", optarg);
+					goto error;
+				}
+				break;
+			case _O_RT_PRIO:		OPT_NUMBER("--rt-prio",			config->rt.prio,			0, 99);
+			case _O_RT_CPU:			OPT_NUMBER("--rt-cpu",			config->rt.cpu,				-1, 1023);
+			case _O_MLOCK:			config->mlock = true; break;
+
+			case _O_SIM:			config->sim_enabled = true; break;
+			case _O_SIM_SPEED:		OPT_NUMBER("--sim-speed",		config->sim_params.speedup,	0, 1000000);
+			case _O_SIM_DURATION:	OPT_NUMBER("--sim-duration",	config->sim_duration,		0, INT_MAX);
+			case _O_SIM_AMBIENT:	OPT_NUMBER("--sim-ambient",		config->sim_params.ambient,	-40, 85);
+			case _O_SIM_LOAD:
+				if (sim_parse_load(&config->sim_params, optarg) < 0) {
+					printf("Invalid value for '--sim-load=%s': should be <sec>:<watts>,...\n", optarg);
+					goto error;
+				}
+				break;
+			case _O_SIM_STALL:
+				if (sim_parse_stalls(&config->sim_params, optarg) < 0) {
+					printf("Invalid value for '--sim-stall=%s': should be <start_sec>:<sec>,...\n", optarg);
+					goto error;
+				}
+				break;
+
+			case _O_INTERVAL:		OPT_NUMBER("--interval",		config->interval,			1, 60);
+
+			case _O_CONFIG: 		if (_load_ini(config, optarg) < 0) { goto error; } break;
+
+			case _O_VERBOSE:		config->log_level = LOG_LEVEL_VERBOSE; break;
+			case _O_DEBUG:			config->log_level = LOG_LEVEL_DEBUG; break;
+			case _O_LOG_RATE:		OPT_NUMBER("--log-rate",		config->log_rate,			0, 60000);
+			case _O_LOG_BURST:		OPT_NUMBER("--log-burst",		config->log_burst,			1, 1000);
+			case _O_LOG_STRUCTURED:	config->log_structured = true; break;
+
+			case _O_HELP:			_help(); retval = 1; goto ok;
+			case _O_VERSION:		puts(VERSION); retval = 1; goto ok;
+
+			case 0: break;
+			default: goto error;
+		}
+	}
+
+#	undef OPT_FLOAT
+#	undef OPT_NUMBER
+#	undef OPT_NUMBER_BASE
+
+	goto ok;
+	error:
+		retval = -1;
+	ok:
+		return retval;
+}
+
+static int _load_ini(_config_s *config, const char *path) {
 	dictionary *ini = NULL;
 	int retval = 0;
 
@@ -306,33 +725,165 @@ static int _load_ini(const char *path) {
 			} \
 		}
 
-	MATCH("main",		"pwm_pin",		_g_pwm_pin,			0, 256,		0)
-	MATCH("main",		"pwm_low",		_g_pwm_low,			0, 1024,	0)
-	MATCH("main",		"pwm_high",		_g_pwm_high,		1, 1024,	0)
-	MATCH("main",		"pwm_soft",		_g_pwm_soft,		50, 100,	0)
-	MATCH("main",		"hall_pin",		_g_hall_pin,		-1, 256,	0)
-	MATCH("main",		"hall_bias",	_g_hall_bias,		FAN_BIAS_DISABLED, FAN_BIAS_PULL_UP, 0);
-	MATCH("main",		"interval",		_g_interval,		1, 10,		0)
-	MATCH("temp",		"hyst",			_g_temp_hyst,		1, 5,		0)
-	MATCH("temp",		"low",			_g_temp_low,		0, 85,		0)
-	MATCH("temp",		"high",			_g_temp_high,		0, 85,		0)
-	MATCH("speed",		"idle",			_g_speed_idle,		0, 100,		0)
-	MATCH("speed",		"low",			_g_speed_low,		0, 100,		0)
-	MATCH("speed",		"high",			_g_speed_high,		0, 100,		0)
-	MATCH("speed",		"heat",			_g_speed_heat,		0, 100,		0)
-	MATCH("speed",		"spin_up",		_g_speed_spin_up,	0, 100,		0)
-	MATCH("speed",		"const",		_g_speed_const,		-1, 100,	0)
-	MATCH("server",		"unix_rm",		_g_unix_rm,			0, 1,		0)
-	MATCH("server",		"unix_mode",	_g_unix_mode,		INT_MIN, INT_MAX, 8)
-	MATCH("logging",	"level",		log_level,			LOG_LEVEL_INFO, LOG_LEVEL_DEBUG, 0);
+#	define MATCH_FLOAT(_section, _option, _dest, _min, _max) { \
+			const char *_value = iniparser_getstring(ini, _section ":" _option, NULL); \
+			if (_value != NULL) { \
+				errno = 0; char *_end = NULL; const float _tmp = strtof(_value, &_end); \
+				if (errno || *_end || _end == _value || !(_tmp >= _min && _tmp <= _max)) { \
+					printf("%s: Invalid value for '%s/%s=%s': min=%d, max=%d\n", \
+						path, _section, _option, _value, (int)_min, (int)_max); \
+					goto error; \
+				} \
+				_dest = _tmp; \
+			} \
+		}
+
+	MATCH("main",		"pwm_pin",		config->pwm_pin,			0, 256,		0)
+	MATCH("main",		"pwm_low",		config->pwm_low,			0, 1024,	0)
+	MATCH("main",		"pwm_high",		config->pwm_high,			1, 1024,	0)
+	MATCH("main",		"pwm_soft",		config->pwm_soft,			50, 100,	0)
+	MATCH("main",		"hall_pin",		config->hall_pin,			-1, 256,	0)
+	MATCH("main",		"hall_bias",	config->hall_bias,			FAN_BIAS_DISABLED, FAN_BIAS_PULL_UP, 0);
+	MATCH("main",		"interval",		config->interval,			1, 60,		0)
+	MATCH_FLOAT("temp",	"hyst",			config->temp_hyst,			0, 20)
+	MATCH_FLOAT("temp",	"rise",			config->temp_rise,			0, 20)
+	MATCH_FLOAT("temp",	"fall",			config->temp_fall,			0, 20)
+	MATCH("temp",		"low",			config->temp_low,			0, 85,		0)
+	MATCH("temp",		"high",			config->temp_high,			0, 85,		0)
+	MATCH("temp",		"hold",			config->temp_hold,			0, 3600,	0)
+	MATCH("temp",		"fail_speed",	config->temp_fail_speed,	0, 100,		0)
+	MATCH("throttle",	"speed",		config->throttle_speed,		0, 100,		0)
+	MATCH("speed",		"idle",			config->speed_idle,			0, 100,		0)
+	MATCH("speed",		"low",			config->speed_low,			0, 100,		0)
+	MATCH("speed",		"high",			config->speed_high,			0, 100,		0)
+	MATCH("speed",		"heat",			config->speed_heat,			0, 100,		0)
+	MATCH("speed",		"spin_up",		config->speed_spin_up,		0, 100,		0)
+	MATCH("speed",		"const",		config->speed_const,		-1, 100,	0)
+	MATCH("speed",		"dwell",		config->speed_dwell,		0, 3600,	0)
+	MATCH("speed",		"changes",		config->speed_changes,		0, CONTROL_CHANGES_MAX, 0)
+	MATCH("server",		"unix_rm",		config->unix_rm,			0, 1,		0)
+	MATCH("server",		"unix_mode",	config->unix_mode,			INT_MIN, INT_MAX, 8)
+	MATCH("ctl",		"rm",			config->ctl_rm,				0, 1,		0)
+	MATCH("ctl",		"mode",			config->ctl_mode,			INT_MIN, INT_MAX, 8)
+	MATCH("shm",		"mode",			config->shm_mode,			INT_MIN, INT_MAX, 8)
+	MATCH("journal",	"size",			config->journal_size,		60, 10000000, 0)
+	MATCH("handover",	"ttl",			config->handover_ttl,		1, 3600,	0)
+	MATCH("logging",	"level",		config->log_level,			LOG_LEVEL_INFO, LOG_LEVEL_DEBUG, 0);
+	MATCH("logging",	"rate",			config->log_rate,			0, 60000,	0)
+	MATCH("logging",	"burst",		config->log_burst,			1, 1000,	0)
+	MATCH("logging",	"structured",	config->log_structured,		0, 1,		0)
+	MATCH("rt",			"prio",			config->rt.prio,			0, 99,		0)
+	MATCH("rt",			"cpu",			config->rt.cpu,				-1, 1023,	0)
+	MATCH("rt",			"mlock",		config->mlock,				0, 1,		0)
+	MATCH("sim",		"enabled",		config->sim_enabled,		0, 1,		0)
+	MATCH("sim",		"speed",		config->sim_params.speedup,	0, 1000000, 0)
+	MATCH("sim",		"duration",		config->sim_duration,		0, INT_MAX,	0)
+	MATCH("sim",		"ambient",		config->sim_params.ambient,	-40, 85, 0)
+	{
+		const char *value = iniparser_getstring(ini, "temp:sensors", NULL);
+		if (value != NULL) {
+			free(config->temp_sensors);
+			assert(config->temp_sensors = strdup(value));
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "throttle:path", NULL);
+		if (value != NULL) {
+			free(config->throttle_path);
+			assert(config->throttle_path = strdup(value));
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "throttle:cpufreq", NULL);
+		if (value != NULL) {
+			free(config->throttle_cpufreq);
+			assert(config->throttle_cpufreq = strdup(value));
+		}
+	}
 	{
 		const char *value = iniparser_getstring(ini, "server:unix", NULL);
 		if (value != NULL) {
-			free(_g_unix_path);
-			assert(_g_unix_path = strdup(value));
+			free(config->unix_path);
+			assert(config->unix_path = strdup(value));
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "journal:path", NULL);
+		if (value != NULL) {
+			free(config->journal_path);
+			assert(config->journal_path = strdup(value));
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "handover:path", NULL);
+		if (value != NULL) {
+			free(config->handover_path);
+			assert(config->handover_path = strdup(value));
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "usage:path", NULL);
+		if (value != NULL) {
+			free(config->usage_path);
+			assert(config->usage_path = strdup(value));
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "shm:name", NULL);
+		if (value != NULL) {
+			free(config->shm_name);
+			assert(config->shm_name = strdup(value));
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "ctl:path", NULL);
+		if (value != NULL) {
+			free(config->ctl_path);
+			assert(config->ctl_path = strdup(value));
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "sim:load", NULL);
+		if (value != NULL && sim_parse_load(&config->sim_params, value) < 0) {
+			printf("%s: Invalid value for 'sim/load=%s': should be <sec>:<watts>,...\n", path, value);
+			goto error;
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "sim:stall", NULL);
+		if (value != NULL && sim_parse_stalls(&config->sim_params, value) < 0) {
+			printf("%s: Invalid value for 'sim/stall=%s': should be <start_sec>:<sec>,...\n", path, value);
+			goto error;
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "rt:policy", NULL);
+		if (value != NULL && (config->rt.policy = rt_parse_policy(value)) < 0) {
+			printf("%s: Invalid value for 'rt/policy=%s': should be fifo or rr\n", path, value);
+			goto error;
+		}
+	}
+	{
+		const char *value = iniparser_getstring(ini, "main:profile", NULL);
+		if (value != NULL) {
+			free(config->profile);
+			assert(config->profile = strdup(value));
+		}
+	}
+	for (int index = 0; index < iniparser_getnsec(ini); ++index) {
+		const char *const section = iniparser_getsecname(ini, index);
+		if (section != NULL && !strncmp(section, "profile.", 8)) {
+			if (_load_ini_profile(config, ini, path, section) < 0) {
+				goto error;
+			}
+		} else if (section != NULL && !strncmp(section, "rule.", 5)) {
+			if (_load_ini_rule(config, ini, path, section) < 0) {
+				goto error;
+			}
 		}
 	}
 
+#	undef MATCH_FLOAT
 #	undef MATCH
 
 	goto ok;
@@ -345,12 +896,362 @@ static int _load_ini(const char *path) {
 		return retval;
 }
 
+static int _load_ini_profile(_config_s *config, dictionary *ini, const char *path, const char *section) {
+	static const struct {
+		const char	*key;
+		size_t		offset;
+		int			min;
+		int			max;
+	} keys[] = {
+		// The hysteresis sets both thresholds, the next keys can override them
+		{"temp_hyst",		offsetof(control_params_s, temp_rise),		0, 20},
+		{"temp_hyst",		offsetof(control_params_s, temp_fall),		0, 20},
+		{"temp_rise",		offsetof(control_params_s, temp_rise),		0, 20},
+		{"temp_fall",		offsetof(control_params_s, temp_fall),		0, 20},
+		{"temp_low",		offsetof(control_params_s, temp_low),		0, 85},
+		{"temp_high",		offsetof(control_params_s, temp_high),		0, 85},
+		{"speed_idle",		offsetof(control_params_s, speed_idle),		0, 100},
+		{"speed_low",		offsetof(control_params_s, speed_low),		0, 100},
+		{"speed_high",		offsetof(control_params_s, speed_high),		0, 100},
+		{"speed_heat",		offsetof(control_params_s, speed_heat),		0, 100},
+		{"speed_spin_up",	offsetof(control_params_s, speed_spin_up),	0, 100},
+		{"speed_dwell",		offsetof(control_params_s, speed_dwell),	0, 3600},
+		{"speed_changes",	offsetof(control_params_s, speed_changes),	0, CONTROL_CHANGES_MAX},
+	};
+
+	const char *const name = section + strlen("profile.");
+	if (name[0] == '\0' || strlen(name) >= PROFILE_NAME_SIZE || strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789_-") != strlen(name) || !strcmp(name, "default")) {
+		printf("%s: Invalid profile name '%s': should be [a-z0-9_-], max %d chars, not 'default'\n",
+			path, name, PROFILE_NAME_SIZE - 1);
+		return -1;
+	}
+
+	// The same profile can be extended by the next config file
+	profile_s *profile = NULL;
+	for (unsigned index = 0; index < config->profiles_count; ++index) {
+		if (!strcmp(config->profiles[index].name, name)) {
+			profile = &config->profiles[index];
+			break;
+		}
+	}
+	if (profile == NULL) {
+		if (config->profiles_count >= PROFILE_MAX) {
+			printf("%s: Too many profiles, max=%d\n", path, PROFILE_MAX);
+			return -1;
+		}
+		profile = &config->profiles[config->profiles_count];
+		++config->profiles_count;
+		profile_init(profile, name);
+	}
+
+	for (unsigned index = 0; index < sizeof(keys) / sizeof(keys[0]); ++index) {
+		char option[128];
+		snprintf(option, sizeof(option), "%s:%s", section, keys[index].key);
+		const char *const value = iniparser_getstring(ini, option, NULL);
+		if (value == NULL) {
+			continue;
+		}
+		errno = 0;
+		char *end = NULL;
+		const float tmp = strtof(value, &end);
+		if (errno || *end || end == value || !(tmp >= keys[index].min && tmp <= keys[index].max)) {
+			printf("%s: Invalid value for '%s/%s=%s': min=%d, max=%d\n",
+				path, section, keys[index].key, value, keys[index].min, keys[index].max);
+			return -1;
+		}
+		*(float *)((char *)&profile->params + keys[index].offset) = tmp;
+	}
+	return 0;
+}
+
+static int _load_ini_rule(_config_s *config, dictionary *ini, const char *path, const char *section) {
+	const char *const name = section + strlen("rule.");
+	if (name[0] == '\0' || strlen(name) >= RULE_NAME_SIZE || strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789_-") != strlen(name)) {
+		printf("%s: Invalid rule name '%s': should be [a-z0-9_-], max %d chars\n", path, name, RULE_NAME_SIZE - 1);
+		return -1;
+	}
+
+	// Like the profiles, a rule can be extended by the next config file.
+	// The rules are evaluated in the order they were first defined.
+	rules_s *const rules = &config->rules;
+	rule_s *rule = NULL;
+	for (unsigned index = 0; index < rules->count; ++index) {
+		if (!strcmp(rules->list[index].name, name)) {
+			rule = &rules->list[index];
+			break;
+		}
+	}
+	if (rule == NULL) {
+		if (rules->count >= RULE_MAX) {
+			printf("%s: Too many rules, max=%d\n", path, RULE_MAX);
+			return -1;
+		}
+		rule = &rules->list[rules->count];
+		++rules->count;
+		rule_init(rule, name);
+	}
+
+	char option[128];
+	const char *value;
+#	define GET(_key) (snprintf(option, sizeof(option), "%s:%s", section, _key), (value = iniparser_getstring(ini, option, NULL)) != NULL)
+#	define INVALID(_key, _expected) { \
+			printf("%s: Invalid value for '%s/%s=%s': should be %s\n", path, section, _key, value, _expected); \
+			return -1; \
+		}
+#	define FLOAT(_key, _dest, _min, _max) { \
+			if (GET(_key)) { \
+				errno = 0; char *_end = NULL; const float _tmp = strtof(value, &_end); \
+				if (errno || *_end || _end == value || !(_tmp >= _min && _tmp <= _max)) { \
+					INVALID(_key, #_min "..." #_max); \
+				} \
+				_dest = _tmp; \
+			} \
+		}
+
+	if (GET("time") && rule_parse_time(rule, value) < 0) {
+		INVALID("time", "HH:MM-HH:MM");
+	}
+	if (GET("days") && rule_parse_days(rule, value) < 0) {
+		INVALID("days", "mon,tue,wed,thu,fri,sat,sun");
+	}
+	FLOAT("load_above",		rule->load_above,		0, 1000);
+	FLOAT("load_below",		rule->load_below,		0, 1000);
+	if (GET("file") && rule_set_file(rule, value) < 0) {
+		INVALID("file", "an absolute path, optionally prefixed by '!'");
+	}
+	if (GET("profile") && rule_set_profile(rule, value) < 0) {
+		INVALID("profile", "a profile name");
+	}
+	FLOAT("speed_max",		rule->speed_max,		0, 100);
+	FLOAT("temp_emergency",	rule->temp_emergency,	0, 85);
+
+#	undef FLOAT
+#	undef INVALID
+#	undef GET
+	return 0;
+}
+
+static int _check_config(_config_s *config) {
+	if (config->pwm_low >= config->pwm_high) {
+		puts("Invalid PWM config, chould be: low < high");
+		return -1;
+	}
+	if (temp_check_paths(config->temp_sensors) < 0) {
+		printf("Invalid temp sensors '%s': should be absolute paths separated by commas, max %d\n",
+			config->temp_sensors, TEMP_MAX_SENSORS);
+		return -1;
+	}
+	const control_params_s params = _get_control_params(config);
+	const char *msg = control_check_params(&params);
+	if (msg != NULL) {
+		puts(msg);
+		return -1;
+	}
+	bool found = (config->profile[0] == '\0' || !strcmp(config->profile, "default"));
+	for (unsigned index = 0; index < config->profiles_count; ++index) {
+		const profile_s *const profile = &config->profiles[index];
+		control_params_s merged = params;
+		profile_apply(profile, &merged);
+		if ((msg = control_check_params(&merged)) != NULL) {
+			printf("Profile '%s': %s\n", profile->name, msg);
+			return -1;
+		}
+		found = (found || !strcmp(config->profile, profile->name));
+	}
+	if (!found) {
+		printf("Unknown profile '%s'\n", config->profile);
+		return -1;
+	}
+	if ((msg = rules_compile(&config->rules, config->profiles, config->profiles_count)) != NULL) {
+		puts(msg);
+		return -1;
+	}
+	return 0;
+}
+
+static void _apply_logging(const _config_s *config) {
+	log_level = config->log_level;
+	log_rate = config->log_rate;
+	log_burst = config->log_burst;
+	log_structured = config->log_structured;
+}
+
+static void _reload(void) {
+	LOG_INFO("config", "Reloading the config ...");
+
+	_config_s config;
+	_config_init(&config);
+	if (_parse_options(_g_argc, _g_argv, &config) != 0 || _check_config(&config) < 0) {
+		fflush(stdout); // The parser errors
+		LOG_ERROR("config", "Can't load the new config, keeping the current one");
+		_config_destroy(&config);
+		return;
+	}
+	const _config_s *const old = &_g_config;
+
+	// The hardware and the process-wide things are set up only once
+#	define KEEP(_field, _name) { \
+			if (config._field != old->_field) { \
+				LOG_ERROR("config", "Can't change %s without a restart, keeping the current value", _name); \
+				config._field = old->_field; \
+			} \
+		}
+	KEEP(pwm_pin,		"main/pwm_pin");
+	KEEP(pwm_soft,		"main/pwm_soft");
+	KEEP(hall_pin,		"main/hall_pin");
+	KEEP(hall_bias,		"main/hall_bias");
+	KEEP(mlock,			"rt/mlock");
+	KEEP(sim_enabled,	"sim/enabled");
+#	undef KEEP
+	config.sim_params = old->sim_params;
+
+	if (config.pwm_low != old->pwm_low || config.pwm_high != old->pwm_high) {
+		fan_set_pwm_range(_g_fan, config.pwm_low, config.pwm_high);
+	}
+
+	const bool rt_changed = (
+		config.rt.policy != old->rt.policy
+		|| config.rt.prio != old->rt.prio
+		|| config.rt.cpu != old->rt.cpu
+	);
+	const bool server_changed = strcmp(config.unix_path, old->unix_path);
+	const bool ctl_changed = strcmp(config.ctl_path, old->ctl_path);
+	if (rt_changed || server_changed || ctl_changed) {
+		// The new HTTP and control threads should not inherit the RT scheduling
+		rt_reset(pthread_self());
+	}
+
+	if ((config.unix_path[0] != '\0' || config.ctl_path[0] != '\0') && _g_history == NULL) {
+		_g_history = history_init();
+	}
+
+	// A new socket is started before the old one is stopped,
+	// so a bad path doesn't leave the clients without the daemon.
+	if (server_changed) {
+		server_s *server = NULL;
+		if (config.unix_path[0] == '\0' || (server = server_init(
+			(config.hall_pin >= 0), _g_history, &_g_override, &_g_profiles, _g_usage, config.unix_path, config.unix_rm, config.unix_mode)) != NULL
+		) {
+			if (_g_server) {
+				server_destroy(_g_server);
+			}
+			_g_server = server;
+		} else {
+			LOG_ERROR("config", "Keeping the HTTP server on '%s'", old->unix_path);
+			free(config.unix_path);
+			assert(config.unix_path = strdup(old->unix_path));
+			config.unix_mode = old->unix_mode;
+		}
+	} else if (config.unix_mode != old->unix_mode && config.unix_mode && _g_server) {
+		if (chmod(config.unix_path, config.unix_mode) < 0) {
+			LOG_PERROR("config", "Can't set permissions %o to UNIX socket '%s'", config.unix_mode, config.unix_path);
+		}
+	}
+
+	if (ctl_changed) {
+		ctl_s *ctl = NULL;
+		if (config.ctl_path[0] == '\0' || (ctl = ctl_init(
+			_g_history, &_g_override, config.ctl_path, config.ctl_rm, config.ctl_mode)) != NULL
+		) {
+			if (_g_ctl) {
+				ctl_destroy(_g_ctl);
+			}
+			_g_ctl = ctl;
+		} else {
+			LOG_ERROR("config", "Keeping the control socket on '%s'", old->ctl_path);
+			free(config.ctl_path);
+			assert(config.ctl_path = strdup(old->ctl_path));
+			config.ctl_mode = old->ctl_mode;
+		}
+	} else if (config.ctl_mode != old->ctl_mode && config.ctl_mode && _g_ctl) {
+		if (chmod(config.ctl_path, config.ctl_mode) < 0) {
+			LOG_PERROR("config", "Can't set permissions %o to UNIX socket '%s'", config.ctl_mode, config.ctl_path);
+		}
+	}
+
+	if (strcmp(config.shm_name, old->shm_name)) {
+		export_s *export = NULL;
+		if (config.shm_name[0] == '\0' || (export = export_init(config.shm_name, config.shm_mode)) != NULL) {
+			if (_g_export) {
+				export_destroy(_g_export);
+			}
+			_g_export = export;
+		} else {
+			LOG_ERROR("config", "Keeping the shared memory '%s'", old->shm_name);
+			free(config.shm_name);
+			assert(config.shm_name = strdup(old->shm_name));
+			config.shm_mode = old->shm_mode;
+		}
+	} else if (config.shm_mode != old->shm_mode && _g_export) {
+		export_set_mode(_g_export, config.shm_mode);
+	}
+
+	if (_g_temp && (strcmp(config.temp_sensors, old->temp_sensors) || config.temp_hold != old->temp_hold)) {
+		// The last known good value is still good for the hold
+		temp_s *const temp = temp_init(config.temp_sensors, config.temp_hold);
+		temp->last = _g_temp->last;
+		temp->last_ns = _g_temp->last_ns;
+		temp->errors = _g_temp->errors;
+		temp_destroy(_g_temp);
+		_g_temp = temp;
+	}
+
+	if (_g_throttle && (strcmp(config.throttle_path, old->throttle_path) || strcmp(config.throttle_cpufreq, old->throttle_cpufreq))) {
+		throttle_s *const throttle = throttle_init(config.throttle_path, config.throttle_cpufreq);
+		throttle_take_over(throttle, _g_throttle, !strcmp(config.throttle_cpufreq, old->throttle_cpufreq));
+		throttle_destroy(_g_throttle);
+		_g_throttle = throttle;
+	}
+
+	if (strcmp(config.journal_path, old->journal_path) || config.journal_size != old->journal_size) {
+		// The same file can't be mapped twice with different sizes, so the old one goes first.
+		// The history already has the records, so they are not recovered again.
+		if (_g_journal) {
+			journal_destroy(_g_journal);
+			_g_journal = NULL;
+		}
+		if (config.journal_path[0] != '\0') {
+			if ((_g_journal = journal_init(config.journal_path, config.journal_size, NULL)) == NULL) {
+				LOG_ERROR("config", "The journal is disabled until the next reload");
+				free(config.journal_path);
+				assert(config.journal_path = strdup(""));
+			}
+		}
+	}
+
+	if (strcmp(config.usage_path, old->usage_path)) {
+		usage_set_path(_g_usage, config.usage_path);
+		usage_save(_g_usage, _now_ns());
+	}
+
+	if (rt_changed || server_changed || ctl_changed) {
+		if (rt_changed && _g_fan->hall_started) {
+			rt_reset(_g_fan->tid);
+			rt_apply(_g_fan->tid, "Hall", &config.rt);
+		}
+		rt_apply(pthread_self(), "loop", &config.rt);
+	}
+
+	_apply_logging(&config);
+
+	_config_destroy(&_g_config);
+	_g_config = config;
+	profiles_set(&_g_profiles, _g_config.profiles, _g_config.profiles_count, _g_config.profile);
+	++_g_config_gen;
+	LOG_INFO("config", "Using the config generation %u", _g_config_gen);
+}
+
 static void _signal_handler(int signum) {
+	if (signum == SIGHUP) {
+		LOG_INFO_SIGNAL("signal", "===== Reloading the config by SIGHUP =====");
+		atomic_store(&_g_reload, true);
+		return;
+	}
 	switch (signum) {
-		case SIGTERM:	LOG_INFO_NOLOCK("signal", "===== Stopping by SIGTERM ====="); break;
-		case SIGINT:	LOG_INFO_NOLOCK("signal", "===== Stopping by SIGINT ====="); break;
-		case SIGPIPE:	LOG_INFO_NOLOCK("signal", "===== Stopping by SIGPIPE ====="); break;
-		default:		LOG_INFO_NOLOCK("signal", "===== Stopping by %d =====", signum); break;
+		case SIGTERM:	LOG_INFO_SIGNAL("signal", "===== Stopping by SIGTERM ====="); break;
+		case SIGINT:	LOG_INFO_SIGNAL("signal", "===== Stopping by SIGINT ====="); break;
+		case SIGPIPE:	LOG_INFO_SIGNAL("signal", "===== Stopping by SIGPIPE ====="); break;
+		default:		LOG_INFO_SIGNAL("signal", "===== Stopping by signal ====="); break;
 	}
 	atomic_store(&_g_stop, true);
 }
@@ -362,82 +1263,256 @@ static void _install_signal_handlers(void) {
 	assert(!sigaddset(&sig_act.sa_mask, SIGINT));
 	assert(!sigaddset(&sig_act.sa_mask, SIGTERM));
 	assert(!sigaddset(&sig_act.sa_mask, SIGPIPE));
+	assert(!sigaddset(&sig_act.sa_mask, SIGHUP));
 	assert(!sigaction(SIGINT, &sig_act, NULL));
 	assert(!sigaction(SIGTERM, &sig_act, NULL));
 	assert(!sigaction(SIGPIPE, &sig_act, NULL));
+	assert(!sigaction(SIGHUP, &sig_act, NULL));
+}
+
+static control_params_s _get_control_params(const _config_s *config) {
+	return (control_params_s){
+		.temp_rise = (isnan(config->temp_rise) ? config->temp_hyst : config->temp_rise),
+		.temp_fall = (isnan(config->temp_fall) ? config->temp_hyst : config->temp_fall),
+		.temp_low = config->temp_low,
+		.temp_high = config->temp_high,
+		.speed_idle = config->speed_idle,
+		.speed_low = config->speed_low,
+		.speed_high = config->speed_high,
+		.speed_heat = config->speed_heat,
+		.speed_spin_up = config->speed_spin_up,
+		.speed_dwell = config->speed_dwell,
+		.speed_changes = config->speed_changes,
+	};
+}
+
+static int64_t _now_ns(void) {
+	// The loop runs on the virtual clock in the simulation mode
+	return (_g_sim != NULL ? sim_get_now_ns(_g_sim) : get_now_monotonic_ns());
 }
 
 static void _stoppable_sleep(unsigned delay) {
-	delay *= 10;
-	for (unsigned count = 0; count < delay && !atomic_load(&_g_stop); ++count) {
-		usleep(100000);
-	}
+	_stoppable_sleep_until(_now_ns() + delay * NS_PER_SEC, NULL);
 }
 
-static int _loop(void) {
-	int retval = 0;
+static unsigned _get_events(void) {
+	// Changes by the HTTP and the control sockets, just for comparison
+	return atomic_load(&_g_override.seq) + atomic_load(&_g_profiles.seq);
+}
 
+static void _stoppable_sleep_until(int64_t deadline_ns, const unsigned *events) {
+	// The loop wakes up on SIGHUP, overrides, profile switches and the thermal events,
+	// so they are applied without waiting
+	while (!atomic_load(&_g_stop) && !(events != NULL && (atomic_load(&_g_reload) || _get_events() != *events))) {
+		if (_g_sim != NULL) {
+			const int64_t now_ns = sim_get_now_ns(_g_sim);
+			if (now_ns >= deadline_ns) {
+				break;
+			}
+			sim_run_until(_g_sim, (deadline_ns - now_ns < 100 * NS_PER_MS ? deadline_ns : now_ns + 100 * NS_PER_MS), &_g_stop);
+			continue;
+		}
+		const int64_t left_ns = deadline_ns - get_now_monotonic_ns();
+		if (left_ns <= 0) {
+			break;
+		}
+		const int64_t wait_ns = (left_ns < 100 * NS_PER_MS ? left_ns : 100 * NS_PER_MS);
+		if (_g_thermal != NULL && events != NULL) {
+			if (thermal_wait(_g_thermal, wait_ns) > 0) {
+				break;
+			}
+		} else {
+			usleep(wait_ns / 1000);
+		}
+	}
+}
+
+static void _loop(const handover_s *handover) {
 	LOG_INFO("loop", "Starting the loop ...");
 
-	float temp_fixed = 0;
-	float prev_speed = -1;
+	control_s control;
+	control_init(&control, _g_config.speed_const);
+	int prev_profile = -1;
+	int prev_rule = -1;
+	bool emergency = false;
+	float prev_ceiling = NAN;
+	control_params_s prev_params = {0};
 	unsigned prev_pwm = 0;
-	const char *mode = "???";
+	state_s state = {
+		.ok = true,
+		.last_fail_ns = -1,
+		.has_hall = (_g_config.hall_pin >= 0),
+		.config_gen = _g_config_gen,
+		.startup_pwm_ns = _g_first_pwm_ns,
+		.startup_ready_ns = get_now_monotonic_ns() - _g_start_ns,
+	};
+	LOG_INFO("loop", "Ready in %.2Lf ms", ns_to_sec(state.startup_ready_ns) * 1000);
+	systemd_notify("READY=1");
+
+	if (handover != NULL) {
+		LOG_INFO("loop", "Resuming after the previous run %.1Lf seconds ago: speed=%.2f%%, temp_fixed=%.2f°C",
+			ns_to_sec(handover->age_ns), handover->speed, handover->temp_fixed);
+		control_resume(&control, handover->temp_fixed, handover->speed);
+		prev_pwm = handover->pwm;
+	}
+
+	const int64_t start_ns = _now_ns();
+	int64_t next_ns = start_ns;
 
 	while (!atomic_load(&_g_stop)) {
-		float temp = 0;
-		if (get_temp(&temp) < 0) {
-			goto error;
+		STATS_BEGIN(begin_ns);
+		STATS_INC(STATS_LOOP_WAKEUPS, 1);
+		const unsigned events = _get_events();
+
+		if (atomic_exchange(&_g_reload, false)) {
+			_reload();
+			prev_rule = -1;
+			state.config_gen = _g_config_gen;
 		}
 
-		bool changed = false;
-		if (_g_speed_const < 0) {
-			if (fabsf(fabsf(temp_fixed) - fabsf(temp)) >= _g_temp_hyst) {
-				LOG_VERBOSE("loop", "Significant temperature change: %.2f°C -> %.2f°C", temp_fixed, temp);
-				changed = true;
+		rules_result_s rules;
+		rules_eval(&_g_config.rules, &rules);
+		if (rules.rule != prev_rule) {
+			if (rules.rule >= 0) {
+				LOG_INFO("loop", "Matched the rule '%s'", _g_config.rules.list[rules.rule].name);
 			}
+			prev_rule = rules.rule;
 		}
 
-		if (changed || prev_speed < 0) {
-			float speed;
-			if (_g_speed_const < 0) {
-				if (temp < _g_temp_low) {
-					speed = _g_speed_idle;
-					mode = "--- IDLE ---";
-				} else if (temp > _g_temp_high) {
-					speed = _g_speed_heat;
-					mode = "!!! HEAT !!!";
-				} else {
-					speed = remap(temp, _g_temp_low, _g_temp_high, _g_speed_low, _g_speed_high);
-					mode = "= IN-RANGE =";
-				}
+		control_params_s params = _get_control_params(&_g_config);
+		const int profile = (rules.rule >= 0 ? rules.profile : profiles_get_active(&_g_profiles));
+		if (profile >= 0) {
+			profile_apply(&_g_config.profiles[profile], &params);
+		}
+		if (profile != prev_profile) {
+			LOG_INFO("loop", "Using the profile '%s'", (profile >= 0 ? _g_config.profiles[profile].name : "default"));
+			profiles_set_effective(&_g_profiles, profile);
+			prev_profile = profile;
+		}
+		const int64_t interval_ns = _g_config.interval * NS_PER_SEC;
+
+		if (_g_sim != NULL && _g_config.sim_duration > 0 && _now_ns() - start_ns >= _g_config.sim_duration * NS_PER_SEC) {
+			break;
+		}
+
+		float temp = 0;
+		temp_health_e temp_health = TEMP_HEALTH_OK;
+		STATS_BEGIN(sensor_begin_ns);
+		if (_g_sim != NULL) {
+			temp = sim_get_temp(_g_sim);
+		} else {
+			temp_health = temp_read(_g_temp, get_now_monotonic_ns(), &temp);
+		}
+		STATS_END(STATS_SENSOR_READ, sensor_begin_ns);
+
+		const bool prev_emergency = emergency;
+		const float ceiling = (rules_limit(&rules, temp, &emergency, &params) ? rules.speed_max : NAN);
+		if (emergency && !prev_emergency) {
+			LOG_ERROR("loop", "Emergency temperature %.2f°C, the noise ceiling is lifted", temp);
+		} else if (ceiling != prev_ceiling && !(isnan(ceiling) && isnan(prev_ceiling))) {
+			if (isnan(ceiling)) {
+				LOG_INFO("loop", "The noise ceiling is removed");
 			} else {
-				speed = _g_speed_const;
-				mode = "= CONST =";
+				LOG_INFO("loop", "Using the noise ceiling: speed<=%.2f%%", ceiling);
 			}
+		}
+		prev_ceiling = ceiling;
 
-			if ((prev_speed < _g_speed_idle || prev_speed <= 0) && speed > 0) {
-				unsigned pwm = fan_set_speed_percent(_g_fan, _g_speed_spin_up);
-				LOG_VERBOSE("loop", "Spinning up the fan: speed=%.2f%% (pwm=%u) ...", _g_speed_spin_up, pwm)
-				_stoppable_sleep(2);
-			}
+		// After the ceiling: the throttling is worse than the noise
+		if (_g_throttle) {
+			const int64_t throttle_now_ns = get_now_monotonic_ns();
+			throttle_update(_g_throttle, throttle_now_ns);
+			throttle_boost(_g_throttle, throttle_now_ns, _g_config.throttle_speed, &params);
+		}
 
-			prev_pwm = fan_set_speed_percent(_g_fan, speed);
-			temp_fixed = temp;
-			prev_speed = speed;
-			changed = true;
+		// The control state is kept on the reload, profile and ceiling changes,
+		// so the fan just follows the new curve without a spin-up.
+		if (memcmp(&params, &prev_params, sizeof(params))) {
+			control_refresh(&control);
+			prev_params = params;
 		}
 
+		float speed_const = _g_config.speed_const;
+		const bool overridden = override_get(&_g_override, &speed_const);
+		if (temp_health == TEMP_HEALTH_FAILED && speed_const < 0) {
+			// The constant speed and the override don't need the temperature
+			speed_const = _g_config.temp_fail_speed;
+		}
+
+		const float prev_speed_const = control.speed_const;
+		const float prev_temp_fixed = control.temp_fixed;
+		const unsigned flags = control_step(&params, &control, _now_ns(), temp, speed_const, overridden);
+		const bool changed = (flags & CONTROL_SPEED_CHANGED);
+		if (flags & CONTROL_CONST_CHANGED) {
+			LOG_VERBOSE("loop", "Constant speed changed: %.2f%% -> %.2f%%", prev_speed_const, speed_const);
+		}
+		if (flags & CONTROL_SUPPRESSED) {
+			LOG_DEBUG("loop", "Postponed the speed change: %.2f°C -> %.2f°C", prev_temp_fixed, temp);
+		} else if (flags & CONTROL_TEMP_CHANGED) {
+			LOG_VERBOSE("loop", "Significant temperature change: %.2f°C -> %.2f°C", prev_temp_fixed, temp);
+		}
+		if (flags & CONTROL_SPIN_UP) {
+			unsigned pwm = fan_set_speed_percent(_g_fan, params.speed_spin_up);
+			LOG_VERBOSE("loop", "Spinning up the fan: speed=%.2f%% (pwm=%u) ...", params.speed_spin_up, pwm)
+			_stoppable_sleep(2);
+		}
+		if (changed) {
+			STATS_BEGIN(pwm_begin_ns);
+			prev_pwm = fan_set_speed_percent(_g_fan, control.speed);
+			STATS_END(STATS_PWM_WRITE, pwm_begin_ns);
+		}
+
+		const float prev_speed = control.speed;
+		const float temp_fixed = control.temp_fixed;
+		const char *const mode = control.mode;
+
 		int rpm = 0;
 		bool fan_ok = true;
-		if (_g_hall_pin >= 0) {
+		if (_g_config.hall_pin >= 0) {
 			rpm = fan_get_hall_rpm(_g_fan);
 			fan_ok = !(prev_speed > 0 && rpm <= 0);
 		}
 
+		const int64_t now_ns = _now_ns();
+		if (_g_history) {
+			history_insert(_g_history, now_ns, temp, prev_speed, rpm);
+		}
+		if (_g_journal) {
+			journal_write(_g_journal, temp, temp_fixed, prev_speed, prev_pwm, rpm,
+				(fan_ok ? JOURNAL_FLAG_OK : 0) | (changed ? JOURNAL_FLAG_CHANGED : 0)
+				| (temp_health != TEMP_HEALTH_OK ? JOURNAL_FLAG_DEGRADED : 0));
+		}
+		state.temp_real = temp;
+		state.temp_fixed = temp_fixed;
+		state.temp_health = temp_health;
+		state.temp_errors = (_g_temp != NULL ? _g_temp->errors : 0);
+		if (_g_throttle) {
+			state.has_throttle = (_g_throttle->flags_fd >= 0 || _g_throttle->max_fd >= 0);
+			state.throttle_flags = _g_throttle->flags;
+			state.throttle_active = _g_throttle->active;
+			state.throttle_events = _g_throttle->events;
+			state.throttle_ns = throttle_get_total_ns(_g_throttle, get_now_monotonic_ns());
+		}
+		state.suppressed_dwell = control.suppressed_dwell;
+		state.suppressed_budget = control.suppressed_budget;
+		state.speed = prev_speed;
+		state.pwm = prev_pwm;
+		state.rpm = rpm;
+		if (state.ok != fan_ok) {
+			state.last_fail_ns = now_ns;
+		}
+		state.ok = fan_ok;
 		if (_g_server) {
-			server_set_state(_g_server, temp, temp_fixed, prev_speed, prev_pwm, rpm, fan_ok);
+			server_set_state(_g_server, &state);
+			server_set_params(_g_server, &params);
+		}
+		if (_g_export) {
+			export_set_state(_g_export, now_ns, &state);
+		}
+		if (_g_ctl) {
+			ctl_set_state(_g_ctl, now_ns, &state);
 		}
+		usage_update(_g_usage, now_ns, control.mode_id);
 #		define SAY(_log, _prefix) \
 			_log("loop", _prefix " [%s] temp=%.2f°C, speed=%.2f%% (pwm=%u), rpm=%d", \
 				mode, temp, prev_speed, prev_pwm, rpm);
@@ -461,17 +1536,42 @@ static int _loop(void) {
 			}
 		}
 
-		_stoppable_sleep(_g_interval);
+		STATS_END(STATS_LOOP_WALL, begin_ns);
+
+		// Keep the iterations on a fixed grid regardless of the work time,
+		// but don't try to catch up after the spin-up or the failure waits.
+		// An early wake by an event doesn't use up the tick, so the next one
+		// is never more than an interval away, whatever the rate of the events.
+		next_ns += interval_ns;
+		const int64_t after_ns = _now_ns();
+		if (next_ns < after_ns || next_ns > after_ns + interval_ns) {
+			next_ns = after_ns + interval_ns;
+		}
+		_stoppable_sleep_until(next_ns, &events);
+		const int64_t woke_ns = _now_ns();
+		if (woke_ns < next_ns) {
+			// Woken up by an event, the tick is still ahead
+			next_ns -= interval_ns;
+		} else {
+			STATS_ADD(STATS_LOOP_LATENESS, woke_ns - next_ns);
+		}
 	}
 
-	goto ok;
-	error:
-		retval = -1;
-	ok:
+	// On a clean exit the fan is left as is for the next start, if it's spinning.
+	// The software PWM dies with the process, so the state is saved just to skip
+	// the spin-up, and the full throttle is still the fallback in all other cases.
+	bool keep = false;
+	if (state.ok && control.speed >= 0 && _g_config.handover_path[0] != '\0') {
+		const handover_s handover = {.speed = control.speed, .temp_fixed = control.temp_fixed, .pwm = prev_pwm};
+		keep = (handover_save(_g_config.handover_path, &handover) == 0 && !_g_config.pwm_soft);
+	}
+	if (!keep) {
 		LOG_VERBOSE("loop", "Full throttle on the fan!");
 		fan_set_speed_percent(_g_fan, 100);
-		LOG_INFO("loop", "Bye-bye");
-		return retval;;
+	}
+	usage_update(_g_usage, _now_ns(), control.mode_id);
+	usage_save(_g_usage, _now_ns());
+	LOG_INFO("loop", "Bye-bye");
 }
 
 static void _help(void) {
@@ -482,36 +1582,120 @@ static void _help(void) {
 	SAY("Copyright (C) 2018-2023 Maxim Devaev <mdevaev@gmail.com>\n");
 	SAY("Hardware options:");
 	SAY("═════════════════");
-	SAY("    --pwm-pin <N>  ─── GPIO pin for PWM. Default: %d.\n", _g_pwm_pin);
-	SAY("    --pwm-low <N>  ─── PWM low level. Default: %d.\n", _g_pwm_low);
-	SAY("    --pwm-high <N>  ── PWM high level. Default: %d.\n", _g_pwm_high);
+	SAY("    --pwm-pin <N>  ─── GPIO pin for PWM. Default: %d.\n", _g_config.pwm_pin);
+	SAY("    --pwm-low <N>  ─── PWM low level. Default: %d.\n", _g_config.pwm_low);
+	SAY("    --pwm-high <N>  ── PWM high level. Default: %d.\n", _g_config.pwm_high);
 	SAY("    --pwm-soft <N>  ── Use software PWM with specified range 0...N. Default: disabled.\n");
 	SAY("    --hall-pin <N>  ── GPIO pin for the Hall sensor. Default: disabled.\n");
-	SAY("    --hall-bias <N>  ─ Hall pin bias: 0 = disabled, 1 = pull-down, 2 = pull-up. Default: %d.\n", _g_hall_bias);
+	SAY("    --hall-bias <N>  ─ Hall pin bias: 0 = disabled, 1 = pull-down, 2 = pull-up. Default: %d.\n", _g_config.hall_bias);
 	SAY("Fan control options:");
 	SAY("════════════════════");
-	SAY("    --temp-hyst <T>  ───── Temperature hysteresis. Default: %.2f°C.\n", _g_temp_hyst);
-	SAY("    --temp-low <T>  ────── Lower temperature range limit. Default: %.2f°C.\n", _g_temp_low);
-	SAY("    --temp-high <T>  ───── Upper temperature range limit. Default: %.2f°C.\n", _g_temp_high);
-	SAY("    --speed-idle <N>  ──── Fan speed below of the range. Default: %.2f%%.\n", _g_speed_idle);
-	SAY("    --speed-low <N>  ───── Lower fan speed range limit. Default: %.2f%%.\n", _g_speed_low);
-	SAY("    --speed-high <N>  ──── Upper fan speed range limit. Default: %.2f%%.\n", _g_speed_high);
-	SAY("    --speed-heat <N>  ──── Fan speed on overheating. Default: %.2f%%.\n", _g_speed_heat);
-	SAY("    --speed-spin-up <N>  ─ Fan speed for spin-up. Default: %.2f%%.\n", _g_speed_spin_up);
-	SAY("    --speed-const <N>  ─── Override the entire logic and set the constant speed. Default: disabled.\n");
-	SAY("    -i|--interval <sec>  ─ Iterations delay. Default: %.2f.\n", _g_interval);
+	SAY("    --temp-hyst <T>  ──────── Temperature hysteresis, sets both --temp-rise and --temp-fall. Default: %.2f°C.\n", _g_config.temp_hyst);
+	SAY("    --temp-rise <T>  ──────── Recalculate the speed when the temperature rises by this value. Default: temp-hyst.\n");
+	SAY("    --temp-fall <T>  ──────── The same for the fall. Default: temp-hyst.\n");
+	SAY("    --temp-low <T>  ───────── Lower temperature range limit. Default: %.2f°C.\n", _g_config.temp_low);
+	SAY("    --temp-high <T>  ──────── Upper temperature range limit. Default: %.2f°C.\n", _g_config.temp_high);
+	SAY("    --temp-sensors <paths>  ─ Comma-separated temperature files, the next ones are used");
+	SAY("                              if the previous ones fail. Default: %s.\n", TEMP_DEFAULT_SENSOR);
+	SAY("    --temp-hold <sec>  ────── Keep the last known temperature if all sensors fail. Default: %d.\n", _g_config.temp_hold);
+	SAY("    --temp-fail-speed <N>  ── Fan speed after the hold time. Default: %.2f%%.\n", _g_config.temp_fail_speed);
+	SAY("    --speed-idle <N>  ─────── Fan speed below of the range. Default: %.2f%%.\n", _g_config.speed_idle);
+	SAY("    --speed-low <N>  ──────── Lower fan speed range limit. Default: %.2f%%.\n", _g_config.speed_low);
+	SAY("    --speed-high <N>  ─────── Upper fan speed range limit. Default: %.2f%%.\n", _g_config.speed_high);
+	SAY("    --speed-heat <N>  ─────── Fan speed on overheating. Default: %.2f%%.\n", _g_config.speed_heat);
+	SAY("    --speed-spin-up <N>  ──── Fan speed for spin-up. Default: %.2f%%.\n", _g_config.speed_spin_up);
+	SAY("    --speed-const <N>  ────── Override the entire logic and set the constant speed. Default: disabled.\n");
+	SAY("    --speed-dwell <sec>  ──── Minimal time at the same speed, the overheating is not delayed. Default: disabled.\n");
+	SAY("    --speed-changes <N>  ──── Max PWM changes per minute, the same exception. Default: unlimited.\n");
+	SAY("    -i|--interval <sec>  ──── Iterations delay. The thermal netlink events (trip points, cooling devices)");
+	SAY("                              wake the loop immediately if the kernel supports them. Default: %.2f.\n", _g_config.interval);
+	SAY("Throttling options:");
+	SAY("═══════════════════");
+	SAY("    --throttle-path <path>  ─── The firmware throttle flags file, \"\" to disable.");
+	SAY("                                Default: %s.\n", THROTTLE_DEFAULT_PATH);
+	SAY("    --throttle-cpufreq <dir>  ─ The cpufreq directory to detect the frequency capping, \"\" to disable.");
+	SAY("                                Default: %s.\n", THROTTLE_DEFAULT_CPUFREQ);
+	SAY("    --throttle-speed <N>  ───── Minimal fan speed during the throttling and 30 seconds after it,");
+	SAY("                                0 to monitor only. Default: %.2f%%.\n", _g_config.throttle_speed);
 	SAY("HTTP server options:");
 	SAY("════════════════════");
-	SAY("    --unix <path> ─────── Path to UNIX socket for the /state request. Default: disabled.\n");
+	SAY("    --unix <path> ─────── Path to UNIX socket for the /state and /history requests. Default: disabled.");
+	SAY("                          POST /override?speed=<N>&ttl=<sec> and POST /profile?name=<name>");
+	SAY("                          change the speed and the profile at runtime, use --unix-mode to restrict them.");
+	SAY("                          POST /simulate?temp_low=<T>&speed_high=<N>&...&res=<sec> replays a candidate curve");
+	SAY("                          over the recorded history and compares it with the actual speed.");
+	SAY("                          A socket with the same path passed by systemd (LISTEN_FDS) is used as is,");
+	SAY("                          the same applies to --ctl.\n");
 	SAY("    --unix-rm  ────────── Try to remove old UNIX socket file before binding. Default: disabled.\n");
 	SAY("    --unix-mode <mode>  ─ Set UNIX socket file permissions (like 777). Default: disabled.\n");
+	SAY("Journal options:");
+	SAY("════════════════");
+	SAY("    --journal <path>  ──── Path to the persistent telemetry journal. Default: disabled.\n");
+	SAY("    --journal-size <N>  ─ Journal capacity in samples, 32 bytes each. Default: %d.\n", _g_config.journal_size);
+	SAY("Handover options:");
+	SAY("═════════════════");
+	SAY("    --handover <path>  ──── Save the fan state to the file on a clean exit and leave the fan running.");
+	SAY("                            The next start resumes from it without the full throttle and spin-up.");
+	SAY("                            Note that the fan isn't controlled until then, so use it with a supervisor.");
+	SAY("                            Default: disabled.\n");
+	SAY("    --handover-ttl <sec>  ─ Ignore the older saved state. Default: %d.\n", _g_config.handover_ttl);
+	SAY("Usage options:");
+	SAY("══════════════");
+	SAY("    --usage <path>  ─ Persistent fan usage counters: duty, revolutions, starts and the time in each mode.");
+	SAY("                      They are available by GET /usage anyway, the file keeps them across the restarts.");
+	SAY("                      Default: in memory only.\n");
+	SAY("Control socket options:");
+	SAY("═══════════════════════");
+	SAY("    --ctl <path> ─────── Path to UNIX socket for the binary control protocol (see kvmd-fanctl). Default: disabled.\n");
+	SAY("    --ctl-rm  ────────── Try to remove old control socket file before binding. Default: disabled.\n");
+	SAY("    --ctl-mode <mode>  ─ Set control socket file permissions (like 660). Default: disabled.\n");
+	SAY("Shared memory options:");
+	SAY("══════════════════════");
+	SAY("    --shm <name>  ─────── Export the state to the POSIX shared memory object (like /kvmd-fan). Default: disabled.\n");
+	SAY("    --shm-mode <mode>  ── Set the shared memory object permissions. Default: %o.\n", _g_config.shm_mode);
+	SAY("Real-time options:");
+	SAY("══════════════════");
+	SAY("    --rt-policy <fifo|rr>  ─ Real-time scheduling policy for the loop and Hall threads. Default: %s.\n",
+		rt_policy_to_string(_g_config.rt.policy));
+	SAY("    --rt-prio <N>  ───────── Real-time priority 1..99 for the loop and Hall threads,");
+	SAY("                             HTTP and control threads stay at the normal priority.");
+	SAY("                             Requires CAP_SYS_NICE. Default: 0 (disabled).\n");
+	SAY("    --rt-cpu <N>  ────────── Pin the loop and Hall threads to the CPU. Default: disabled.\n");
+	SAY("    --mlock  ─────────────── Lock the memory after init to avoid page faults. Default: disabled.\n");
+	SAY("Simulation options:");
+	SAY("═══════════════════");
+	SAY("    --sim  ──────────────── Replace the thermal zone, PWM and Hall sensor with a simulated");
+	SAY("                            thermal plant and fan. No hardware is required. Default: disabled.\n");
+	SAY("    --sim-speed <N>  ────── Run N times faster than real time, 0 for as fast as possible. Default: %.0f.\n",
+		_g_config.sim_params.speedup);
+	SAY("    --sim-duration <sec>  ─ Stop after the simulated time and print the summary. Default: unlimited.\n");
+	SAY("    --sim-ambient <N>  ──── Ambient temperature. Default: %.0f°C.\n", _g_config.sim_params.ambient);
+	SAY("    --sim-load <spec>  ──── Repeated heat input schedule, <sec>:<watts>,... Default: 300:3,300:7.\n");
+	SAY("    --sim-stall <spec>  ─── Stall the fan, <start_sec>:<sec>,... Default: disabled.\n");
 	SAY("Config options:");
 	SAY("═══════════════");
-	SAY("    -c|--config <path>  ─ Path to the INI config file. Default: disabled.\n");
+	SAY("    -c|--config <path>  ─ Path to the INI config file. Default: disabled.");
+	SAY("                          On SIGHUP the options and the config are re-read and applied");
+	SAY("                          without stopping the fan, except the pins and --sim-* options.\n");
+	SAY("    --profile <name>  ─── Active profile from the [profile.<name>] config sections. Default: default.");
+	SAY("                          The [rule.<name>] sections choose the profile and limit the speed on each tick:");
+	SAY("                            - conditions: time=HH:MM-HH:MM, days=mon,..., load_above=<N>, load_below=<N>,");
+	SAY("                              file=[!]<path>; all the specified ones should match;");
+	SAY("                            - actions: profile=<name>, speed_max=<N> (noise ceiling) which is lifted");
+	SAY("                              at temp_emergency=<T> (default: the temp-high of the profile).");
+	SAY("                          The first matched rule with a profile wins, the lowest matched ceiling is used.\n");
 	SAY("Logging options:");
 	SAY("════════════════");
 	SAY("    --verbose  ─ Enable verbose messages. Default: disabled.\n");
 	SAY("    --debug  ─── Enable verbose and debug messages. Default: disabled.\n");
+	SAY("    --log-rate <N>  ─── Allow at most N messages per minute from each call site,");
+	SAY("                        the rest are counted and summarized in the next passed message.");
+	SAY("                        Default: 0 (unlimited).\n");
+	SAY("    --log-burst <N>  ── Number of messages a call site can log at once before");
+	SAY("                        the rate limit kicks in. Default: %u.\n", log_burst);
+	SAY("    --log-structured  ─ Print messages as key=value pairs:");
+	SAY("                        ts=<sec> level=<level> class=<class> msg=\"<text>\" [suppressed=<N>].");
+	SAY("                        Default: disabled.\n");
 	SAY("Help options:");
 	SAY("═════════════");
 	SAY("    -h|--help  ──── Print this text and exit.\n");
@@ -0,0 +1,63 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "override.h"
+
+
+#define _NONE		UINT16_MAX
+#define _TS_MASK	((UINT64_C(1) << 48) - 1)
+
+
+void override_init(override_s *override) {
+	atomic_init(&override->value, _NONE);
+	atomic_init(&override->seq, 0);
+}
+
+void override_set(override_s *override, float speed, int64_t ttl_ns) {
+	assert(speed >= 0 && speed <= 100);
+	assert(ttl_ns >= 0);
+	// Rounded up, so any positive TTL expires and never turns into 0 = forever
+	const uint64_t until = (ttl_ns > 0 ? (uint64_t)((get_now_monotonic_ns() + ttl_ns + NS_PER_MS - 1) / NS_PER_MS) & _TS_MASK : 0);
+	atomic_store(&override->value, (until << 16) | (uint64_t)lroundf(speed * 100));
+	atomic_fetch_add(&override->seq, 1);
+}
+
+void override_clear(override_s *override) {
+	atomic_store(&override->value, _NONE);
+	atomic_fetch_add(&override->seq, 1);
+}
+
+bool override_get(override_s *override, float *speed) {
+	const uint64_t value = atomic_load(&override->value);
+	if ((value & 0xFFFF) == _NONE) {
+		return false;
+	}
+	const uint64_t until = value >> 16;
+	if (until > 0 && (uint64_t)(get_now_monotonic_ns() / NS_PER_MS) >= until) {
+		// Don't drop a newer override that could be set concurrently
+		uint64_t expected = value;
+		atomic_compare_exchange_strong(&override->value, &expected, _NONE);
+		return false;
+	}
+	*speed = (float)(value & 0xFFFF) / 100;
+	return true;
+}
@@ -0,0 +1,45 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+
+#include "tools.h"
+
+
+// Speed (x100) and expiration time (monotonic ms) are packed into the single word,
+// so the loop can read them without locking.
+typedef struct {
+	atomic_uint_least64_t	value;
+	atomic_uint				seq; // Incremented on each change, for waking up the loop
+} override_s;
+
+
+void override_init(override_s *override);
+
+void override_set(override_s *override, float speed, int64_t ttl_ns); // 0 for no expiration
+void override_clear(override_s *override);
+bool override_get(override_s *override, float *speed);
@@ -0,0 +1,135 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "profile.h"
+
+
+static int _find(const profiles_s *profiles, const char *name);
+
+
+void profile_init(profile_s *profile, const char *name) {
+	assert(strlen(name) < PROFILE_NAME_SIZE);
+	strcpy(profile->name, name);
+	profile->params = (control_params_s){
+		.temp_rise = NAN, .temp_fall = NAN, .temp_low = NAN, .temp_high = NAN,
+		.speed_idle = NAN, .speed_low = NAN, .speed_high = NAN, .speed_heat = NAN, .speed_spin_up = NAN,
+		.speed_dwell = NAN, .speed_changes = NAN,
+	};
+}
+
+void profile_apply(const profile_s *profile, control_params_s *params) {
+#	define APPLY(_field) { if (!isnan(profile->params._field)) { params->_field = profile->params._field; } }
+	APPLY(temp_rise);
+	APPLY(temp_fall);
+	APPLY(temp_low);
+	APPLY(temp_high);
+	APPLY(speed_idle);
+	APPLY(speed_low);
+	APPLY(speed_high);
+	APPLY(speed_heat);
+	APPLY(speed_spin_up);
+	APPLY(speed_dwell);
+	APPLY(speed_changes);
+#	undef APPLY
+}
+
+void profiles_init(profiles_s *profiles) {
+	memset(profiles->names, 0, sizeof(profiles->names));
+	profiles->count = 0;
+	A_MUTEX_INIT(&profiles->mutex);
+	atomic_init(&profiles->active, -1);
+	atomic_init(&profiles->effective, -1);
+	atomic_init(&profiles->seq, 0);
+}
+
+void profiles_destroy(profiles_s *profiles) {
+	A_MUTEX_DESTROY(&profiles->mutex);
+}
+
+void profiles_set(profiles_s *profiles, const profile_s *list, unsigned count, const char *fallback) {
+	// Called on start and on reload: the active profile is kept by the name
+	// if it's still defined, otherwise the fallback one is used.
+	assert(count <= PROFILE_MAX);
+	A_MUTEX_LOCK(&profiles->mutex);
+	char active[PROFILE_NAME_SIZE] = {0};
+	const int prev = atomic_load(&profiles->active);
+	if (prev >= 0) {
+		strcpy(active, profiles->names[prev]);
+	}
+	for (unsigned index = 0; index < count; ++index) {
+		strcpy(profiles->names[index], list[index].name);
+	}
+	profiles->count = count;
+	int next = _find(profiles, active);
+	if (next < 0) {
+		next = _find(profiles, fallback);
+	}
+	if (next != prev) {
+		atomic_store(&profiles->active, next);
+		atomic_fetch_add(&profiles->seq, 1);
+	}
+	A_MUTEX_UNLOCK(&profiles->mutex);
+}
+
+int profiles_select(profiles_s *profiles, const char *name) {
+	int retval = 0;
+	A_MUTEX_LOCK(&profiles->mutex);
+	const int index = _find(profiles, name);
+	if (index < 0 && strcmp(name, "default")) {
+		retval = -1;
+	} else {
+		atomic_store(&profiles->active, index);
+		atomic_fetch_add(&profiles->seq, 1);
+	}
+	A_MUTEX_UNLOCK(&profiles->mutex);
+	return retval;
+}
+
+int profiles_get_active(profiles_s *profiles) {
+	return atomic_load(&profiles->active);
+}
+
+void profiles_set_effective(profiles_s *profiles, int index) {
+	atomic_store(&profiles->effective, index);
+}
+
+unsigned profiles_get_names(profiles_s *profiles, char names[PROFILE_MAX][PROFILE_NAME_SIZE], int *active, int *effective) {
+	A_MUTEX_LOCK(&profiles->mutex);
+	memcpy(names, profiles->names, sizeof(profiles->names));
+	const unsigned count = profiles->count;
+	*active = atomic_load(&profiles->active);
+	*effective = atomic_load(&profiles->effective);
+	if (*effective >= (int)count) {
+		*effective = -1; // The loop hasn't seen the reloaded config yet
+	}
+	A_MUTEX_UNLOCK(&profiles->mutex);
+	return count;
+}
+
+static int _find(const profiles_s *profiles, const char *name) {
+	for (unsigned index = 0; index < profiles->count; ++index) {
+		if (!strcmp(profiles->names[index], name)) {
+			return index;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,70 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "tools.h"
+#include "control.h"
+
+
+#define PROFILE_MAX			8
+#define PROFILE_NAME_SIZE	32
+
+
+// A named set of the control params on top of the base config, NAN for the inherited ones
+typedef struct {
+	char				name[PROFILE_NAME_SIZE];
+	control_params_s	params;
+} profile_s;
+
+// The active profile shared between the loop and the HTTP server.
+// The loop only reads the atomic index, the names are for the server.
+typedef struct {
+	char			names[PROFILE_MAX][PROFILE_NAME_SIZE];
+	unsigned		count;
+	pthread_mutex_t	mutex;
+
+	atomic_int		active; // Index of the profile, -1 for the base config
+	atomic_int		effective; // The one used by the loop, can be chosen by the rules
+	atomic_uint		seq; // Incremented on each switch
+} profiles_s;
+
+
+void profile_init(profile_s *profile, const char *name);
+void profile_apply(const profile_s *profile, control_params_s *params);
+
+void profiles_init(profiles_s *profiles);
+void profiles_destroy(profiles_s *profiles);
+
+void profiles_set(profiles_s *profiles, const profile_s *list, unsigned count, const char *fallback);
+int profiles_select(profiles_s *profiles, const char *name);
+int profiles_get_active(profiles_s *profiles);
+void profiles_set_effective(profiles_s *profiles, int index);
+unsigned profiles_get_names(profiles_s *profiles, char names[PROFILE_MAX][PROFILE_NAME_SIZE], int *active, int *effective);
@@ -0,0 +1,108 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+// Fixed-layout protocol of the local control socket (AF_UNIX, SOCK_SEQPACKET).
+// Every message is a single packet. The client sends proto_request_s
+// and gets one or more proto_response_s:
+//   - GET_STATE: one response with the state.
+//   - GET_HISTORY: a series of responses with up to PROTO_MAX_POINTS points,
+//     the last one has PROTO_FLAG_MORE cleared.
+//   - SET_OVERRIDE: one empty response. A negative speed clears the override,
+//     zero TTL means no expiration.
+//   - SUBSCRIBE: one empty response, then a GET_STATE-like response
+//     after each loop iteration until the client disconnects.
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "shm.h"
+
+
+#define PROTO_MAGIC			0x464BU // "KF"
+#define PROTO_VERSION		2U
+#define PROTO_MAX_POINTS	1024U
+#define PROTO_FLAG_MORE		1U
+
+typedef enum {
+	PROTO_CMD_GET_STATE = 1,
+	PROTO_CMD_GET_HISTORY = 2,
+	PROTO_CMD_SET_OVERRIDE = 3,
+	PROTO_CMD_SUBSCRIBE = 4,
+} proto_cmd_e;
+
+typedef enum {
+	PROTO_STATUS_OK = 0,
+	PROTO_STATUS_BAD_REQUEST = 1,
+	PROTO_STATUS_UNAVAILABLE = 2,
+} proto_status_e;
+
+typedef struct {
+	uint16_t	magic;
+	uint8_t		version;
+	uint8_t		cmd;
+	uint32_t	reserved;
+	union {
+		struct {
+			uint32_t	res;
+			uint32_t	reserved;
+			int64_t		from_ms; // INT64_MIN/INT64_MAX for an open range
+			int64_t		to_ms;
+		} history;
+		struct {
+			float		speed;
+			uint32_t	ttl; // Seconds
+		} override;
+	};
+} proto_request_s;
+
+typedef struct {
+	int64_t		ts_ms;
+	int16_t		temp_min; // Fixed-point x100
+	int16_t		temp_max;
+	int16_t		temp_avg;
+	uint16_t	speed_min; // Fixed-point x100
+	uint16_t	speed_max;
+	uint16_t	speed_avg;
+	uint16_t	rpm_min;
+	uint16_t	rpm_max;
+	uint16_t	rpm_avg;
+	uint8_t		reserved[6];
+} proto_point_s;
+
+typedef struct {
+	uint16_t	magic;
+	uint8_t		version;
+	uint8_t		cmd;
+	uint8_t		status;
+	uint8_t		flags;
+	uint16_t	count; // Number of points
+	union {
+		kvmd_fan_shm_state_s	state;
+		proto_point_s			points[PROTO_MAX_POINTS];
+	};
+} proto_response_s;
+
+#define PROTO_RESPONSE_SIZE(_count)	(offsetof(proto_response_s, points) + (_count) * sizeof(proto_point_s))
+#define PROTO_STATE_RESPONSE_SIZE	(offsetof(proto_response_s, state) + sizeof(kvmd_fan_shm_state_s))
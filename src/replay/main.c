@@ -0,0 +1,606 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <math.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "../const.h"
+#include "../tools.h"
+#include "../history.h"
+#include "../encode.h"
+#include "../control.h"
+#include "../sim.h"
+
+
+#define _MAX_SWEEPS		8
+#define _MAX_CONFIGS	10000000
+
+
+enum _OPT_VALUES {
+	_O_HELP = 'h',
+	_O_VERSION = 'v',
+	_O_JOBS = 'j',
+
+	_O_TEMP_HYST = 10000,
+	_O_TEMP_RISE,
+	_O_TEMP_FALL,
+	_O_TEMP_LOW,
+	_O_TEMP_HIGH,
+	_O_SPEED_IDLE,
+	_O_SPEED_LOW,
+	_O_SPEED_HIGH,
+	_O_SPEED_HEAT,
+	_O_SPEED_SPIN_UP,
+	_O_SPEED_DWELL,
+	_O_SPEED_CHANGES,
+	_O_PWM_LOW,
+	_O_PWM_HIGH,
+	_O_THRESHOLD,
+	_O_INTERVAL,
+	_O_SIM_AMBIENT,
+	_O_SWEEP,
+};
+
+static const char *const _SHORT_OPTS = "hvj:";
+static const struct option _LONG_OPTS[] = {
+	{"temp-hyst",		required_argument,	NULL,	_O_TEMP_HYST},
+	{"temp-rise",		required_argument,	NULL,	_O_TEMP_RISE},
+	{"temp-fall",		required_argument,	NULL,	_O_TEMP_FALL},
+	{"temp-low",		required_argument,	NULL,	_O_TEMP_LOW},
+	{"temp-high",		required_argument,	NULL,	_O_TEMP_HIGH},
+	{"speed-idle",		required_argument,	NULL,	_O_SPEED_IDLE},
+	{"speed-low",		required_argument,	NULL,	_O_SPEED_LOW},
+	{"speed-high",		required_argument,	NULL,	_O_SPEED_HIGH},
+	{"speed-heat",		required_argument,	NULL,	_O_SPEED_HEAT},
+	{"speed-spin-up",	required_argument,	NULL,	_O_SPEED_SPIN_UP},
+	{"speed-dwell",		required_argument,	NULL,	_O_SPEED_DWELL},
+	{"speed-changes",	required_argument,	NULL,	_O_SPEED_CHANGES},
+	{"pwm-low",			required_argument,	NULL,	_O_PWM_LOW},
+	{"pwm-high",		required_argument,	NULL,	_O_PWM_HIGH},
+	{"threshold",		required_argument,	NULL,	_O_THRESHOLD},
+	{"interval",		required_argument,	NULL,	_O_INTERVAL},
+	{"sim-ambient",		required_argument,	NULL,	_O_SIM_AMBIENT},
+	{"sweep",			required_argument,	NULL,	_O_SWEEP},
+	{"jobs",			required_argument,	NULL,	_O_JOBS},
+	{"help",			no_argument,		NULL,	_O_HELP},
+	{"version",			no_argument,		NULL,	_O_VERSION},
+	{NULL, 0, NULL, 0},
+};
+
+static const struct {
+	const char	*name;
+	size_t		offset;
+} _PARAMS[] = {
+	{"temp_rise",		offsetof(control_params_s, temp_rise)},
+	{"temp_fall",		offsetof(control_params_s, temp_fall)},
+	{"temp_low",		offsetof(control_params_s, temp_low)},
+	{"temp_high",		offsetof(control_params_s, temp_high)},
+	{"speed_idle",		offsetof(control_params_s, speed_idle)},
+	{"speed_low",		offsetof(control_params_s, speed_low)},
+	{"speed_high",		offsetof(control_params_s, speed_high)},
+	{"speed_heat",		offsetof(control_params_s, speed_heat)},
+	{"speed_spin_up",	offsetof(control_params_s, speed_spin_up)},
+	{"speed_dwell",		offsetof(control_params_s, speed_dwell)},
+	{"speed_changes",	offsetof(control_params_s, speed_changes)},
+};
+#define _PARAMS_COUNT (sizeof(_PARAMS) / sizeof(_PARAMS[0]))
+
+typedef struct {
+	double	ts;
+	float	temp;
+	float	load; // Watts, NAN if the trace has only temperatures
+} _sample_s;
+
+typedef struct {
+	unsigned	param;
+	float		from;
+	float		to;
+	float		step;
+	unsigned	count;
+} _sweep_s;
+
+typedef struct {
+	bool		valid;
+	double		duration;
+	double		above; // Seconds above the threshold
+	float		temp_max;
+	double		temp_avg;
+	double		speed_avg;
+	float		speed_max;
+	unsigned	pwm_changes;
+	unsigned	spin_ups;
+	double		noise_db;
+} _result_s;
+
+
+static control_params_s _g_params = {
+	.temp_rise = 3,
+	.temp_fall = 3,
+	.temp_low = 45,
+	.temp_high = 75,
+	.speed_idle = 25,
+	.speed_low = 25,
+	.speed_high = 75,
+	.speed_heat = 100,
+	.speed_spin_up = 75,
+};
+static unsigned _g_pwm_low = 0;
+static unsigned _g_pwm_high = 1024;
+static float _g_threshold = NAN;
+static float _g_interval = 1;
+static float _g_sim_ambient = NAN;
+static _sweep_s _g_sweeps[_MAX_SWEEPS];
+static unsigned _g_sweeps_count = 0;
+static unsigned _g_jobs = 0;
+
+static _sample_s *_g_samples = NULL;
+static size_t _g_samples_count = 0;
+static bool _g_closed_loop = false;
+static size_t _g_configs_count = 1;
+static atomic_size_t _g_next_config;
+static _result_s *_g_results = NULL;
+
+
+static int _parse_sweep(const char *str);
+static int _load_trace(FILE *fp);
+static int _load_csv(const char *text);
+static int _load_history(const uint8_t *data, size_t size);
+static control_params_s _get_config(size_t index);
+static void *_worker_thread(void *arg);
+static void _replay_open(const control_params_s *params, _result_s *result);
+static void _replay_closed(const control_params_s *params, _result_s *result);
+static void _account(const control_params_s *params, _result_s *result, float temp, float speed, double dt);
+static void _finish(_result_s *result);
+static float *_get_param(control_params_s *params, unsigned index);
+static void _help(void);
+
+
+int main(int argc, char *argv[]) {
+	for (int ch; (ch = getopt_long(argc, argv, _SHORT_OPTS, _LONG_OPTS, NULL)) >= 0;) {
+		switch (ch) {
+			case _O_TEMP_HYST:		_g_params.temp_rise = _g_params.temp_fall = strtof(optarg, NULL); break;
+			case _O_TEMP_RISE:		_g_params.temp_rise = strtof(optarg, NULL); break;
+			case _O_TEMP_FALL:		_g_params.temp_fall = strtof(optarg, NULL); break;
+			case _O_TEMP_LOW:		_g_params.temp_low = strtof(optarg, NULL); break;
+			case _O_TEMP_HIGH:		_g_params.temp_high = strtof(optarg, NULL); break;
+			case _O_SPEED_IDLE:		_g_params.speed_idle = strtof(optarg, NULL); break;
+			case _O_SPEED_LOW:		_g_params.speed_low = strtof(optarg, NULL); break;
+			case _O_SPEED_HIGH:		_g_params.speed_high = strtof(optarg, NULL); break;
+			case _O_SPEED_HEAT:		_g_params.speed_heat = strtof(optarg, NULL); break;
+			case _O_SPEED_SPIN_UP:	_g_params.speed_spin_up = strtof(optarg, NULL); break;
+			case _O_SPEED_DWELL:	_g_params.speed_dwell = strtof(optarg, NULL); break;
+			case _O_SPEED_CHANGES:	_g_params.speed_changes = strtof(optarg, NULL); break;
+			case _O_PWM_LOW:		_g_pwm_low = strtoul(optarg, NULL, 10); break;
+			case _O_PWM_HIGH:		_g_pwm_high = strtoul(optarg, NULL, 10); break;
+			case _O_THRESHOLD:		_g_threshold = strtof(optarg, NULL); break;
+			case _O_INTERVAL:		_g_interval = strtof(optarg, NULL); break;
+			case _O_SIM_AMBIENT:	_g_sim_ambient = strtof(optarg, NULL); break;
+			case _O_JOBS:			_g_jobs = strtoul(optarg, NULL, 10); break;
+			case _O_SWEEP:
+				if (_parse_sweep(optarg) < 0) {
+					fprintf(stderr, "Invalid sweep '%s', should be <param>=<from>:<to>:<step>\n", optarg);
+					return 1;
+				}
+				break;
+			case _O_HELP:			_help(); return 0;
+			case _O_VERSION:		puts(VERSION); return 0;
+			default:				return 1;
+		}
+	}
+	if (_g_interval <= 0 || _g_pwm_low >= _g_pwm_high || _g_pwm_high > 1024) {
+		fputs("Invalid --interval or --pwm-* options\n", stderr);
+		return 1;
+	}
+
+	FILE *fp = stdin;
+	if (optind < argc && strcmp(argv[optind], "-")) {
+		if ((fp = fopen(argv[optind], "r")) == NULL) {
+			fprintf(stderr, "Can't open '%s': %s\n", argv[optind], strerror(errno));
+			return 1;
+		}
+	}
+	const int loaded = _load_trace(fp);
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	if (loaded < 0) {
+		return 1;
+	}
+
+	if (_g_jobs == 0) {
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		_g_jobs = (cpus > 0 ? cpus : 1);
+	}
+	if (_g_jobs > _g_configs_count) {
+		_g_jobs = _g_configs_count;
+	}
+	fprintf(stderr, "Replaying %zu samples (%s loop) for %zu configs on %u threads ...\n",
+		_g_samples_count, (_g_closed_loop ? "closed" : "open"), _g_configs_count, _g_jobs);
+
+	A_CALLOC(_g_results, _g_configs_count);
+	atomic_init(&_g_next_config, 0);
+	const int64_t begin_ns = get_now_monotonic_ns();
+
+	pthread_t *tids;
+	A_CALLOC(tids, _g_jobs);
+	for (unsigned index = 0; index < _g_jobs; ++index) {
+		A_THREAD_CREATE(&tids[index], _worker_thread, NULL);
+	}
+	for (unsigned index = 0; index < _g_jobs; ++index) {
+		A_THREAD_JOIN(tids[index]);
+	}
+	free(tids);
+
+	fprintf(stderr, "Done in %.3Lf seconds\n", ns_to_sec(get_now_monotonic_ns() - begin_ns));
+
+	for (unsigned index = 0; index < _PARAMS_COUNT; ++index) {
+		printf("%s,", _PARAMS[index].name);
+	}
+	puts("duration,above_sec,above_pct,temp_max,temp_avg,speed_avg,speed_max,pwm_changes,spin_ups,noise_db");
+	size_t invalid = 0;
+	for (size_t config = 0; config < _g_configs_count; ++config) {
+		const _result_s *const result = &_g_results[config];
+		if (!result->valid) {
+			++invalid;
+			continue;
+		}
+		control_params_s params = _get_config(config);
+		for (unsigned index = 0; index < _PARAMS_COUNT; ++index) {
+			printf("%g,", *_get_param(&params, index));
+		}
+		printf("%.0f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%u,%u,%.2f\n",
+			result->duration, result->above, (result->duration > 0 ? result->above / result->duration * 100 : 0),
+			result->temp_max, result->temp_avg, result->speed_avg, result->speed_max,
+			result->pwm_changes, result->spin_ups, result->noise_db);
+	}
+	if (invalid > 0) {
+		fprintf(stderr, "Skipped %zu invalid configs\n", invalid);
+	}
+
+	free(_g_results);
+	free(_g_samples);
+	return 0;
+}
+
+static int _parse_sweep(const char *str) {
+	if (_g_sweeps_count >= _MAX_SWEEPS) {
+		return -1;
+	}
+	const char *const eq = strchr(str, '=');
+	if (eq == NULL) {
+		return -1;
+	}
+	_sweep_s *const sweep = &_g_sweeps[_g_sweeps_count];
+	sweep->param = _PARAMS_COUNT;
+	for (unsigned index = 0; index < _PARAMS_COUNT; ++index) {
+		const size_t len = strlen(_PARAMS[index].name);
+		if ((size_t)(eq - str) == len && !strncmp(str, _PARAMS[index].name, len)) {
+			sweep->param = index;
+			break;
+		}
+	}
+	if (sweep->param == _PARAMS_COUNT) {
+		return -1;
+	}
+	if (sscanf(eq + 1, "%f:%f:%f", &sweep->from, &sweep->to, &sweep->step) != 3 || sweep->step <= 0 || sweep->to < sweep->from) {
+		return -1;
+	}
+	sweep->count = floorf((sweep->to - sweep->from) / sweep->step + 1e-3) + 1;
+	if (_g_configs_count * sweep->count > _MAX_CONFIGS) {
+		return -1;
+	}
+	_g_configs_count *= sweep->count;
+	++_g_sweeps_count;
+	return 0;
+}
+
+static int _load_trace(FILE *fp) {
+	size_t size = 0;
+	size_t cap = 65536;
+	uint8_t *data;
+	A_CALLOC(data, cap + 1);
+	for (size_t len; (len = fread(data + size, 1, cap - size, fp)) > 0;) {
+		size += len;
+		if (size == cap) {
+			cap *= 2;
+			assert((data = realloc(data, cap + 1)) != NULL);
+		}
+	}
+	data[size] = '\0';
+
+	const int retval = (decode_kind(data, size) == ENCODE_KIND_HISTORY
+		? _load_history(data, size)
+		: _load_csv((const char *)data));
+	free(data);
+
+	if (retval == 0 && _g_samples_count < 2) {
+		fputs("The trace needs at least two samples\n", stderr);
+		return -1;
+	}
+	return retval;
+}
+
+static int _load_csv(const char *text) {
+	// "ts,temp", "ts,load" or "ts,temp,load" with an optional header, '#' for comments.
+	// Without the header the columns are "ts,temp".
+	int temp_col = 1;
+	int load_col = -1;
+	size_t cap = 0;
+	unsigned line_number = 0;
+
+	for (const char *line = text; *line != '\0';) {
+		const char *const end = line + strcspn(line, "\n");
+		++line_number;
+
+		if (line != end && *line != '#') {
+			if (!(isdigit(*line) || *line == '-' || *line == '.')) {
+				// Header
+				temp_col = load_col = -1;
+				int col = 0;
+				for (const char *ptr = line; ptr < end; ++col) {
+					const size_t len = strcspn(ptr, ",\r\n");
+					if (len == 4 && !strncmp(ptr, "temp", 4)) {
+						temp_col = col;
+					} else if (len == 4 && !strncmp(ptr, "load", 4)) {
+						load_col = col;
+					}
+					ptr += len + (ptr[len] == ',' ? 1 : len == 0 ? 1 : 0);
+				}
+				if (temp_col < 0 && load_col < 0) {
+					fprintf(stderr, "CSV line %u: no temp or load column\n", line_number);
+					return -1;
+				}
+			} else {
+				if (_g_samples_count == cap) {
+					cap = (cap ? cap * 2 : 4096);
+					assert((_g_samples = realloc(_g_samples, cap * sizeof(_sample_s))) != NULL);
+				}
+				_sample_s *const sample = &_g_samples[_g_samples_count];
+				sample->temp = NAN;
+				sample->load = NAN;
+
+				const char *ptr = line;
+				for (int col = 0; ptr < end; ++col) {
+					char *num_end;
+					const double value = strtod(ptr, &num_end);
+					if (num_end == ptr) {
+						fprintf(stderr, "CSV line %u: invalid number\n", line_number);
+						return -1;
+					}
+					if (col == 0) {
+						sample->ts = value;
+					} else if (col == temp_col) {
+						sample->temp = value;
+					} else if (col == load_col) {
+						sample->load = value;
+					}
+					ptr = num_end + (*num_end == ',' ? 1 : 0);
+					if (*num_end != ',') {
+						break;
+					}
+				}
+				if (_g_samples_count > 0 && sample->ts < _g_samples[_g_samples_count - 1].ts) {
+					fprintf(stderr, "CSV line %u: timestamps must be ascending\n", line_number);
+					return -1;
+				}
+				if (load_col >= 0 ? isnan(sample->load) : isnan(sample->temp)) {
+					fprintf(stderr, "CSV line %u: missing value\n", line_number);
+					return -1;
+				}
+				++_g_samples_count;
+			}
+		}
+		line = (*end == '\n' ? end + 1 : end);
+	}
+	_g_closed_loop = (load_col >= 0);
+	return 0;
+}
+
+static int _load_history(const uint8_t *data, size_t size) {
+	unsigned res;
+	history_point_s *points;
+	size_t count;
+	if (decode_history_binary(data, size, &res, &points, &count) < 0) {
+		fputs("Can't decode the history\n", stderr);
+		return -1;
+	}
+	A_CALLOC(_g_samples, count + 1);
+	for (size_t index = 0; index < count; ++index) {
+		_g_samples[index] = (_sample_s){.ts = points[index].ts, .temp = points[index].temp.avg, .load = NAN};
+	}
+	_g_samples_count = count;
+	free(points);
+	return 0;
+}
+
+static control_params_s _get_config(size_t index) {
+	control_params_s params = _g_params;
+	for (unsigned sweep = 0; sweep < _g_sweeps_count; ++sweep) {
+		const _sweep_s *const ptr = &_g_sweeps[sweep];
+		*_get_param(&params, ptr->param) = ptr->from + ptr->step * (index % ptr->count);
+		index /= ptr->count;
+	}
+	return params;
+}
+
+static void *_worker_thread(UNUSED void *arg) {
+	size_t config;
+	while ((config = atomic_fetch_add(&_g_next_config, 1)) < _g_configs_count) {
+		const control_params_s params = _get_config(config);
+		_result_s *const result = &_g_results[config];
+		if (control_check_params(&params) != NULL) {
+			continue;
+		}
+		if (_g_closed_loop) {
+			_replay_closed(&params, result);
+		} else {
+			_replay_open(&params, result);
+		}
+		_finish(result);
+	}
+	return NULL;
+}
+
+static void _replay_open(const control_params_s *params, _result_s *result) {
+	// The recorded temperature doesn't depend on the fan, so this shows
+	// how a policy would have reacted, but not how it would have cooled.
+	control_s control;
+	control_init(&control, -1);
+	unsigned pwm = 0;
+	for (size_t index = 0; index < _g_samples_count - 1; ++index) {
+		const _sample_s *const sample = &_g_samples[index];
+		const unsigned flags = control_step(params, &control, sample->ts * NS_PER_SEC, sample->temp, -1, false);
+		if (flags & CONTROL_SPIN_UP) {
+			result->spin_ups += 1;
+		}
+		if (flags & CONTROL_SPEED_CHANGED) {
+			const unsigned new_pwm = control_get_pwm(control.speed, _g_pwm_low, _g_pwm_high);
+			if (new_pwm != pwm) {
+				result->pwm_changes += 1;
+				pwm = new_pwm;
+			}
+		}
+		_account(params, result, sample->temp, control.speed, _g_samples[index + 1].ts - sample->ts);
+	}
+}
+
+static void _replay_closed(const control_params_s *params, _result_s *result) {
+	// The trace is the heat input, the temperature comes from the simulated plant
+	sim_params_s sim_params;
+	sim_params_init(&sim_params);
+	sim_params.speedup = 0;
+	if (!isnan(_g_sim_ambient)) {
+		sim_params.ambient = _g_sim_ambient;
+	}
+	sim_s *const sim = sim_init(&sim_params);
+	const atomic_bool stop = false;
+
+	control_s control;
+	control_init(&control, -1);
+	unsigned pwm = 0;
+	const int64_t interval_ns = _g_interval * NS_PER_SEC;
+	const double begin_ts = _g_samples[0].ts;
+	const double end_ts = _g_samples[_g_samples_count - 1].ts;
+	size_t index = 0;
+
+	while (true) {
+		const double ts = begin_ts + ns_to_sec(sim_get_now_ns(sim) - sim->start_ns);
+		if (ts >= end_ts) {
+			break;
+		}
+		while (index + 1 < _g_samples_count && _g_samples[index + 1].ts <= ts) {
+			++index;
+		}
+		sim_set_heat(sim, _g_samples[index].load);
+
+		const int64_t before_ns = sim_get_now_ns(sim);
+		const float temp = sim_get_temp(sim);
+		const unsigned flags = control_step(params, &control, before_ns, temp, -1, false);
+		if (flags & CONTROL_SPIN_UP) {
+			result->spin_ups += 1;
+			sim_set_duty(sim, control_get_pwm(params->speed_spin_up, _g_pwm_low, _g_pwm_high) / 1024.0);
+			sim_run_until(sim, sim_get_now_ns(sim) + 2 * NS_PER_SEC, &stop);
+		}
+		if (flags & CONTROL_SPEED_CHANGED) {
+			const unsigned new_pwm = control_get_pwm(control.speed, _g_pwm_low, _g_pwm_high);
+			if (new_pwm != pwm) {
+				result->pwm_changes += 1;
+				pwm = new_pwm;
+			}
+			sim_set_duty(sim, pwm / 1024.0);
+		}
+
+		sim_run_until(sim, sim_get_now_ns(sim) + interval_ns, &stop);
+		_account(params, result, temp, control.speed, ns_to_sec(sim_get_now_ns(sim) - before_ns));
+	}
+	sim_destroy(sim);
+}
+
+static void _account(const control_params_s *params, _result_s *result, float temp, float speed, double dt) {
+	const float threshold = (isnan(_g_threshold) ? params->temp_high : _g_threshold);
+	result->duration += dt;
+	if (temp > threshold) {
+		result->above += dt;
+	}
+	result->temp_max = fmaxf(result->temp_max, temp);
+	result->temp_avg += temp * dt;
+	result->speed_avg += speed * dt;
+	result->speed_max = fmaxf(result->speed_max, speed);
+	// Fan laws: the sound power goes as the 5th power of the speed
+	result->noise_db += pow(speed / 100, 5) * dt;
+}
+
+static void _finish(_result_s *result) {
+	result->valid = true;
+	if (result->duration > 0) {
+		result->temp_avg /= result->duration;
+		result->speed_avg /= result->duration;
+		result->noise_db /= result->duration;
+	}
+	// dB relative to the full speed all the time
+	result->noise_db = (result->noise_db > 0 ? 10 * log10(result->noise_db) : -99);
+}
+
+static float *_get_param(control_params_s *params, unsigned index) {
+	return (float *)((char *)params + _PARAMS[index].offset);
+}
+
+static void _help(void) {
+#	define SAY(_msg, ...) printf(_msg "\n", ##__VA_ARGS__)
+	SAY("\nKVMD-FAN-REPLAY - Offline policy evaluation for kvmd-fan");
+	SAY("════════════════════════════════════════════════════════");
+	SAY("Version: %s; license: GPLv3\n", VERSION);
+	SAY("Usage: kvmd-fan-replay [options] [<trace>|-]\n");
+	SAY("The trace is a CSV or the binary /history (Accept: " ENCODE_MIME_BINARY ").");
+	SAY("CSV columns: ts,temp (open loop, the recorded temperatures are replayed as is)");
+	SAY("or ts,load in watts (closed loop, the temperature comes from the simulated plant).");
+	SAY("The results are printed as CSV, one row per valid config.\n");
+	SAY("Options:");
+	SAY("════════");
+	SAY("    --temp-hyst, --temp-rise, --temp-fall, --temp-low, --temp-high, --speed-idle, --speed-low,");
+	SAY("    --speed-high, --speed-heat, --speed-spin-up, --speed-dwell, --speed-changes  ─ The same as for kvmd-fan.\n");
+	SAY("    --pwm-low <N>, --pwm-high <N>  ─ PWM range for counting the PWM changes. Default: %u...%u.\n",
+		_g_pwm_low, _g_pwm_high);
+	SAY("    --threshold <T>  ─── Count the time above this temperature. Default: temp-high.\n");
+	SAY("    --interval <sec>  ── Control interval for the closed loop. Default: %.2f.\n", _g_interval);
+	SAY("    --sim-ambient <T>  ─ Ambient temperature for the closed loop. Default: the kvmd-fan --sim default.\n");
+	SAY("    --sweep <param>=<from>:<to>:<step>  ─ Sweep the parameter (like temp_fall=1:5:0.5).");
+	SAY("                                          Can be repeated up to %d times, all the combinations", _MAX_SWEEPS);
+	SAY("                                          are evaluated.\n");
+	SAY("    -j|--jobs <N>  ─ Number of threads. Default: number of CPUs.\n");
+	SAY("    -h|--help  ──── Print this text and exit.\n");
+	SAY("    -v|--version  ─ Print version and exit.\n");
+#	undef SAY
+}
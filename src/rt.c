@@ -0,0 +1,95 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "rt.h"
+
+
+int rt_parse_policy(const char *str) {
+	if (!strcmp(str, "fifo")) {
+		return SCHED_FIFO;
+	} else if (!strcmp(str, "rr")) {
+		return SCHED_RR;
+	}
+	return -1;
+}
+
+const char *rt_policy_to_string(int policy) {
+	return (policy == SCHED_RR ? "rr" : "fifo");
+}
+
+int rt_apply(pthread_t tid, const char *name, const rt_s *rt) {
+	// Errors are not fatal here: the fan must be controlled anyway,
+	// even if the daemon has no CAP_SYS_NICE.
+	int retval = 0;
+	int error;
+
+	if (rt->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(rt->cpu, &cpus);
+		if ((error = pthread_setaffinity_np(tid, sizeof(cpus), &cpus)) != 0) {
+			errno = error;
+			LOG_PERROR("rt", "Can't pin the %s thread to CPU %d", name, rt->cpu);
+			retval = -1;
+		} else {
+			LOG_INFO("rt", "Pinned the %s thread to CPU %d", name, rt->cpu);
+		}
+	}
+
+	if (rt->prio > 0) {
+		const struct sched_param param = {.sched_priority = rt->prio};
+		if ((error = pthread_setschedparam(tid, rt->policy, &param)) != 0) {
+			errno = error;
+			LOG_PERROR("rt", "Can't set %s/%u scheduling for the %s thread",
+				rt_policy_to_string(rt->policy), rt->prio, name);
+			retval = -1;
+		} else {
+			LOG_INFO("rt", "Using %s/%u scheduling for the %s thread",
+				rt_policy_to_string(rt->policy), rt->prio, name);
+		}
+	}
+	return retval;
+}
+
+void rt_reset(pthread_t tid) {
+	// Back to the normal scheduling on all CPUs, for spawning the helper threads
+	const struct sched_param param = {.sched_priority = 0};
+	pthread_setschedparam(tid, SCHED_OTHER, &param);
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	const long count = sysconf(_SC_NPROCESSORS_CONF);
+	for (long cpu = 0; cpu < count && cpu < CPU_SETSIZE; ++cpu) {
+		CPU_SET(cpu, &cpus);
+	}
+	pthread_setaffinity_np(tid, sizeof(cpus), &cpus);
+}
+
+int rt_lock_memory(void) {
+	// Fault in and pin the stacks, the heap and the mappings,
+	// so the loop and the Hall thread don't stall on the page faults.
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		LOG_PERROR("rt", "Can't lock the memory");
+		return -1;
+	}
+	LOG_INFO("rt", "Locked the memory");
+	return 0;
+}
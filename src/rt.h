@@ -0,0 +1,50 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "tools.h"
+#include "logging.h"
+
+
+typedef struct {
+	int			policy; // SCHED_FIFO or SCHED_RR
+	unsigned	prio; // 0 to keep the normal scheduling
+	int			cpu; // -1 for any
+} rt_s;
+
+
+int rt_parse_policy(const char *str);
+const char *rt_policy_to_string(int policy);
+
+int rt_apply(pthread_t tid, const char *name, const rt_s *rt);
+void rt_reset(pthread_t tid);
+int rt_lock_memory(void);
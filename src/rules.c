@@ -0,0 +1,275 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "rules.h"
+
+
+static int _parse_hhmm(const char *str, char **end);
+static bool _is_time_matched(const rule_s *rule, const struct tm *tm);
+static float _read_load(void);
+
+
+void rule_init(rule_s *rule, const char *name) {
+	assert(strlen(name) < RULE_NAME_SIZE);
+	memset(rule, 0, sizeof(*rule));
+	strcpy(rule->name, name);
+	rule->time_begin = -1;
+	rule->time_end = -1;
+	rule->days = 0x7F;
+	rule->load_above = NAN;
+	rule->load_below = NAN;
+	rule->profile_index = -1;
+	rule->speed_max = NAN;
+	rule->temp_emergency = NAN;
+}
+
+int rule_parse_time(rule_s *rule, const char *str) {
+	// "HH:MM-HH:MM", the end is exclusive: "22:00-07:00" is the whole night
+	char *end;
+	const int begin = _parse_hhmm(str, &end);
+	if (begin < 0 || *end != '-') {
+		return -1;
+	}
+	const int stop = _parse_hhmm(end + 1, &end);
+	if (stop < 0 || *end != '\0' || stop == begin) {
+		return -1;
+	}
+	rule->time_begin = begin;
+	rule->time_end = stop;
+	return 0;
+}
+
+int rule_parse_days(rule_s *rule, const char *str) {
+	// "mon,tue,..." in any order
+	static const char *const names[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+	unsigned days = 0;
+	const char *ptr = str;
+	while (true) {
+		const size_t len = strcspn(ptr, ",");
+		unsigned day = 0;
+		for (; day < 7; ++day) {
+			if (len == 3 && !strncasecmp(ptr, names[day], 3)) {
+				break;
+			}
+		}
+		if (day >= 7) {
+			return -1;
+		}
+		days |= (1 << day);
+		if (ptr[len] == '\0') {
+			break;
+		}
+		ptr += len + 1;
+	}
+	rule->days = days;
+	return 0;
+}
+
+int rule_set_file(rule_s *rule, const char *str) {
+	const bool absent = (str[0] == '!');
+	if (absent) {
+		str += 1;
+	}
+	if (str[0] != '/' || strlen(str) >= RULE_PATH_SIZE) {
+		return -1;
+	}
+	strcpy(rule->file, str);
+	rule->file_absent = absent;
+	return 0;
+}
+
+int rule_set_profile(rule_s *rule, const char *str) {
+	if (str[0] == '\0' || strlen(str) >= PROFILE_NAME_SIZE) {
+		return -1;
+	}
+	strcpy(rule->profile, str);
+	return 0;
+}
+
+const char *rules_compile(rules_s *rules, const profile_s *profiles, unsigned profiles_count) {
+	// Resolves everything that can be done once, so rules_eval() is just O(rules)
+	// comparisons plus a few syscalls for the used inputs and doesn't allocate.
+	static char msg[256];
+	rules->need_time = false;
+	rules->need_load = false;
+	rules->need_file = false;
+	for (unsigned index = 0; index < rules->count; ++index) {
+		rule_s *const rule = &rules->list[index];
+		if (rule->profile[0] == '\0' && isnan(rule->speed_max)) {
+			snprintf(msg, sizeof(msg), "Rule '%s': should have a profile or a speed_max", rule->name);
+			return msg;
+		}
+		rule->profile_index = -1;
+		if (rule->profile[0] != '\0' && strcmp(rule->profile, "default")) {
+			unsigned found = 0;
+			for (; found < profiles_count; ++found) {
+				if (!strcmp(profiles[found].name, rule->profile)) {
+					break;
+				}
+			}
+			if (found >= profiles_count) {
+				snprintf(msg, sizeof(msg), "Rule '%s': unknown profile '%s'", rule->name, rule->profile);
+				return msg;
+			}
+			rule->profile_index = found;
+		}
+		if (!isnan(rule->load_above) && !isnan(rule->load_below) && rule->load_above >= rule->load_below) {
+			snprintf(msg, sizeof(msg), "Rule '%s': should be load_above < load_below", rule->name);
+			return msg;
+		}
+		rules->need_time = (rules->need_time || rule->time_begin >= 0 || rule->days != 0x7F);
+		rules->need_load = (rules->need_load || !isnan(rule->load_above) || !isnan(rule->load_below));
+		rules->need_file = (rules->need_file || rule->file[0] != '\0');
+	}
+	if (rules->need_time) {
+		tzset(); // Once, localtime_r() doesn't re-read the zone info
+	}
+	return NULL;
+}
+
+void rules_eval(const rules_s *rules, rules_result_s *result) {
+	result->rule = -1;
+	result->profile = -1;
+	result->speed_max = NAN;
+	result->temp_emergency = NAN;
+	result->emergency_high = false;
+	if (rules->count == 0) {
+		return;
+	}
+
+	struct tm tm = {0};
+	if (rules->need_time) {
+		const time_t now = time(NULL);
+		localtime_r(&now, &tm);
+	}
+	const float load = (rules->need_load ? _read_load() : NAN);
+
+	for (unsigned index = 0; index < rules->count; ++index) {
+		const rule_s *const rule = &rules->list[index];
+		if (rules->need_time && !_is_time_matched(rule, &tm)) {
+			continue;
+		}
+		// An unreadable load doesn't match anything, the comparisons with NAN are false
+		if (!isnan(rule->load_above) && !(load > rule->load_above)) {
+			continue;
+		}
+		if (!isnan(rule->load_below) && !(load < rule->load_below)) {
+			continue;
+		}
+		if (rule->file[0] != '\0' && (access(rule->file, F_OK) == 0) == rule->file_absent) {
+			continue;
+		}
+
+		if (rule->profile[0] != '\0' && result->rule < 0) {
+			result->rule = index;
+			result->profile = rule->profile_index;
+		}
+		if (!isnan(rule->speed_max) && !(result->speed_max <= rule->speed_max)) {
+			result->speed_max = rule->speed_max;
+		}
+		if (!isnan(rule->speed_max)) {
+			if (isnan(rule->temp_emergency)) {
+				result->emergency_high = true;
+			} else if (!(result->temp_emergency <= rule->temp_emergency)) {
+				result->temp_emergency = rule->temp_emergency;
+			}
+		}
+	}
+}
+
+bool rules_limit(const rules_result_s *result, float temp, bool *emergency, control_params_s *params) {
+	// Applies the noise ceiling to the params unless the temperature has reached
+	// the emergency level. It's lifted until the temperature falls below
+	// the emergency level minus the hysteresis, so the fan doesn't flap on the border.
+	if (isnan(result->speed_max)) {
+		*emergency = false;
+		return false;
+	}
+	float temp_emergency = result->temp_emergency;
+	if (result->emergency_high && !(temp_emergency <= params->temp_high)) {
+		temp_emergency = params->temp_high;
+	}
+	if (temp >= temp_emergency) {
+		*emergency = true;
+	} else if (temp < temp_emergency - params->temp_fall) {
+		*emergency = false;
+	}
+	if (*emergency) {
+		return false;
+	}
+#	define LIMIT(_field) { if (params->_field > result->speed_max) { params->_field = result->speed_max; } }
+	LIMIT(speed_idle);
+	LIMIT(speed_low);
+	LIMIT(speed_high);
+	LIMIT(speed_heat);
+#	undef LIMIT
+	return true;
+}
+
+static int _parse_hhmm(const char *str, char **end) {
+	const long hours = strtol(str, end, 10);
+	if (*end == str || **end != ':' || hours < 0 || hours > 23) {
+		return -1;
+	}
+	str = *end + 1;
+	const long minutes = strtol(str, end, 10);
+	if (*end - str != 2 || minutes < 0 || minutes > 59) {
+		return -1;
+	}
+	return hours * 60 + minutes;
+}
+
+static bool _is_time_matched(const rule_s *rule, const struct tm *tm) {
+	if (rule->time_begin < 0) {
+		return (rule->days & (1 << tm->tm_wday));
+	}
+	const int now = tm->tm_hour * 60 + tm->tm_min;
+	if (rule->time_begin < rule->time_end) {
+		return ((rule->days & (1 << tm->tm_wday)) && now >= rule->time_begin && now < rule->time_end);
+	}
+	// The overnight window belongs to the day it has started
+	if (now >= rule->time_begin) {
+		return (rule->days & (1 << tm->tm_wday));
+	} else if (now < rule->time_end) {
+		return (rule->days & (1 << ((tm->tm_wday + 6) % 7)));
+	}
+	return false;
+}
+
+static float _read_load(void) {
+	// Plain read() instead of fopen() to keep the loop allocation-free
+	char buf[128];
+	const int fd = open("/proc/loadavg", O_RDONLY);
+	if (fd < 0) {
+		return NAN;
+	}
+	const ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		return NAN;
+	}
+	buf[len] = '\0';
+	char *end;
+	const float load = strtof(buf, &end);
+	return (end == buf ? NAN : load);
+}
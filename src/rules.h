@@ -0,0 +1,91 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "tools.h"
+#include "control.h"
+#include "profile.h"
+
+
+#define RULE_MAX		16
+#define RULE_NAME_SIZE	32
+#define RULE_PATH_SIZE	256
+
+
+// A rule matches when all of its conditions are true, a rule without conditions always matches
+typedef struct {
+	char	name[RULE_NAME_SIZE];
+
+	int			time_begin; // Minutes since midnight, -1 for the whole day
+	int			time_end; // Exclusive, less than the begin for the overnight windows
+	unsigned	days; // Mask of (1 << tm_wday)
+	float		load_above; // 1-minute load average, NAN if not used
+	float		load_below;
+	char		file[RULE_PATH_SIZE]; // Flag file, "" if not used
+	bool		file_absent; // Match if the file doesn't exist, "!<path>" in the config
+
+	char	profile[PROFILE_NAME_SIZE]; // "" to keep the selected one, "default" for the base params
+	int		profile_index; // Resolved by rules_compile(), -1 for the base params
+	float	speed_max; // Noise ceiling, NAN if not used
+	float	temp_emergency; // The ceiling is lifted at this temperature, NAN for the temp_high
+} rule_s;
+
+typedef struct {
+	rule_s		list[RULE_MAX];
+	unsigned	count;
+
+	// Set by rules_compile(), so the evaluation doesn't touch the inputs that aren't used
+	bool	need_time;
+	bool	need_load;
+	bool	need_file;
+} rules_s;
+
+typedef struct {
+	int		rule; // The first matched rule with a profile, -1 if there is no such rule
+	int		profile; // Valid only if the rule >= 0
+	float	speed_max; // The lowest ceiling of the matched rules, NAN if there is no ceiling
+	float	temp_emergency; // The lowest explicit emergency temperature of the matched ceilings, NAN if none
+	bool	emergency_high; // Some of the matched ceilings are lifted at the temp_high
+} rules_result_s;
+
+
+void rule_init(rule_s *rule, const char *name);
+int rule_parse_time(rule_s *rule, const char *str);
+int rule_parse_days(rule_s *rule, const char *str);
+int rule_set_file(rule_s *rule, const char *str);
+int rule_set_profile(rule_s *rule, const char *str);
+
+const char *rules_compile(rules_s *rules, const profile_s *profiles, unsigned profiles_count);
+void rules_eval(const rules_s *rules, rules_result_s *result);
+bool rules_limit(const rules_result_s *result, float temp, bool *emergency, control_params_s *params);
@@ -28,16 +28,28 @@ static void _mhd_log(UNUSED void *ctx, const char *fmt, va_list args);
 static enum MHD_Result _mhd_handler(void *v_server, struct MHD_Connection *conn,
 	const char *url, const char *method, UNUSED const char *version,
 	UNUSED const char *upload_data, size_t *upload_data_size,  // cppcheck-suppress constParameter
-	UNUSED void **ctx);
+	void **ctx);
 
+static char *_render_state(server_s *server, bool binary, size_t *size);
+static char *_render_history(server_s *server, struct MHD_Connection *conn, bool binary, size_t *size);
+static char *_render_profile(server_s *server, size_t *size);
+static char *_render_simulate(server_s *server, struct MHD_Connection *conn, size_t *size);
+static int _set_override(server_s *server, struct MHD_Connection *conn);
+static int _set_profile(server_s *server, struct MHD_Connection *conn);
+static int _get_arg_ld(struct MHD_Connection *conn, const char *name, long double *dest);
 
-server_s *server_init(bool has_hall, const char *path, bool rm, mode_t mode) {
+
+server_s *server_init(bool has_hall, history_s *history, override_s *override, profiles_s *profiles, usage_s *usage, const char *path, bool rm, mode_t mode) {
 	server_s *server;
 	A_CALLOC(server, 1);
 	A_MUTEX_INIT(&server->s_mutex);
-	server->s_ok = true;
-	server->s_last_fail_ts = -1;
-	server->has_hall = has_hall;
+	server->s_state.ok = true;
+	server->s_state.last_fail_ns = -1;
+	server->s_state.has_hall = has_hall;
+	server->history = history;
+	server->override = override;
+	server->profiles = profiles;
+	server->usage = usage;
 	server->fd = -1;
 
 	struct sockaddr_un addr = {0};
@@ -54,26 +66,31 @@ server_s *server_init(bool has_hall, const char *path, bool rm, mode_t mode) {
 
 #   undef MAX_SUN_PATH
 
-	assert((server->fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+	if ((server->fd = systemd_get_socket(path, SOCK_STREAM)) >= 0) {
+		// Already bound and listening, the permissions are set by the socket unit
+		LOG_INFO("server", "Using UNIX socket '%s' passed by systemd", path);
+	} else {
+		assert((server->fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
 
-	if (rm && unlink(path) < 0) {
-		if (errno != ENOENT) {
-			LOG_PERROR("server", "Can't remove old UNIX socket '%s'", path);
-			goto error;
+		if (rm && unlink(path) < 0) {
+			if (errno != ENOENT) {
+				LOG_PERROR("server", "Can't remove old UNIX socket '%s'", path);
+				goto error;
+			}
 		}
-	}
 
-	if (bind(server->fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) < 0) {
-		LOG_PERROR("server", "Can't bind HTTP to UNIX socket '%s'", path);
-		goto error;
-	}
-	if (mode && chmod(path, mode) < 0) {
-		LOG_PERROR("server", "Can't set permissions %o to UNIX socket '%s'", mode, path);
-		goto error;
-	}
-	if (listen(server->fd, 128) < 0) {
-		LOG_PERROR("server", "Can't listen UNIX socket '%s'", path);
-		goto error;
+		if (bind(server->fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) < 0) {
+			LOG_PERROR("server", "Can't bind HTTP to UNIX socket '%s'", path);
+			goto error;
+		}
+		if (mode && chmod(path, mode) < 0) {
+			LOG_PERROR("server", "Can't set permissions %o to UNIX socket '%s'", mode, path);
+			goto error;
+		}
+		if (listen(server->fd, 128) < 0) {
+			LOG_PERROR("server", "Can't listen UNIX socket '%s'", path);
+			goto error;
+		}
 	}
 
 	server->mhd = MHD_start_daemon(
@@ -108,83 +125,327 @@ void server_destroy(server_s *server) {
 	free(server);
 }
 
-void server_set_state(server_s *server, float temp_real, float temp_fixed, float speed, unsigned pwm, unsigned rpm, bool ok) {
+void server_set_state(server_s *server, const state_s *state) {
 	A_MUTEX_LOCK(&server->s_mutex);
-	server->s_temp_real = temp_real;
-	server->s_temp_fixed = temp_fixed;
-	server->s_speed = speed;
-	server->s_pwm = pwm;
-	server->s_rpm = rpm;
-	if (server->s_ok != ok) {
-		server->s_last_fail_ts = get_now_monotonic();
-	}
-	server->s_ok = ok;
+	server->s_state = *state;
+	A_MUTEX_UNLOCK(&server->s_mutex);
+}
+
+void server_set_params(server_s *server, const control_params_s *params) {
+	A_MUTEX_LOCK(&server->s_mutex);
+	server->s_params = *params;
 	A_MUTEX_UNLOCK(&server->s_mutex);
 }
 
 static void _mhd_log(UNUSED void *ctx, const char *fmt, va_list args) {
-	A_MUTEX_LOCK(&log_mutex);
-	char buf[4096];
+	char buf[1024];
 	vsnprintf(buf, sizeof(buf), fmt, args);
 	LOG_ERROR("server", "%s", buf);
-	A_MUTEX_UNLOCK(&log_mutex);
 }
 
 static enum MHD_Result _mhd_handler(void *v_server, struct MHD_Connection *conn,
 	const char *url, const char *method, UNUSED const char *version,
 	UNUSED const char *upload_data, size_t *upload_data_size,  // cppcheck-suppress [constParameter, constParameterCallback]
-	UNUSED void **ctx) {
+	void **ctx) {
 
 	server_s *server = (server_s *)v_server;
 
-	if (strcmp(method, "GET") != 0 || *upload_data_size > 0) {
+	const bool post = (!strcmp(method, "POST") || !strcmp(method, "PUT"));
+	if (post) {
+		// The params are passed in the query string and the body is ignored.
+		// MHD calls the handler for the headers, for each body chunk and once more at the end.
+		if (*ctx == NULL) {
+			*ctx = server;
+			return MHD_YES;
+		}
+		if (*upload_data_size > 0) {
+			*upload_data_size = 0;
+			return MHD_YES;
+		}
+	} else if (strcmp(method, "GET") != 0 || *upload_data_size > 0) {
 		return MHD_NO;
 	}
 
+	STATS_BEGIN(begin_ns);
+	STATS_INC(STATS_HTTP_REQUESTS, 1);
+
+	const char *const accept = MHD_lookup_connection_value(conn, MHD_HEADER_KIND, "Accept");
+	const bool binary = (accept != NULL && strstr(accept, ENCODE_MIME_BINARY) != NULL);
+	const char *const data_type = (binary ? ENCODE_MIME_BINARY : "application/json");
+
 	unsigned status = MHD_HTTP_OK;
-	char *content_type = "text/plain";
+	const char *content_type = "text/plain";
 	char *page = "Stub";
+	size_t page_size = 0;
 	enum MHD_ResponseMemoryMode page_mode = MHD_RESPMEM_PERSISTENT;
 
-	if (!strcmp(url, "/")) {
+	if (
+		post
+		? (strcmp(url, "/override") && strcmp(url, "/profile") && strcmp(url, "/simulate"))
+		: (!strcmp(url, "/override") || !strcmp(url, "/simulate"))
+	) {
+		status = MHD_HTTP_METHOD_NOT_ALLOWED;
+		page = "Method not allowed\n";
+
+	} else if (!strcmp(url, "/")) {
 		content_type = "application/json";
-		A_ASPRINTF(page,
-			"{\"ok\": true, \"result\": {\"version\": \"%s\"}}\n",
-			VERSION);
-		page_mode = MHD_RESPMEM_MUST_FREE;
+		page = "{\"ok\": true, \"result\": {\"version\": \"" VERSION "\"}}\n";
 
 	} else if (!strcmp(url, "/state")) {
+		content_type = data_type;
+		page = _render_state(server, binary, &page_size);
+
+	} else if (!strcmp(url, "/history") && server->history != NULL) {
+		if ((page = _render_history(server, conn, binary, &page_size)) != NULL) {
+			content_type = data_type;
+			page_mode = MHD_RESPMEM_MUST_FREE;
+		} else {
+			status = MHD_HTTP_BAD_REQUEST;
+			page = "Bad request\n";
+		}
+
+	} else if (!strcmp(url, "/override")) {
+		if (_set_override(server, conn) == 0) {
+			content_type = "application/json";
+			page = "{\"ok\": true, \"result\": {}}\n";
+		} else {
+			status = MHD_HTTP_BAD_REQUEST;
+			page = "Bad request\n";
+		}
+
+	} else if (!strcmp(url, "/profile")) {
+		if (!post || _set_profile(server, conn) == 0) {
+			content_type = "application/json";
+			page = _render_profile(server, &page_size);
+			page_mode = MHD_RESPMEM_MUST_FREE;
+		} else {
+			status = MHD_HTTP_BAD_REQUEST;
+			page = "Bad request\n";
+		}
+
+	} else if (!strcmp(url, "/simulate") && server->history != NULL) {
+		if ((page = _render_simulate(server, conn, &page_size)) != NULL) {
+			content_type = "application/json";
+			page_mode = MHD_RESPMEM_MUST_FREE;
+		} else {
+			status = MHD_HTTP_BAD_REQUEST;
+			page = "Bad request\n";
+		}
+
+	} else if (!strcmp(url, "/usage")) {
 		content_type = "application/json";
-		A_MUTEX_LOCK(&server->s_mutex);
-		A_ASPRINTF(page,
-			"{\"ok\": true, \"result\": {"
-			"\"service\": {\"now_ts\": %.2Lf},"
-			" \"temp\": {\"real\": %.2f, \"fixed\": %.2f},"
-			" \"fan\": {\"speed\": %.2f, \"pwm\": %u, \"ok\": %s, \"last_fail_ts\": %.2Lf},"
-			" \"hall\": {\"available\": %s, \"rpm\": %u}"
-			"}}\n",
-			get_now_monotonic(),
-			server->s_temp_real,
-			server->s_temp_fixed,
-			server->s_speed,
-			server->s_pwm,
-			(server->s_ok ? "true" : "false"),
-			server->s_last_fail_ts,
-			(server->has_hall ? "true" : "false"),
-			server->s_rpm);
-		A_MUTEX_UNLOCK(&server->s_mutex);
+		FILE *fp;
+		assert(fp = open_memstream(&page, &page_size));
+		usage_render_json(server->usage, fp);
+		assert(!fclose(fp));
 		page_mode = MHD_RESPMEM_MUST_FREE;
 
+#	ifdef WITH_STATS
+	} else if (!strcmp(url, "/debug/stats")) {
+		content_type = "application/json";
+		FILE *fp;
+		assert(fp = open_memstream(&page, &page_size));
+		stats_render_json(fp);
+		assert(!fclose(fp));
+		page_mode = MHD_RESPMEM_MUST_FREE;
+#	endif
+
 	} else {
 		status = MHD_HTTP_NOT_FOUND;
 		page = "Not found\n";
 	}
 
+	if (page_size == 0) {
+		page_size = strlen(page);
+	}
+
 	struct MHD_Response *resp;
-	assert(resp = MHD_create_response_from_buffer(strlen(page), page, page_mode));
+	assert(resp = MHD_create_response_from_buffer(page_size, page, page_mode));
 	assert(MHD_add_response_header(resp, "Content-Type", content_type) == MHD_YES);
 
 	enum MHD_Result result = MHD_queue_response(conn, status, resp);
 	MHD_destroy_response(resp);
+	STATS_END(STATS_HTTP_REQUEST, begin_ns);
 	return result;
 }
+
+static char *_render_state(server_s *server, bool binary, size_t *size) {
+	// MHD_USE_THREAD_PER_CONNECTION: the response is sent by this thread
+	// before it handles the next request, so a persistent per-thread buffer is enough.
+	static __thread char page[ENCODE_STATE_MAX_SIZE];
+
+	A_MUTEX_LOCK(&server->s_mutex);
+	const state_s state = server->s_state;
+	A_MUTEX_UNLOCK(&server->s_mutex);
+
+	if (binary) {
+		*size = encode_state_binary_buf((uint8_t *)page, ENCODE_STATE_MAX_SIZE, get_now_monotonic_ns(), &state);
+	} else {
+		*size = encode_state_json_buf(page, ENCODE_STATE_MAX_SIZE, get_now_monotonic_ns(), &state);
+	}
+	return page;
+}
+
+static char *_render_history(server_s *server, struct MHD_Connection *conn, bool binary, size_t *size) {
+	long double res = 1;
+	long double from = -INFINITY;
+	long double to = INFINITY;
+	if (
+		_get_arg_ld(conn, "res", &res) < 0
+		|| _get_arg_ld(conn, "from", &from) < 0
+		|| _get_arg_ld(conn, "to", &to) < 0
+		|| res < 1 || res > UINT_MAX
+	) {
+		return NULL;
+	}
+
+	history_point_s *points;
+	size_t count;
+	if (history_get(server->history, res, from, to, &points, &count) < 0) {
+		return NULL;
+	}
+
+	char *page = NULL;
+	FILE *fp;
+	assert(fp = open_memstream(&page, size));
+	if (binary) {
+		encode_history_binary(fp, res, points, count);
+	} else {
+		encode_history_json(fp, res, points, count);
+	}
+	assert(!fclose(fp));
+
+	free(points);
+	return page;
+}
+
+static char *_render_profile(server_s *server, size_t *size) {
+	char names[PROFILE_MAX][PROFILE_NAME_SIZE];
+	int active;
+	int effective;
+	const unsigned count = profiles_get_names(server->profiles, names, &active, &effective);
+
+	char *page = NULL;
+	FILE *fp;
+	assert(fp = open_memstream(&page, size));
+	fprintf(fp, "{\"ok\": true, \"result\": {\"active\": \"%s\", \"effective\": \"%s\", \"profiles\": [\"default\"",
+		(active >= 0 ? names[active] : "default"),
+		(effective >= 0 ? names[effective] : "default"));
+	for (unsigned index = 0; index < count; ++index) {
+		fprintf(fp, ", \"%s\"", names[index]);
+	}
+	fputs("]}}\n", fp);
+	assert(!fclose(fp));
+	return page;
+}
+
+static char *_render_simulate(server_s *server, struct MHD_Connection *conn, size_t *size) {
+	// Runs in the connection thread (MHD_USE_THREAD_PER_CONNECTION), so the loop is not affected.
+	// The missing params are taken from the effective ones.
+	static const struct {
+		const char	*name;
+		size_t		offset;
+	} fields[] = {
+		{"temp_rise",		offsetof(control_params_s, temp_rise)},
+		{"temp_fall",		offsetof(control_params_s, temp_fall)},
+		{"temp_low",		offsetof(control_params_s, temp_low)},
+		{"temp_high",		offsetof(control_params_s, temp_high)},
+		{"speed_idle",		offsetof(control_params_s, speed_idle)},
+		{"speed_low",		offsetof(control_params_s, speed_low)},
+		{"speed_high",		offsetof(control_params_s, speed_high)},
+		{"speed_heat",		offsetof(control_params_s, speed_heat)},
+		{"speed_spin_up",	offsetof(control_params_s, speed_spin_up)},
+		{"speed_dwell",		offsetof(control_params_s, speed_dwell)},
+		{"speed_changes",	offsetof(control_params_s, speed_changes)},
+	};
+
+	A_MUTEX_LOCK(&server->s_mutex);
+	control_params_s params = server->s_params;
+	A_MUTEX_UNLOCK(&server->s_mutex);
+
+	for (unsigned index = 0; index < sizeof(fields) / sizeof(fields[0]); ++index) {
+		float *const dest = (float *)((char *)&params + fields[index].offset);
+		long double value = *dest;
+		if (_get_arg_ld(conn, fields[index].name, &value) < 0) {
+			return NULL;
+		}
+		*dest = value;
+	}
+	const char *const msg = control_check_params(&params);
+	if (msg != NULL) {
+		LOG_ERROR("server", "Can't simulate: %s", msg);
+		return NULL;
+	}
+
+	long double res = 1;
+	long double from = -INFINITY;
+	long double to = INFINITY;
+	if (
+		_get_arg_ld(conn, "res", &res) < 0
+		|| _get_arg_ld(conn, "from", &from) < 0
+		|| _get_arg_ld(conn, "to", &to) < 0
+		|| res < 1 || res > UINT_MAX
+	) {
+		return NULL;
+	}
+	history_point_s *points;
+	size_t count;
+	if (history_get(server->history, res, from, to, &points, &count) < 0) {
+		return NULL;
+	}
+
+	char *page = NULL;
+	FILE *fp;
+	assert(fp = open_memstream(&page, size));
+	whatif_render_json(fp, &params, res, points, count);
+	assert(!fclose(fp));
+
+	free(points);
+	return page;
+}
+
+static int _set_override(server_s *server, struct MHD_Connection *conn) {
+	long double speed = NAN;
+	long double ttl = 0;
+	if (
+		_get_arg_ld(conn, "speed", &speed) < 0
+		|| _get_arg_ld(conn, "ttl", &ttl) < 0
+		|| isnan(speed) || speed > 100
+		|| ttl < 0 || ttl > UINT_MAX
+	) {
+		return -1;
+	}
+	if (speed < 0) {
+		LOG_INFO("server", "Clearing the speed override");
+		override_clear(server->override);
+	} else {
+		const int64_t ttl_ns = ceill(ttl * NS_PER_SEC);
+		LOG_INFO("server", "Overriding the speed: %.2Lf%% for %.3Lfs", speed, ns_to_sec(ttl_ns));
+		override_set(server->override, speed, ttl_ns);
+	}
+	return 0;
+}
+
+static int _set_profile(server_s *server, struct MHD_Connection *conn) {
+	const char *const name = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "name");
+	if (name == NULL || profiles_select(server->profiles, name) < 0) {
+		return -1;
+	}
+	LOG_INFO("server", "Switched to the profile '%s'", name);
+	return 0;
+}
+
+static int _get_arg_ld(struct MHD_Connection *conn, const char *name, long double *dest) {
+	const char *const value = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, name);
+	if (value == NULL) {
+		return 0;
+	}
+	errno = 0;
+	char *end = NULL;
+	const long double tmp = strtold(value, &end);
+	if (errno || *end || end == value || isnan(tmp)) {
+		return -1;
+	}
+	*dest = tmp;
+	return 0;
+}
@@ -23,10 +23,14 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <errno.h>
+#include <math.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -38,25 +42,34 @@
 #include "const.h"
 #include "tools.h"
 #include "logging.h"
+#include "systemd.h"
+#include "state.h"
+#include "history.h"
+#include "override.h"
+#include "profile.h"
+#include "usage.h"
+#include "control.h"
+#include "whatif.h"
+#include "encode.h"
+#include "stats.h"
 
 
 typedef struct {
-	float			s_temp_real;
-	float			s_temp_fixed;
-	float			s_speed;
-	unsigned		s_pwm;
-	unsigned		s_rpm;
-	bool			s_ok;
-	long double		s_last_fail_ts;
-	pthread_mutex_t	s_mutex;
-
-	bool				has_hall;
+	state_s				s_state;
+	control_params_s	s_params; // Effective, the defaults for /simulate
+	pthread_mutex_t		s_mutex;
+
+	history_s			*history;
+	override_s			*override;
+	profiles_s			*profiles;
+	usage_s				*usage;
 	int					fd;
 	struct MHD_Daemon	*mhd;
 } server_s;
 
 
-server_s *server_init(bool has_hall, const char *path, bool rm, mode_t mode);
+server_s *server_init(bool has_hall, history_s *history, override_s *override, profiles_s *profiles, usage_s *usage, const char *path, bool rm, mode_t mode);
 void server_destroy(server_s *server);
 
-void server_set_state(server_s *server, float temp_real, float temp_fixed, float speed, unsigned pwm, unsigned rpm, bool ok);
+void server_set_state(server_s *server, const state_s *state);
+void server_set_params(server_s *server, const control_params_s *params);
@@ -0,0 +1,117 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+// Header-only reader of the KVMD-FAN state exported to the shared memory.
+// It has no dependencies except libc, so it can be copied to any C11 project.
+//
+//   kvmd_fan_shm_s *shm = kvmd_fan_shm_open(KVMD_FAN_SHM_DEFAULT_NAME);
+//   kvmd_fan_shm_state_s state;
+//   if (shm != NULL && kvmd_fan_shm_read(shm, &state) == 0) { ... }
+//   kvmd_fan_shm_close(shm);
+//
+// kvmd_fan_shm_read() is a plain memory read guarded by the sequence counter,
+// it doesn't make any syscalls.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+
+
+#define KVMD_FAN_SHM_DEFAULT_NAME	"/kvmd-fan"
+#define KVMD_FAN_SHM_MAGIC			0x4E41464BU // "KFAN"
+#define KVMD_FAN_SHM_VERSION		2U
+
+
+typedef struct {
+	int64_t		ts_ms; // CLOCK_MONOTONIC of the update
+	float		temp_real;
+	float		temp_fixed;
+	float		speed;
+	uint32_t	pwm;
+	uint32_t	rpm;
+	uint8_t		ok;
+	uint8_t		has_hall;
+	uint8_t		has_throttle;
+	uint8_t		throttle_active; // Throttling is imminent or happening, the fan is boosted
+	int64_t		last_fail_ts_ms; // -1 if the fan has never failed
+	uint32_t	throttle_flags; // The firmware get_throttled flags
+	uint32_t	throttle_events;
+	int64_t		throttle_ms; // Total duration of the throttling
+} kvmd_fan_shm_state_s;
+
+typedef struct {
+	uint32_t				magic;
+	uint32_t				version;
+	_Atomic uint32_t		seq; // Odd while the writer is updating, zero before the first update
+	uint32_t				reserved;
+	kvmd_fan_shm_state_s	state;
+} kvmd_fan_shm_s;
+
+
+static inline kvmd_fan_shm_s *kvmd_fan_shm_open(const char *name) {
+	const int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	void *const ptr = mmap(NULL, sizeof(kvmd_fan_shm_s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		return NULL;
+	}
+	kvmd_fan_shm_s *const shm = (kvmd_fan_shm_s *)ptr;
+	if (shm->magic != KVMD_FAN_SHM_MAGIC || shm->version != KVMD_FAN_SHM_VERSION) {
+		munmap(ptr, sizeof(kvmd_fan_shm_s));
+		return NULL;
+	}
+	return shm;
+}
+
+static inline void kvmd_fan_shm_close(kvmd_fan_shm_s *shm) {
+	if (shm != NULL) {
+		munmap(shm, sizeof(kvmd_fan_shm_s));
+	}
+}
+
+static inline int kvmd_fan_shm_read(const kvmd_fan_shm_s *shm, kvmd_fan_shm_state_s *state) {
+	for (unsigned retries = 0; retries < 1000; ++retries) {
+		const uint32_t begin = atomic_load_explicit((_Atomic uint32_t *)&shm->seq, memory_order_acquire);
+		if (begin == 0) {
+			return -1; // No data yet
+		}
+		if (begin & 1) {
+			continue;
+		}
+		*state = shm->state;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit((_Atomic uint32_t *)&shm->seq, memory_order_relaxed) == begin) {
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,223 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "sim.h"
+
+
+#define _STEP_NS (100 * NS_PER_MS)
+
+
+static int _parse_segments(const char *str, sim_segment_s *segments, unsigned *count, bool absolute);
+static float _get_heat(const sim_s *sim);
+static bool _is_stalled(const sim_s *sim);
+static void _step(sim_s *sim, int64_t dt_ns);
+
+
+void sim_params_init(sim_params_s *params) {
+	*params = (sim_params_s){
+		.ambient = 30,
+		.r_passive = 8,
+		.r_active = 3,
+		.thermal_tau = 60,
+		.rpm_max = 5000,
+		.fan_tau = 1.5,
+		.start_duty = 0.3,
+		.speedup = 1,
+	};
+	assert(!sim_parse_load(params, "300:3,300:7"));
+}
+
+int sim_parse_load(sim_params_s *params, const char *str) {
+	sim_segment_s segments[SIM_MAX_SEGMENTS];
+	unsigned count;
+	if (_parse_segments(str, segments, &count, false) < 0 || count == 0) {
+		return -1;
+	}
+	memcpy(params->load, segments, sizeof(segments));
+	params->load_count = count;
+	params->load_period_ns = segments[count - 1].end_ns;
+	return 0;
+}
+
+int sim_parse_stalls(sim_params_s *params, const char *str) {
+	sim_segment_s segments[SIM_MAX_SEGMENTS];
+	unsigned count;
+	if (_parse_segments(str, segments, &count, true) < 0) {
+		return -1;
+	}
+	memcpy(params->stalls, segments, sizeof(segments));
+	params->stalls_count = count;
+	return 0;
+}
+
+sim_s *sim_init(const sim_params_s *params) {
+	sim_s *sim;
+	A_CALLOC(sim, 1);
+	sim->params = *params;
+	sim->start_ns = get_now_monotonic_ns();
+	sim->now_ns = sim->start_ns;
+	sim->window_ns = sim->start_ns;
+	sim->temp = params->ambient;
+	sim->temp_min = sim->temp_max = sim->temp;
+	sim->heat = NAN;
+	return sim;
+}
+
+void sim_destroy(sim_s *sim) {
+	free(sim);
+}
+
+int64_t sim_get_now_ns(const sim_s *sim) {
+	return sim->now_ns;
+}
+
+void sim_run_until(sim_s *sim, int64_t deadline_ns, const atomic_bool *stop) {
+	while (sim->now_ns < deadline_ns && !atomic_load(stop)) {
+		const int64_t left_ns = deadline_ns - sim->now_ns;
+		const int64_t dt_ns = (left_ns < _STEP_NS ? left_ns : _STEP_NS);
+		_step(sim, dt_ns);
+		if (sim->params.speedup > 0) {
+			usleep(dt_ns / sim->params.speedup / 1000);
+		}
+	}
+}
+
+void sim_set_heat(sim_s *sim, float heat) {
+	sim->heat = heat;
+}
+
+float sim_get_temp(sim_s *sim) {
+	sim->temp_sum += sim->temp;
+	sim->duty_sum += sim->duty;
+	sim->samples += 1;
+	return sim->temp;
+}
+
+void sim_set_duty(sim_s *sim, float duty) {
+	if (duty != sim->duty) {
+		sim->duty = duty;
+		sim->duty_changes += 1;
+	}
+}
+
+int sim_get_hall_rpm(sim_s *sim) {
+	return sim->hall_rpm;
+}
+
+static int _parse_segments(const char *str, sim_segment_s *segments, unsigned *count, bool absolute) {
+	// "<a>:<b>,<a>:<b>,...": for the load it's <duration>:<watts> one after another,
+	// for the stalls it's <start>:<duration> since the start of the simulation.
+	*count = 0;
+	int64_t offset_ns = 0;
+	const char *ptr = str;
+	while (*ptr != '\0') {
+		if (*count >= SIM_MAX_SEGMENTS) {
+			return -1;
+		}
+		char *end;
+		const float first = strtof(ptr, &end);
+		if (end == ptr || *end != ':' || first < 0) {
+			return -1;
+		}
+		ptr = end + 1;
+		const float second = strtof(ptr, &end);
+		if (end == ptr || (*end != ',' && *end != '\0') || second < 0) {
+			return -1;
+		}
+		ptr = (*end == ',' ? end + 1 : end);
+
+		sim_segment_s *const segment = &segments[*count];
+		if (absolute) {
+			segment->begin_ns = first * NS_PER_SEC;
+			segment->end_ns = segment->begin_ns + second * NS_PER_SEC;
+			segment->value = 0;
+		} else {
+			if (first <= 0) {
+				return -1;
+			}
+			segment->begin_ns = offset_ns;
+			segment->end_ns = offset_ns + first * NS_PER_SEC;
+			segment->value = second;
+			offset_ns = segment->end_ns;
+		}
+		*count += 1;
+	}
+	return 0;
+}
+
+static float _get_heat(const sim_s *sim) {
+	if (!isnan(sim->heat)) {
+		return sim->heat;
+	}
+	const sim_params_s *const params = &sim->params;
+	const int64_t offset_ns = (sim->now_ns - sim->start_ns) % params->load_period_ns;
+	for (unsigned index = 0; index < params->load_count; ++index) {
+		if (offset_ns < params->load[index].end_ns) {
+			return params->load[index].value;
+		}
+	}
+	return 0;
+}
+
+static bool _is_stalled(const sim_s *sim) {
+	const int64_t offset_ns = sim->now_ns - sim->start_ns;
+	for (unsigned index = 0; index < sim->params.stalls_count; ++index) {
+		if (offset_ns >= sim->params.stalls[index].begin_ns && offset_ns < sim->params.stalls[index].end_ns) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void _step(sim_s *sim, int64_t dt_ns) {
+	const sim_params_s *const params = &sim->params;
+	const float dt = (float)dt_ns / NS_PER_SEC;
+
+	// Fan
+	if (_is_stalled(sim)) {
+		sim->rpm = 0;
+	} else {
+		float target = sim->duty * params->rpm_max;
+		if (sim->rpm < 1 && sim->duty < params->start_duty) {
+			target = 0;
+		}
+		sim->rpm += (target - sim->rpm) * (1 - expf(-dt / params->fan_tau));
+	}
+
+	// Plant
+	const float airflow = fminf(sim->rpm / params->rpm_max, 1);
+	const float resistance = params->r_passive - (params->r_passive - params->r_active) * airflow;
+	const float target = params->ambient + _get_heat(sim) * resistance;
+	sim->temp += (target - sim->temp) * (1 - expf(-dt / params->thermal_tau));
+	sim->temp_min = fminf(sim->temp_min, sim->temp);
+	sim->temp_max = fmaxf(sim->temp_max, sim->temp);
+
+	// Hall sensor: two pulses per revolution, counted in one second windows
+	sim->pulses += sim->rpm / 60 * 2 * dt;
+	sim->now_ns += dt_ns;
+	if (sim->now_ns - sim->window_ns >= NS_PER_SEC) {
+		const float pulses = floorf(sim->pulses);
+		sim->hall_rpm = pulses * 30 * NS_PER_SEC / (sim->now_ns - sim->window_ns);
+		sim->pulses -= pulses;
+		sim->window_ns = sim->now_ns;
+	}
+}
@@ -0,0 +1,107 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "tools.h"
+
+
+#define SIM_MAX_SEGMENTS 32
+
+
+typedef struct {
+	int64_t	begin_ns; // Offset from the start of the schedule
+	int64_t	end_ns;
+	float	value;
+} sim_segment_s;
+
+typedef struct {
+	// Thermal plant: the die temperature goes to ambient + heat * resistance(airflow)
+	// as a first-order system with the time constant thermal_tau.
+	float	ambient;		// °C
+	float	r_passive;		// °C/W without airflow
+	float	r_active;		// °C/W at the max fan RPM
+	float	thermal_tau;	// Seconds
+
+	// Fan: RPM follows duty * rpm_max with the time constant fan_tau.
+	// A stopped fan doesn't start below start_duty.
+	float	rpm_max;
+	float	fan_tau;
+	float	start_duty;
+
+	float	speedup; // Virtual vs real time, 0 for as fast as possible
+
+	// Heat input, repeated: durations and watts
+	sim_segment_s	load[SIM_MAX_SEGMENTS];
+	unsigned		load_count;
+	int64_t			load_period_ns;
+
+	// Fan stalls in virtual time since the start
+	sim_segment_s	stalls[SIM_MAX_SEGMENTS];
+	unsigned		stalls_count;
+} sim_params_s;
+
+typedef struct {
+	sim_params_s	params;
+
+	int64_t	start_ns;
+	int64_t	now_ns; // Virtual clock
+	float	temp;
+	float	duty;
+	float	rpm; // Physical RPM
+	float	pulses; // Hall pulses in the current window
+	int64_t	window_ns;
+	int		hall_rpm; // Measured like fan.c does
+	float	heat; // Overrides the load schedule if not NAN
+
+	// Summary
+	float		temp_min;
+	float		temp_max;
+	long double	temp_sum;
+	long double	duty_sum;
+	unsigned	samples;
+	unsigned	duty_changes;
+} sim_s;
+
+
+void sim_params_init(sim_params_s *params);
+int sim_parse_load(sim_params_s *params, const char *str);
+int sim_parse_stalls(sim_params_s *params, const char *str);
+
+sim_s *sim_init(const sim_params_s *params);
+void sim_destroy(sim_s *sim);
+
+int64_t sim_get_now_ns(const sim_s *sim);
+void sim_run_until(sim_s *sim, int64_t deadline_ns, const atomic_bool *stop);
+
+void sim_set_heat(sim_s *sim, float heat);
+float sim_get_temp(sim_s *sim);
+void sim_set_duty(sim_s *sim, float duty);
+int sim_get_hall_rpm(sim_s *sim);
@@ -0,0 +1,52 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "temp.h"
+
+
+typedef struct {
+	float			temp_real;
+	float			temp_fixed;
+	temp_health_e	temp_health;
+	unsigned		temp_errors; // Total sensor read errors
+	float			speed;
+	unsigned		pwm;
+	unsigned		rpm;
+	bool			ok;
+	int64_t			last_fail_ns; // -1 if the fan has never failed
+	bool			has_hall;
+	unsigned		config_gen; // Incremented on each applied config reload
+	int64_t			startup_pwm_ns; // From the start of the process to the first PWM write
+	int64_t			startup_ready_ns; // From the start of the process to the first loop iteration
+	bool			has_throttle;
+	unsigned		throttle_flags; // The firmware get_throttled flags
+	bool			throttle_active; // Throttling is imminent or happening, the fan is boosted
+	unsigned		throttle_events;
+	int64_t			throttle_ns; // Total duration of the throttling
+	unsigned		suppressed_dwell; // The speed changes postponed by the dwell time
+	unsigned		suppressed_budget; // The same for the PWM changes budget
+} state_s;
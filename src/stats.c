@@ -0,0 +1,263 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "stats.h"
+
+#ifdef WITH_STATS
+
+typedef struct {
+	atomic_uint_least64_t	buckets[STATS_BUCKETS];
+	atomic_uint_least64_t	count;
+	atomic_uint_least64_t	sum_ns;
+	atomic_uint_least64_t	max_ns;
+} _hist_s;
+
+
+static const char *const _HIST_NAMES[STATS_HISTS] = {
+	[STATS_LOOP_WALL] = "loop_wall",
+	[STATS_LOOP_LATENESS] = "loop_lateness",
+	[STATS_SENSOR_READ] = "sensor_read",
+	[STATS_PWM_WRITE] = "pwm_write",
+	[STATS_HALL_WALL] = "hall_wall",
+	[STATS_HTTP_REQUEST] = "http_request",
+};
+
+static const char *const _COUNTER_NAMES[STATS_COUNTERS] = {
+	[STATS_LOOP_WAKEUPS] = "loop_wakeups",
+	[STATS_HALL_WAKEUPS] = "hall_wakeups",
+	[STATS_HALL_EDGES] = "hall_edges",
+	[STATS_HTTP_REQUESTS] = "http_requests",
+	[STATS_THERMAL_EVENTS] = "thermal_events",
+};
+
+static _hist_s					_g_hists[STATS_HISTS];
+static atomic_uint_least64_t	_g_counters[STATS_COUNTERS];
+static int64_t					_g_start_ns;
+
+
+static unsigned _get_bucket(int64_t ns);
+static uint64_t _get_percentile(const uint64_t *buckets, uint64_t count, double rank);
+static void _render_hist(FILE *fp, const _hist_s *hist);
+static void _render_memory(FILE *fp);
+static void _render_threads(FILE *fp, long double uptime);
+static int _read_task_file(const char *tid, const char *name, char *buf, size_t size);
+
+
+void stats_init(void) {
+	_g_start_ns = get_now_monotonic_ns();
+}
+
+void stats_add(stats_hist_e hist, int64_t ns) {
+	if (ns < 0) {
+		ns = 0;
+	}
+	_hist_s *const ptr = &_g_hists[hist];
+	atomic_fetch_add_explicit(&ptr->buckets[_get_bucket(ns)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&ptr->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&ptr->sum_ns, ns, memory_order_relaxed);
+	uint64_t max = atomic_load_explicit(&ptr->max_ns, memory_order_relaxed);
+	while ((uint64_t)ns > max && !atomic_compare_exchange_weak_explicit(
+		&ptr->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+void stats_inc(stats_counter_e counter, unsigned value) {
+	atomic_fetch_add_explicit(&_g_counters[counter], value, memory_order_relaxed);
+}
+
+void stats_render_json(FILE *fp) {
+	const long double uptime = ns_to_sec(get_now_monotonic_ns() - _g_start_ns);
+
+	fprintf(fp, "{\"ok\": true, \"result\": {\"uptime\": %.3Lf, \"hists\": {", uptime);
+	for (unsigned index = 0; index < STATS_HISTS; ++index) {
+		fprintf(fp, "%s\"%s\": ", (index > 0 ? ", " : ""), _HIST_NAMES[index]);
+		_render_hist(fp, &_g_hists[index]);
+	}
+
+	fputs("}, \"counters\": {", fp);
+	for (unsigned index = 0; index < STATS_COUNTERS; ++index) {
+		const uint64_t value = atomic_load_explicit(&_g_counters[index], memory_order_relaxed);
+		fprintf(fp, "%s\"%s\": {\"total\": %ju, \"per_sec\": %.2Lf}",
+			(index > 0 ? ", " : ""), _COUNTER_NAMES[index],
+			(uintmax_t)value, (uptime > 0 ? value / uptime : 0));
+	}
+
+	struct rusage usage;
+	assert(!getrusage(RUSAGE_SELF, &usage));
+	fprintf(fp,
+		"}, \"process\": {\"utime\": %.3f, \"stime\": %.3f, \"max_rss_kb\": %ld,"
+		" \"minflt\": %ld, \"majflt\": %ld, \"nvcsw\": %ld, \"nivcsw\": %ld}",
+		usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1.0e6,
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1.0e6,
+		usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw, usage.ru_nivcsw);
+
+	fputs(", \"memory\": ", fp);
+	_render_memory(fp);
+
+	fputs(", \"threads\": [", fp);
+	_render_threads(fp, uptime);
+	fputs("]}}\n", fp);
+}
+
+static unsigned _get_bucket(int64_t ns) {
+	const uint64_t us = ns / 1000;
+	if (us == 0) {
+		return 0;
+	}
+	const unsigned bucket = 64 - __builtin_clzll(us);
+	return (bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1);
+}
+
+static uint64_t _get_percentile(const uint64_t *buckets, uint64_t count, double rank) {
+	// Returns the upper bound of the bucket in microseconds
+	const uint64_t need = ceil(count * rank);
+	uint64_t seen = 0;
+	for (unsigned index = 0; index < STATS_BUCKETS; ++index) {
+		seen += buckets[index];
+		if (seen >= need && seen > 0) {
+			return (uint64_t)1 << index;
+		}
+	}
+	return (uint64_t)1 << (STATS_BUCKETS - 1);
+}
+
+static void _render_hist(FILE *fp, const _hist_s *hist) {
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t count = 0;
+	for (unsigned index = 0; index < STATS_BUCKETS; ++index) {
+		buckets[index] = atomic_load_explicit(&hist->buckets[index], memory_order_relaxed);
+		count += buckets[index];
+	}
+	const uint64_t sum_ns = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+	const uint64_t max_ns = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+
+	fprintf(fp, "{\"count\": %ju, \"avg_us\": %.1f, \"max_us\": %.1f",
+		(uintmax_t)count, (count > 0 ? (double)sum_ns / count / 1000 : 0), (double)max_ns / 1000);
+	if (count > 0) {
+		fprintf(fp, ", \"p50_us\": %ju, \"p90_us\": %ju, \"p99_us\": %ju",
+			(uintmax_t)_get_percentile(buckets, count, 0.5),
+			(uintmax_t)_get_percentile(buckets, count, 0.9),
+			(uintmax_t)_get_percentile(buckets, count, 0.99));
+	}
+
+	// Only the non-empty buckets as [<upper bound in us>, <count>]
+	fputs(", \"buckets\": [", fp);
+	bool first = true;
+	for (unsigned index = 0; index < STATS_BUCKETS; ++index) {
+		if (buckets[index] > 0) {
+			fprintf(fp, "%s[%ju, %ju]", (first ? "" : ", "), (uintmax_t)1 << index, (uintmax_t)buckets[index]);
+			first = false;
+		}
+	}
+	fputs("]}", fp);
+}
+
+static void _render_memory(FILE *fp) {
+	// Both should be flat after the startup
+	long pages = 0;
+	long rss_pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL) {
+		if (fscanf(statm, "%ld %ld", &pages, &rss_pages) != 2) {
+			rss_pages = 0;
+		}
+		fclose(statm);
+	}
+	fprintf(fp, "{\"rss_kb\": %ld", rss_pages * (sysconf(_SC_PAGESIZE) / 1024));
+
+#	if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	const struct mallinfo2 info = mallinfo2();
+	fprintf(fp, ", \"heap_arena\": %zu, \"heap_mmap\": %zu, \"heap_in_use\": %zu, \"heap_free\": %zu",
+		info.arena, info.hblkhd, info.uordblks, info.fordblks);
+#	endif
+	fputc('}', fp);
+}
+
+static void _render_threads(FILE *fp, long double uptime) {
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == NULL) {
+		return;
+	}
+
+	const long ticks = sysconf(_SC_CLK_TCK);
+	bool first = true;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		char comm[32];
+		char stat[1024];
+		char status[4096];
+		if (
+			_read_task_file(entry->d_name, "comm", comm, sizeof(comm)) < 0
+			|| _read_task_file(entry->d_name, "stat", stat, sizeof(stat)) < 0
+			|| _read_task_file(entry->d_name, "status", status, sizeof(status)) < 0
+		) {
+			continue; // The thread is gone
+		}
+		comm[strcspn(comm, "\n")] = '\0';
+
+		// The comm field can contain spaces and brackets, so skip to the last one.
+		// The fields after it are: state(3) ... utime(14) stime(15).
+		unsigned long long utime = 0;
+		unsigned long long stime = 0;
+		const char *const fields = strrchr(stat, ')');
+		if (fields != NULL) {
+			sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime);
+		}
+
+		unsigned long long voluntary = 0;
+		unsigned long long involuntary = 0;
+		const char *ptr;
+		if ((ptr = strstr(status, "\nvoluntary_ctxt_switches:")) != NULL) {
+			sscanf(ptr, "\nvoluntary_ctxt_switches: %llu", &voluntary);
+		}
+		if ((ptr = strstr(status, "\nnonvoluntary_ctxt_switches:")) != NULL) {
+			sscanf(ptr, "\nnonvoluntary_ctxt_switches: %llu", &involuntary);
+		}
+
+		fprintf(fp,
+			"%s{\"tid\": %s, \"name\": \"%s\", \"utime\": %.2f, \"stime\": %.2f,"
+			" \"voluntary_ctxt_switches\": %llu, \"nonvoluntary_ctxt_switches\": %llu, \"wakeups_per_sec\": %.2Lf}",
+			(first ? "" : ", "), entry->d_name, comm,
+			(double)utime / ticks, (double)stime / ticks,
+			voluntary, involuntary, (uptime > 0 ? voluntary / uptime : 0));
+		first = false;
+	}
+	closedir(dir);
+}
+
+static int _read_task_file(const char *tid, const char *name, char *buf, size_t size) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/task/%s/%s", tid, name);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	const size_t len = fread(buf, 1, size - 1, fp);
+	fclose(fp);
+	buf[len] = '\0';
+	return (len > 0 ? 0 : -1);
+}
+
+#endif // WITH_STATS
@@ -0,0 +1,81 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <assert.h>
+
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#	include <malloc.h>
+#endif
+
+#include "tools.h"
+
+
+// Log2 buckets by microseconds: [0] < 1us, [N] < 2^N us, the last one is everything else
+#define STATS_BUCKETS 26
+
+
+typedef enum {
+	STATS_LOOP_WALL = 0,	// The work of one loop iteration
+	STATS_LOOP_LATENESS,	// Wakeup time vs the intended tick
+	STATS_SENSOR_READ,
+	STATS_PWM_WRITE,
+	STATS_HALL_WALL,		// Events processing of one Hall iteration, without waiting
+	STATS_HTTP_REQUEST,
+	STATS_HISTS,
+} stats_hist_e;
+
+typedef enum {
+	STATS_LOOP_WAKEUPS = 0,
+	STATS_HALL_WAKEUPS,
+	STATS_HALL_EDGES,
+	STATS_HTTP_REQUESTS,
+	STATS_THERMAL_EVENTS,
+	STATS_COUNTERS,
+} stats_counter_e;
+
+
+#ifdef WITH_STATS
+void stats_init(void);
+void stats_add(stats_hist_e hist, int64_t ns);
+void stats_inc(stats_counter_e counter, unsigned value);
+void stats_render_json(FILE *fp);
+
+#	define STATS_BEGIN(_var)			const int64_t _var = get_now_monotonic_ns()
+#	define STATS_END(_hist, _var)		stats_add(_hist, get_now_monotonic_ns() - (_var))
+#	define STATS_ADD(_hist, _ns)		stats_add(_hist, _ns)
+#	define STATS_INC(_counter, _value)	stats_inc(_counter, _value)
+#else
+#	define STATS_BEGIN(_var)
+#	define STATS_END(_hist, _var)
+#	define STATS_ADD(_hist, _ns)
+#	define STATS_INC(_counter, _value)
+#endif
@@ -0,0 +1,97 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "systemd.h"
+
+
+// The socket activation and the readiness notification protocols
+// are simple enough to not depend on libsystemd, see sd_listen_fds(3)
+// and sd_notify(3).
+
+#define _LISTEN_FDS_START 3
+
+
+static bool _g_taken[64] = {0};
+
+
+int systemd_get_socket(const char *path, int type) {
+	// Returns the passed listening socket bound to the path or -1.
+	// The sockets are matched by the path instead of LISTEN_FDNAMES,
+	// so the same --unix and --ctl options work with and without systemd.
+	const char *const pid_str = getenv("LISTEN_PID");
+	const char *const fds_str = getenv("LISTEN_FDS");
+	if (pid_str == NULL || fds_str == NULL || atol(pid_str) != getpid()) {
+		return -1;
+	}
+	const int count = atoi(fds_str);
+	for (int index = 0; index < count && index < (int)(sizeof(_g_taken) / sizeof(_g_taken[0])); ++index) {
+		const int fd = _LISTEN_FDS_START + index;
+		if (_g_taken[index]) {
+			continue; // Could be closed and the number reused
+		}
+
+		int fd_type;
+		socklen_t len = sizeof(fd_type);
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &fd_type, &len) < 0 || fd_type != type) {
+			continue;
+		}
+		struct sockaddr_un addr = {0};
+		len = sizeof(addr);
+		if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0 || addr.sun_family != AF_UNIX) {
+			continue;
+		}
+		if (strncmp(addr.sun_path, path, sizeof(addr.sun_path))) {
+			continue;
+		}
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		_g_taken[index] = true;
+		return fd;
+	}
+	return -1;
+}
+
+void systemd_notify(const char *state) {
+	const char *const path = getenv("NOTIFY_SOCKET");
+	if (path == NULL || (path[0] != '/' && path[0] != '@')) {
+		return;
+	}
+	struct sockaddr_un addr = {0};
+	const size_t path_len = strlen(path);
+	if (path_len >= sizeof(addr.sun_path)) {
+		return;
+	}
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, path_len);
+	if (addr.sun_path[0] == '@') {
+		addr.sun_path[0] = '\0'; // Abstract namespace
+	}
+
+	const int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return;
+	}
+	sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+		(struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + path_len);
+	close(fd);
+}
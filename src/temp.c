@@ -20,31 +20,155 @@
 *****************************************************************************/
 
 
+
 #include "temp.h"
 
 
-int get_temp(float *temp) {
-	int retval = 0;
+// The sensors are tried in the order of the list on each read. A failed one
+// is retried once right away, because a single transient EIO from the thermal
+// driver is not a reason to degrade, and then with an exponential backoff
+// so a dead sensor doesn't cost a syscall and a log message on each iteration.
+// When all of them fail, the last known good value is used for the hold time,
+// and then the caller falls back to the safe speed.
+
+#define _BACKOFF_MIN_NS	NS_PER_SEC
+#define _BACKOFF_MAX_NS	(32 * NS_PER_SEC)
+
+
+static int _read_sensor(temp_sensor_s *sensor, float *value);
+
+
+temp_s *temp_init(const char *paths, unsigned hold) {
+	assert(!temp_check_paths(paths));
+
+	temp_s *temp;
+	A_CALLOC(temp, 1);
+	temp->hold_ns = hold * NS_PER_SEC;
+	temp->last_ns = -1;
+	temp->health = TEMP_HEALTH_FAILED;
+
+	const char *ptr = paths;
+	while (*ptr != '\0') {
+		const size_t len = strcspn(ptr, ",");
+		temp_sensor_s *const sensor = &temp->sensors[temp->count];
+		assert(sensor->path = strndup(ptr, len));
+		sensor->fd = -1;
+		sensor->backoff_ns = _BACKOFF_MIN_NS;
+		LOG_INFO("temp", "Using sensor %u: %s", temp->count, sensor->path);
+		++temp->count;
+		ptr += len + (ptr[len] == ',' ? 1 : 0);
+	}
+	return temp;
+}
+
+void temp_destroy(temp_s *temp) {
+	for (unsigned index = 0; index < temp->count; ++index) {
+		if (temp->sensors[index].fd >= 0) {
+			close(temp->sensors[index].fd);
+		}
+		free(temp->sensors[index].path);
+	}
+	free(temp);
+}
 
-	FILE *fp = NULL;
-	if ((fp = fopen("/sys/class/thermal/thermal_zone0/temp", "r")) == NULL) {
-		LOG_PERROR("temp", "Can't read thermal zone 0");
+int temp_check_paths(const char *paths) {
+	// "<path>,<path>,...": absolute, non-empty and no more than TEMP_MAX_SENSORS
+	unsigned count = 0;
+	const char *ptr = paths;
+	while (true) {
+		const size_t len = strcspn(ptr, ",");
+		if (len == 0 || ptr[0] != '/' || count >= TEMP_MAX_SENSORS) {
+			return -1;
+		}
+		++count;
+		if (ptr[len] == '\0') {
+			return 0;
+		}
+		ptr += len + 1;
+	}
+}
+
+temp_health_e temp_read(temp_s *temp, int64_t now_ns, float *value) {
+	const temp_health_e prev_health = temp->health;
+	const unsigned prev_sensor = temp->sensor;
+
+	temp->health = TEMP_HEALTH_FAILED;
+	for (unsigned index = 0; index < temp->count; ++index) {
+		temp_sensor_s *const sensor = &temp->sensors[index];
+		if (sensor->failed && now_ns < sensor->retry_ns) {
+			continue;
+		}
+		if (_read_sensor(sensor, value) < 0 && _read_sensor(sensor, value) < 0) {
+			temp->errors += 1;
+			if (!sensor->failed) {
+				LOG_ERROR("temp", "Sensor %u has failed, retrying with a backoff", index);
+				sensor->failed = true;
+			} else if (sensor->backoff_ns < _BACKOFF_MAX_NS) {
+				sensor->backoff_ns *= 2;
+			}
+			sensor->retry_ns = now_ns + sensor->backoff_ns;
+			continue;
+		}
+		if (sensor->failed) {
+			LOG_INFO("temp", "Sensor %u is working again", index);
+			sensor->failed = false;
+			sensor->backoff_ns = _BACKOFF_MIN_NS;
+		}
+		temp->last = *value;
+		temp->last_ns = now_ns;
+		temp->health = (index == 0 ? TEMP_HEALTH_OK : TEMP_HEALTH_FALLBACK);
+		temp->sensor = index;
+		break;
+	}
+
+	if (temp->health == TEMP_HEALTH_FAILED && temp->last_ns >= 0 && now_ns - temp->last_ns <= temp->hold_ns) {
+		*value = temp->last;
+		temp->health = TEMP_HEALTH_HOLD;
+	}
+	if (temp->health == TEMP_HEALTH_FAILED) {
+		*value = (temp->last_ns >= 0 ? temp->last : 0); // Just for the reports
+	}
+
+	if (temp->health != prev_health || (temp->health == TEMP_HEALTH_FALLBACK && temp->sensor != prev_sensor)) {
+		switch (temp->health) {
+			case TEMP_HEALTH_OK: LOG_INFO("temp", "Using the primary sensor"); break;
+			case TEMP_HEALTH_FALLBACK: LOG_ERROR("temp", "Using the fallback sensor %u", temp->sensor); break;
+			case TEMP_HEALTH_HOLD: LOG_ERROR("temp", "No working sensors, holding the last value %.2f°C", temp->last); break;
+			case TEMP_HEALTH_FAILED: LOG_ERROR("temp", "No working sensors and no recent value, using the safe speed"); break;
+		}
+	}
+	return temp->health;
+}
+
+static int _read_sensor(temp_sensor_s *sensor, float *value) {
+	// The sysfs attribute is regenerated on every read from the offset 0,
+	// so the file is opened once and then just pread() without stdio buffers.
+	if (sensor->fd < 0 && (sensor->fd = open(sensor->path, O_RDONLY | O_CLOEXEC)) < 0) {
+		LOG_PERROR("temp", "Can't open '%s'", sensor->path);
+		return -1;
+	}
+
+	char buf[32];
+	const ssize_t size = pread(sensor->fd, buf, sizeof(buf) - 1, 0);
+	if (size <= 0) {
+		LOG_PERROR("temp", "Can't read '%s'", sensor->path);
 		goto error;
 	}
+	buf[size] = '\0';
 
-	int raw;
-	if (fscanf(fp, "%d", &raw) != 1) {
-		LOG_ERROR("temp", "Can't parse thermal zone 0");
+	char *end = NULL;
+	errno = 0;
+	const long raw = strtol(buf, &end, 10);
+	if (errno || end == buf || (*end != '\n' && *end != '\0')) {
+		LOG_ERROR("temp", "Can't parse '%s'", sensor->path);
 		goto error;
 	}
-	*temp = (float)raw / 1000;
+	*value = (float)raw / 1000;
+	return 0;
 
-	goto ok;
 	error:
-		retval = -1;
-	ok:
-		if (fp) {
-			fclose(fp);
-		}
-		return retval;
+		// Reopen on the next try
+		close(sensor->fd);
+		sensor->fd = -1;
+		return -1;
 }
@@ -20,14 +20,68 @@
 *****************************************************************************/
 
 
+
 #pragma once
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
 
 #include "tools.h"
 #include "logging.h"
 
 
-int get_temp(float *temp);
+#define TEMP_MAX_SENSORS	4
+#define TEMP_DEFAULT_SENSOR	"/sys/class/thermal/thermal_zone0/temp"
+
+
+typedef enum {
+	TEMP_HEALTH_OK = 0,		// The primary sensor
+	TEMP_HEALTH_FALLBACK,	// One of the secondary sensors
+	TEMP_HEALTH_HOLD,		// No sensors, the last known good value within the hold time
+	TEMP_HEALTH_FAILED,		// No value, the caller should use the safe speed
+} temp_health_e;
+
+typedef struct {
+	char		*path;
+	int			fd;
+	bool		failed;
+	int64_t		retry_ns; // The next try for the failed sensor
+	int64_t		backoff_ns;
+} temp_sensor_s;
+
+typedef struct {
+	temp_sensor_s	sensors[TEMP_MAX_SENSORS];
+	unsigned		count;
+	int64_t			hold_ns;
+
+	float			last; // The last known good value
+	int64_t			last_ns; // -1 if there were no good values
+	temp_health_e	health;
+	unsigned		sensor; // The index of the sensor for the OK and FALLBACK
+	unsigned		errors; // Total read errors
+} temp_s;
+
+
+temp_s *temp_init(const char *paths, unsigned hold);
+void temp_destroy(temp_s *temp);
+
+int temp_check_paths(const char *paths);
+temp_health_e temp_read(temp_s *temp, int64_t now_ns, float *value);
+
+
+INLINE const char *temp_health_to_string(temp_health_e health) {
+	switch (health) {
+		case TEMP_HEALTH_OK: return "ok";
+		case TEMP_HEALTH_FALLBACK: return "fallback";
+		case TEMP_HEALTH_HOLD: return "hold";
+		case TEMP_HEALTH_FAILED: return "failed";
+	}
+	return "???";
+}
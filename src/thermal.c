@@ -0,0 +1,263 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "thermal.h"
+
+
+// The kernel thermal framework multicasts the trip point crossings and
+// the cooling device changes over the generic netlink, see thermal_netlink.c.
+// The loop sleeps on the socket instead of usleep(), so a real thermal event
+// triggers an iteration immediately. If the family is not available
+// (an old kernel or CONFIG_THERMAL_NETLINK=n), only the timer is used.
+//
+// The old headers don't have the new family at all, it's the same fallback.
+
+#define _BUF_SIZE 8192
+
+
+#ifdef THERMAL_GENL_EVENT_GROUP_NAME
+static int _resolve_family(int fd, unsigned *family, unsigned *group);
+static const struct nlattr *_find_attr(const void *data, int len, unsigned type);
+#endif
+
+
+thermal_s *thermal_init(void) {
+#	ifdef THERMAL_GENL_EVENT_GROUP_NAME
+	int fd = -1;
+	unsigned family;
+	unsigned group;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_GENERIC)) < 0) {
+		LOG_PERROR("thermal", "Can't create the netlink socket");
+		goto error;
+	}
+	const struct sockaddr_nl addr = {.nl_family = AF_NETLINK};
+	if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		LOG_PERROR("thermal", "Can't bind the netlink socket");
+		goto error;
+	}
+	if (_resolve_family(fd, &family, &group) < 0) {
+		goto error;
+	}
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+		LOG_PERROR("thermal", "Can't subscribe to the thermal events");
+		goto error;
+	}
+	LOG_INFO("thermal", "Listening to the thermal netlink events");
+	return thermal_init_fd(fd, family);
+
+	error:
+		if (fd >= 0) {
+			close(fd);
+		}
+#	endif
+	LOG_INFO("thermal", "The thermal netlink events are not available, using the polling only");
+	return NULL;
+}
+
+thermal_s *thermal_init_fd(int fd, unsigned family) {
+	// Takes the ownership of any datagram socket with the netlink messages,
+	// so the parser can be fed by a socketpair() without the kernel.
+	thermal_s *thermal;
+	A_CALLOC(thermal, 1);
+	thermal->fd = fd;
+	thermal->family = family;
+	return thermal;
+}
+
+void thermal_destroy(thermal_s *thermal) {
+	close(thermal->fd);
+	free(thermal);
+}
+
+int thermal_wait(thermal_s *thermal, int64_t timeout_ns) {
+	// Returns the number of the relevant events received during the timeout
+	struct pollfd pfd = {.fd = thermal->fd, .events = POLLIN};
+	const int retval = poll(&pfd, 1, (timeout_ns + NS_PER_MS - 1) / NS_PER_MS);
+	if (retval < 0) {
+		if (errno != EINTR) {
+			LOG_PERROR("thermal", "Can't poll the netlink socket");
+		}
+		return 0;
+	}
+	return (retval > 0 ? thermal_process(thermal) : 0);
+}
+
+int thermal_process(thermal_s *thermal) {
+	// Reads all the pending messages, returns the number of the relevant events.
+	// The lost messages are treated as a relevant event, it's safer to check.
+	int count = 0;
+	while (true) {
+		static uint8_t buf[_BUF_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+		const ssize_t size = recv(thermal->fd, buf, _BUF_SIZE, 0);
+		if (size < 0) {
+			if (errno == ENOBUFS) {
+				LOG_ERROR("thermal", "Some thermal events are lost");
+				++count;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				LOG_PERROR("thermal", "Can't read the netlink socket");
+			}
+			break;
+		}
+		if (size == 0) {
+			break;
+		}
+
+#		ifdef THERMAL_GENL_EVENT_GROUP_NAME
+		int len = size;
+		for (const struct nlmsghdr *msg = (const struct nlmsghdr *)buf; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+			if (msg->nlmsg_type != thermal->family || msg->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)) {
+				continue;
+			}
+			const struct genlmsghdr *const genl = NLMSG_DATA(msg);
+			const void *const attrs = (const uint8_t *)genl + GENL_HDRLEN;
+			const int attrs_len = msg->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+#			define GET_U32(_type) ({ \
+					const struct nlattr *_attr = _find_attr(attrs, attrs_len, _type); \
+					(_attr != NULL && _attr->nla_len >= NLA_HDRLEN + sizeof(uint32_t) \
+						? (int)*(const uint32_t *)((const uint8_t *)_attr + NLA_HDRLEN) : -1); \
+				})
+			// A message without the required attributes is malformed, not an event
+			switch (genl->cmd) {
+				case THERMAL_GENL_EVENT_TZ_TRIP_UP:
+				case THERMAL_GENL_EVENT_TZ_TRIP_DOWN: {
+					const int zone = GET_U32(THERMAL_GENL_ATTR_TZ_ID);
+					const int trip = GET_U32(THERMAL_GENL_ATTR_TZ_TRIP_ID);
+					if (zone >= 0 && trip >= 0) {
+						LOG_VERBOSE("thermal", "Zone %d crossed the trip %d %s",
+							zone, trip, (genl->cmd == THERMAL_GENL_EVENT_TZ_TRIP_UP ? "up" : "down"));
+						++count;
+					}
+					break;
+				}
+				case THERMAL_GENL_EVENT_CDEV_STATE_UPDATE: {
+					const int cdev = GET_U32(THERMAL_GENL_ATTR_CDEV_ID);
+					const int state = GET_U32(THERMAL_GENL_ATTR_CDEV_CUR_STATE);
+					if (cdev >= 0 && state >= 0) {
+						LOG_VERBOSE("thermal", "Cooling device %d changed the state to %d", cdev, state);
+						++count;
+					}
+					break;
+				}
+				default: break; // The zones and the trips management
+			}
+#			undef GET_U32
+		}
+#		endif
+	}
+	thermal->events += count;
+	STATS_INC(STATS_THERMAL_EVENTS, count);
+	return count;
+}
+
+#ifdef THERMAL_GENL_EVENT_GROUP_NAME
+static int _resolve_family(int fd, unsigned *family, unsigned *group) {
+	// CTRL_CMD_GETFAMILY is answered synchronously, the reply is already queued after send()
+	struct {
+		struct nlmsghdr		msg;
+		struct genlmsghdr	genl;
+		struct nlattr		attr;
+		char				name[NLA_ALIGN(sizeof(THERMAL_GENL_FAMILY_NAME))];
+	} req = {
+		.msg = {.nlmsg_len = sizeof(req), .nlmsg_type = GENL_ID_CTRL, .nlmsg_flags = NLM_F_REQUEST, .nlmsg_seq = 1},
+		.genl = {.cmd = CTRL_CMD_GETFAMILY, .version = 1},
+		.attr = {.nla_len = NLA_HDRLEN + sizeof(THERMAL_GENL_FAMILY_NAME), .nla_type = CTRL_ATTR_FAMILY_NAME},
+		.name = THERMAL_GENL_FAMILY_NAME,
+	};
+	if (send(fd, &req, sizeof(req), 0) < 0) {
+		LOG_PERROR("thermal", "Can't request the thermal netlink family");
+		return -1;
+	}
+
+	static uint8_t buf[_BUF_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	ssize_t size;
+	if (poll(&pfd, 1, 1000) <= 0 || (size = recv(fd, buf, _BUF_SIZE, 0)) <= 0) {
+		LOG_PERROR("thermal", "Can't receive the thermal netlink family");
+		return -1;
+	}
+	const struct nlmsghdr *const msg = (const struct nlmsghdr *)buf;
+	if (!NLMSG_OK(msg, size)) {
+		LOG_ERROR("thermal", "Invalid netlink reply");
+		return -1;
+	}
+	if (msg->nlmsg_type == NLMSG_ERROR) {
+		const struct nlmsgerr *const err = NLMSG_DATA(msg);
+		LOG_INFO("thermal", "No thermal netlink family: %s", strerror(-err->error));
+		return -1;
+	}
+
+	const void *const attrs = (const uint8_t *)NLMSG_DATA(msg) + GENL_HDRLEN;
+	const int attrs_len = msg->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	const struct nlattr *const id = _find_attr(attrs, attrs_len, CTRL_ATTR_FAMILY_ID);
+	const struct nlattr *const groups = _find_attr(attrs, attrs_len, CTRL_ATTR_MCAST_GROUPS);
+	if (id == NULL || groups == NULL) {
+		LOG_ERROR("thermal", "Invalid thermal netlink family reply");
+		return -1;
+	}
+	*family = *(const uint16_t *)((const uint8_t *)id + NLA_HDRLEN);
+
+	// Nested: each group is a nested list of the name and the id
+	const uint8_t *ptr = (const uint8_t *)groups + NLA_HDRLEN;
+	int left = groups->nla_len - NLA_HDRLEN;
+	while (left >= NLA_HDRLEN) {
+		const struct nlattr *const item = (const struct nlattr *)ptr;
+		if (item->nla_len < NLA_HDRLEN || item->nla_len > left) {
+			break;
+		}
+		const void *const item_attrs = ptr + NLA_HDRLEN;
+		const int item_len = item->nla_len - NLA_HDRLEN;
+		const struct nlattr *const name = _find_attr(item_attrs, item_len, CTRL_ATTR_MCAST_GRP_NAME);
+		const struct nlattr *const grp = _find_attr(item_attrs, item_len, CTRL_ATTR_MCAST_GRP_ID);
+		if (name != NULL && grp != NULL && !strncmp(
+			(const char *)name + NLA_HDRLEN, THERMAL_GENL_EVENT_GROUP_NAME, name->nla_len - NLA_HDRLEN)
+		) {
+			*group = *(const uint32_t *)((const uint8_t *)grp + NLA_HDRLEN);
+			return 0;
+		}
+		ptr += NLA_ALIGN(item->nla_len);
+		left -= NLA_ALIGN(item->nla_len);
+	}
+	LOG_ERROR("thermal", "No '%s' group in the thermal netlink family", THERMAL_GENL_EVENT_GROUP_NAME);
+	return -1;
+}
+
+static const struct nlattr *_find_attr(const void *data, int len, unsigned type) {
+	const uint8_t *ptr = data;
+	while (len >= NLA_HDRLEN) {
+		const struct nlattr *const attr = (const struct nlattr *)ptr;
+		if (attr->nla_len < NLA_HDRLEN || attr->nla_len > len) {
+			break;
+		}
+		if ((attr->nla_type & NLA_TYPE_MASK) == type) {
+			return attr;
+		}
+		ptr += NLA_ALIGN(attr->nla_len);
+		len -= NLA_ALIGN(attr->nla_len);
+	}
+	return NULL;
+}
+#endif
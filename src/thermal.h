@@ -0,0 +1,56 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/thermal.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "stats.h"
+
+
+typedef struct {
+	int			fd;
+	unsigned	family; // The netlink message type of the thermal family
+	unsigned	events; // Trip crossings and cooling device changes
+} thermal_s;
+
+
+thermal_s *thermal_init(void);
+thermal_s *thermal_init_fd(int fd, unsigned family);
+void thermal_destroy(thermal_s *thermal);
+
+int thermal_wait(thermal_s *thermal, int64_t timeout_ns);
+int thermal_process(thermal_s *thermal);
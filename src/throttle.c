@@ -0,0 +1,200 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "throttle.h"
+
+
+// What matters is the CPU throttling that degrades the video, not a particular
+// temperature. The Pi firmware reports the soft temperature limit and the ARM
+// frequency capping before the hard throttling, so any of them turns the fan up.
+// The kernel thermal cooling lowers scaling_max_freq, which is treated the same way.
+// The user or the governor can also keep it below cpuinfo_max_freq permanently,
+// so only a drop below the value seen at the start is a capping. The base follows
+// the raises, in case the daemon was started during the capping.
+// The under-voltage is only reported.
+//
+// The files are opened once and read by pread() like the temperature,
+// so the polling on each iteration is just two syscalls.
+
+#define _HOLD_NS (30 * NS_PER_SEC) // Keep the boost after the throttling is over
+
+
+static int _open(const char *path);
+static int _read_ulong(int fd, int base, unsigned long *value);
+
+
+throttle_s *throttle_init(const char *path, const char *cpufreq_path) {
+	throttle_s *throttle;
+	A_CALLOC(throttle, 1);
+	throttle->flags_fd = -1;
+	throttle->max_fd = -1;
+	throttle->last_active_ns = -1;
+
+	if (path[0] != '\0') {
+		if ((throttle->flags_fd = _open(path)) >= 0) {
+			LOG_INFO("throttle", "Using the firmware throttle flags '%s'", path);
+		}
+	}
+
+	if (cpufreq_path[0] != '\0') {
+		char *info_path;
+		A_ASPRINTF(info_path, "%s/cpuinfo_max_freq", cpufreq_path);
+		const int info_fd = _open(info_path);
+		free(info_path);
+		unsigned long cpuinfo_max = 0;
+		if (info_fd >= 0 && _read_ulong(info_fd, 10, &cpuinfo_max) == 0 && cpuinfo_max > 0) {
+			char *max_path;
+			A_ASPRINTF(max_path, "%s/scaling_max_freq", cpufreq_path);
+			unsigned long scaling_max = 0;
+			if ((throttle->max_fd = _open(max_path)) >= 0) {
+				if (_read_ulong(throttle->max_fd, 10, &scaling_max) == 0 && scaling_max > 0) {
+					throttle->max_base = scaling_max;
+					LOG_INFO("throttle", "Using the cpufreq capping '%s', max=%lu kHz, base=%lu kHz",
+						max_path, cpuinfo_max, scaling_max);
+				} else {
+					LOG_ERROR("throttle", "Can't read '%s'", max_path);
+					close(throttle->max_fd);
+					throttle->max_fd = -1;
+				}
+			}
+			free(max_path);
+		}
+		if (info_fd >= 0) {
+			close(info_fd);
+		}
+	}
+	return throttle;
+}
+
+void throttle_destroy(throttle_s *throttle) {
+	if (throttle->flags_fd >= 0) {
+		close(throttle->flags_fd);
+	}
+	if (throttle->max_fd >= 0) {
+		close(throttle->max_fd);
+	}
+	free(throttle);
+}
+
+void throttle_take_over(throttle_s *throttle, const throttle_s *old, bool same_cpufreq) {
+	// The period in progress goes on, so it's not counted again by the next update
+	throttle->flags = old->flags;
+	throttle->capped = old->capped;
+	throttle->active = old->active;
+	throttle->active_since_ns = old->active_since_ns;
+	throttle->last_active_ns = old->last_active_ns;
+	throttle->events = old->events;
+	throttle->total_ns = old->total_ns;
+	if (same_cpufreq && throttle->max_fd >= 0 && old->max_fd >= 0) {
+		// The fresh base could be read during the capping
+		throttle->max_base = old->max_base;
+	}
+}
+
+void throttle_update(throttle_s *throttle, int64_t now_ns) {
+	const unsigned prev_flags = throttle->flags;
+	const bool prev_capped = throttle->capped;
+	const bool prev_active = throttle->active;
+
+	// Read errors don't change the state, it's better than a false boost or release
+	unsigned long value;
+	if (throttle->flags_fd >= 0 && _read_ulong(throttle->flags_fd, 16, &value) == 0) {
+		throttle->flags = value;
+	}
+	if (throttle->max_fd >= 0 && _read_ulong(throttle->max_fd, 10, &value) == 0) {
+		if ((long)value > throttle->max_base) {
+			LOG_INFO("throttle", "The cpufreq base is raised to %lu kHz", value);
+			throttle->max_base = value;
+		}
+		throttle->capped = ((long)value < throttle->max_base);
+	}
+
+	const unsigned now_flags = (throttle->flags & 0xFFFF);
+	throttle->active = (throttle->capped || (now_flags & (THROTTLE_FREQ_CAPPED | THROTTLE_THROTTLED | THROTTLE_SOFT_LIMIT)));
+
+	if (throttle->active) {
+		if (!prev_active) {
+			throttle->active_since_ns = now_ns;
+			throttle->events += 1;
+			LOG_ERROR("throttle", "CPU throttling: flags=0x%x, cpufreq capped=%s",
+				throttle->flags, (throttle->capped ? "yes" : "no"));
+		} else if (now_flags != (prev_flags & 0xFFFF) || throttle->capped != prev_capped) {
+			LOG_ERROR("throttle", "CPU throttling changed: flags=0x%x, cpufreq capped=%s",
+				throttle->flags, (throttle->capped ? "yes" : "no"));
+		}
+		throttle->last_active_ns = now_ns;
+	} else if (prev_active) {
+		throttle->total_ns += now_ns - throttle->active_since_ns;
+		LOG_INFO("throttle", "CPU throttling is over after %.1Lf seconds", ns_to_sec(now_ns - throttle->active_since_ns));
+	}
+
+	if ((now_flags & THROTTLE_UNDER_VOLTAGE) && !(prev_flags & THROTTLE_UNDER_VOLTAGE)) {
+		LOG_ERROR("throttle", "Under-voltage detected, check the power supply");
+	}
+}
+
+int64_t throttle_get_total_ns(const throttle_s *throttle, int64_t now_ns) {
+	return throttle->total_ns + (throttle->active ? now_ns - throttle->active_since_ns : 0);
+}
+
+bool throttle_boost(const throttle_s *throttle, int64_t now_ns, float speed, control_params_s *params) {
+	// Raises the curve to the speed while throttling and for a while after it
+	if (throttle->last_active_ns < 0 || now_ns - throttle->last_active_ns > _HOLD_NS) {
+		return false;
+	}
+#	define RAISE(_field) { if (params->_field < speed) { params->_field = speed; } }
+	RAISE(speed_idle);
+	RAISE(speed_low);
+	RAISE(speed_high);
+	RAISE(speed_heat);
+#	undef RAISE
+	return true;
+}
+
+static int _open(const char *path) {
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			LOG_INFO("throttle", "'%s' is not available", path);
+		} else {
+			LOG_PERROR("throttle", "Can't open '%s'", path);
+		}
+	}
+	return fd;
+}
+
+static int _read_ulong(int fd, int base, unsigned long *value) {
+	char buf[32];
+	const ssize_t size = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (size <= 0) {
+		return -1;
+	}
+	buf[size] = '\0';
+	char *end = NULL;
+	errno = 0;
+	*value = strtoul(buf, &end, base);
+	if (errno || end == buf || (*end != '\n' && *end != '\0')) {
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "control.h"
+
+
+#define THROTTLE_DEFAULT_PATH	"/sys/devices/platform/soc/soc:firmware/get_throttled"
+#define THROTTLE_DEFAULT_CPUFREQ	"/sys/devices/system/cpu/cpu0/cpufreq"
+
+// The firmware flags, the same bits << 16 are sticky "has occurred" ones
+#define THROTTLE_UNDER_VOLTAGE	0x1
+#define THROTTLE_FREQ_CAPPED	0x2
+#define THROTTLE_THROTTLED		0x4
+#define THROTTLE_SOFT_LIMIT		0x8
+
+
+typedef struct {
+	int			flags_fd; // get_throttled, -1 if not available
+	int			max_fd; // scaling_max_freq, -1 if not available
+	long		max_base; // scaling_max_freq without the thermal capping
+
+	unsigned	flags;
+	bool		capped; // scaling_max_freq is lowered below the base
+	bool		active; // Throttling is imminent or happening
+	int64_t		active_since_ns;
+	int64_t		last_active_ns; // -1 if there was no throttling
+
+	unsigned	events; // Number of the throttling periods
+	int64_t		total_ns; // Total duration of the finished periods
+} throttle_s;
+
+
+throttle_s *throttle_init(const char *path, const char *cpufreq_path);
+void throttle_destroy(throttle_s *throttle);
+
+void throttle_take_over(throttle_s *throttle, const throttle_s *old, bool same_cpufreq);
+void throttle_update(throttle_s *throttle, int64_t now_ns);
+int64_t throttle_get_total_ns(const throttle_s *throttle, int64_t now_ns);
+bool throttle_boost(const throttle_s *throttle, int64_t now_ns, float speed, control_params_s *params);
@@ -57,7 +57,11 @@
 #define A_MUTEX_UNLOCK(_mutex)				assert(!pthread_mutex_unlock(_mutex))
 
 
-INLINE long double get_now_monotonic(void) {
+#define NS_PER_SEC	((int64_t)1000000000)
+#define NS_PER_MS	((int64_t)1000000)
+
+
+INLINE int64_t get_now_monotonic_ns(void) {
 	struct timespec ts;
 	assert(!clock_gettime(
 #		if defined(CLOCK_MONOTONIC_RAW)
@@ -68,14 +72,21 @@ INLINE long double get_now_monotonic(void) {
 		CLOCK_MONOTONIC,
 #		endif
 		&ts));
+	return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
 
-	time_t sec = ts.tv_sec;
-	long msec = round(ts.tv_nsec / 1.0e6);
-	if (msec > 999) {
-		sec += 1;
-		msec = 0;
-	}
-	return (long double)sec + ((long double)msec) / 1000;
+// For the output only, all internal timings are in integer nanoseconds
+INLINE long double ns_to_sec(int64_t ns) {
+	return (long double)ns / NS_PER_SEC;
+}
+
+INLINE long double get_now_monotonic(void) {
+	return ns_to_sec(get_now_monotonic_ns());
+}
+
+INLINE void thread_set_name(const char *name) {
+	// Max 15 chars, visible in /proc/self/task/*/comm, top -H and /debug/stats
+	pthread_setname_np(pthread_self(), name);
 }
 
 INLINE char *errno_to_string(int error, char *buf, size_t size) {
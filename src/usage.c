@@ -0,0 +1,248 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "usage.h"
+
+
+// The lifetime counters of the fan for the power budgeting and the wear
+// estimation. They are integrated on each PWM write and on each loop
+// iteration, and saved to a small binary file periodically and on exit,
+// so they are monotonic across the restarts. A crash loses at most
+// the last save interval. The file is replaced by rename() like the handover.
+
+#define _MAGIC				"KFUS"
+#define _VERSION			1
+#define _FILE_MODES			8
+#define _SAVE_INTERVAL_NS	(600 * NS_PER_SEC)
+
+typedef struct {
+	char		magic[4];
+	uint32_t	version;
+	uint64_t	duty_ns;
+	uint64_t	running_ns;
+	uint64_t	pulses;
+	uint64_t	starts;
+	uint64_t	mode_ns[_FILE_MODES]; // Indexed by control_mode_e, the rest is reserved
+} _file_s;
+
+static_assert(CONTROL_MODES <= _FILE_MODES, "Too many control modes for the usage file");
+
+
+static void _accumulate(usage_s *usage, int64_t now_ns);
+static int _load(const char *path, usage_counters_s *counters);
+
+
+usage_s *usage_init(const char *path, int64_t now_ns) {
+	usage_s *usage;
+	A_CALLOC(usage, 1);
+	assert(usage->path = strdup(path));
+	A_MUTEX_INIT(&usage->mutex);
+	atomic_init(&usage->pulses, 0);
+	usage->duty = -1;
+	usage->duty_since_ns = now_ns;
+	usage->mode = CONTROL_MODE_NONE;
+	usage->mode_since_ns = now_ns;
+	usage->saved_ns = now_ns;
+
+	if (path[0] != '\0' && _load(path, &usage->counters) == 0) {
+		LOG_INFO("usage", "Loaded the fan usage: running=%.0Lf hours, starts=%" PRIu64,
+			ns_to_sec(usage->counters.running_ns) / 3600, usage->counters.starts);
+	}
+	return usage;
+}
+
+void usage_destroy(usage_s *usage) {
+	A_MUTEX_DESTROY(&usage->mutex);
+	free(usage->path);
+	free(usage);
+}
+
+void usage_set_path(usage_s *usage, const char *path) {
+	// The counters are kept, so they are just moved to the new file on the next save
+	free(usage->path);
+	assert(usage->path = strdup(path));
+}
+
+void usage_set_duty(usage_s *usage, int64_t now_ns, float duty) {
+	A_MUTEX_LOCK(&usage->mutex);
+	_accumulate(usage, now_ns);
+	if (usage->duty == 0 && duty > 0) {
+		// The unknown initial state is not a start: the fan might be left spinning
+		++usage->counters.starts;
+	}
+	usage->duty = duty;
+	A_MUTEX_UNLOCK(&usage->mutex);
+}
+
+void usage_add_pulses(usage_s *usage, unsigned pulses) {
+	atomic_fetch_add_explicit(&usage->pulses, pulses, memory_order_relaxed);
+}
+
+void usage_update(usage_s *usage, int64_t now_ns, control_mode_e mode) {
+	A_MUTEX_LOCK(&usage->mutex);
+	_accumulate(usage, now_ns);
+	usage->mode = mode;
+	A_MUTEX_UNLOCK(&usage->mutex);
+
+	if (usage->path[0] != '\0' && now_ns - usage->saved_ns >= _SAVE_INTERVAL_NS) {
+		usage_save(usage, now_ns);
+	}
+}
+
+void usage_get(usage_s *usage, usage_counters_s *counters) {
+	// Up to the last update, so it doesn't depend on the clock of the caller
+	A_MUTEX_LOCK(&usage->mutex);
+	*counters = usage->counters;
+	A_MUTEX_UNLOCK(&usage->mutex);
+	counters->pulses += atomic_load_explicit(&usage->pulses, memory_order_relaxed);
+}
+
+int usage_save(usage_s *usage, int64_t now_ns) {
+	char *tmp_path = NULL;
+	int fd = -1;
+	int retval = 0;
+
+	usage->saved_ns = now_ns; // Don't retry the failed save on each iteration
+	if (usage->path[0] == '\0') {
+		goto ok;
+	}
+
+	usage_counters_s counters;
+	usage_get(usage, &counters);
+	_file_s file = {
+		.version = _VERSION,
+		.duty_ns = counters.duty_ns,
+		.running_ns = counters.running_ns,
+		.pulses = counters.pulses,
+		.starts = counters.starts,
+	};
+	memcpy(file.magic, _MAGIC, 4);
+	memcpy(file.mode_ns, counters.mode_ns, sizeof(counters.mode_ns));
+
+	A_ASPRINTF(tmp_path, "%s.tmp", usage->path);
+	if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		LOG_PERROR("usage", "Can't create the usage file");
+		goto error;
+	}
+	// fsync() because the counters should survive the power loss, it's rare enough
+	if (write(fd, &file, sizeof(file)) != sizeof(file) || fsync(fd) < 0) {
+		LOG_PERROR("usage", "Can't write the usage file");
+		goto error;
+	}
+	close(fd);
+	fd = -1;
+	if (rename(tmp_path, usage->path) < 0) {
+		LOG_PERROR("usage", "Can't rename the usage file");
+		goto error;
+	}
+	LOG_VERBOSE("usage", "Saved the fan usage to '%s'", usage->path);
+
+	goto ok;
+	error:
+		retval = -1;
+		if (tmp_path != NULL) {
+			unlink(tmp_path);
+		}
+	ok:
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(tmp_path);
+		return retval;
+}
+
+void usage_render_json(usage_s *usage, FILE *fp) {
+	static const char *const names[CONTROL_MODES] = {
+		[CONTROL_MODE_NONE] = "none",
+		[CONTROL_MODE_IDLE] = "idle",
+		[CONTROL_MODE_RANGE] = "in_range",
+		[CONTROL_MODE_HEAT] = "heat",
+		[CONTROL_MODE_CONST] = "const",
+		[CONTROL_MODE_OVERRIDE] = "override",
+	};
+
+	usage_counters_s counters;
+	usage_get(usage, &counters);
+	fprintf(fp, "{\"ok\": true, \"result\": {\"duty\": %.3Lf, \"running\": %.3Lf, \"revolutions\": %" PRIu64
+		", \"starts\": %" PRIu64 ", \"modes\": {",
+		ns_to_sec(counters.duty_ns), ns_to_sec(counters.running_ns), counters.pulses / 2, counters.starts);
+	for (unsigned index = 0; index < CONTROL_MODES; ++index) {
+		fprintf(fp, "%s\"%s\": %.3Lf", (index > 0 ? ", " : ""), names[index], ns_to_sec(counters.mode_ns[index]));
+	}
+	fputs("}}}\n", fp);
+}
+
+static void _accumulate(usage_s *usage, int64_t now_ns) {
+	const int64_t duty_ns = now_ns - usage->duty_since_ns;
+	if (duty_ns > 0) {
+		if (usage->duty > 0) {
+			usage->counters.duty_ns += (uint64_t)((double)duty_ns * usage->duty);
+			usage->counters.running_ns += duty_ns;
+		}
+		usage->duty_since_ns = now_ns;
+	}
+	const int64_t mode_ns = now_ns - usage->mode_since_ns;
+	if (mode_ns > 0) {
+		usage->counters.mode_ns[usage->mode] += mode_ns;
+		usage->mode_since_ns = now_ns;
+	}
+}
+
+static int _load(const char *path, usage_counters_s *counters) {
+	int fd = -1;
+	int retval = 0;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT) {
+			LOG_PERROR("usage", "Can't open the usage file");
+		} else {
+			LOG_INFO("usage", "There is no usage file yet, starting from zero");
+		}
+		goto error;
+	}
+
+	_file_s file;
+	if (read(fd, &file, sizeof(file)) != sizeof(file)) {
+		LOG_ERROR("usage", "The usage file is truncated, starting from zero");
+		goto error;
+	}
+	if (memcmp(file.magic, _MAGIC, 4) || file.version != _VERSION) {
+		LOG_ERROR("usage", "The usage file has an incompatible format, starting from zero");
+		goto error;
+	}
+
+	counters->duty_ns = file.duty_ns;
+	counters->running_ns = file.running_ns;
+	counters->pulses = file.pulses;
+	counters->starts = file.starts;
+	memcpy(counters->mode_ns, file.mode_ns, sizeof(counters->mode_ns));
+
+	goto ok;
+	error:
+		retval = -1;
+	ok:
+		if (fd >= 0) {
+			close(fd);
+		}
+		return retval;
+}
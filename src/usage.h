@@ -0,0 +1,77 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "control.h"
+
+
+typedef struct {
+	uint64_t	duty_ns; // Integral of the PWM duty, i.e. the time at the full speed
+	uint64_t	running_ns; // Time with the non-zero duty
+	uint64_t	pulses; // Hall pulses, two per revolution
+	uint64_t	starts; // Transitions from the stopped fan
+	uint64_t	mode_ns[CONTROL_MODES];
+} usage_counters_s;
+
+typedef struct {
+	char					*path; // "" to keep the counters in memory only
+	int64_t					saved_ns;
+
+	pthread_mutex_t			mutex;
+	usage_counters_s		counters;
+	atomic_uint_least64_t	pulses; // From the Hall thread
+
+	float					duty; // -1 if unknown
+	int64_t					duty_since_ns;
+	control_mode_e			mode;
+	int64_t					mode_since_ns;
+} usage_s;
+
+
+usage_s *usage_init(const char *path, int64_t now_ns);
+void usage_destroy(usage_s *usage);
+void usage_set_path(usage_s *usage, const char *path);
+
+void usage_set_duty(usage_s *usage, int64_t now_ns, float duty);
+void usage_add_pulses(usage_s *usage, unsigned pulses);
+void usage_update(usage_s *usage, int64_t now_ns, control_mode_e mode);
+
+void usage_get(usage_s *usage, usage_counters_s *counters);
+int usage_save(usage_s *usage, int64_t now_ns);
+void usage_render_json(usage_s *usage, FILE *fp);
@@ -0,0 +1,121 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "whatif.h"
+
+
+// Replays a candidate curve over the recorded temperatures like kvmd-fan-replay
+// in the open loop: the temperature doesn't depend on the candidate fan speed,
+// so it shows how the policy would have reacted, but not how it would have cooled.
+// The actual changes are estimated at the history resolution.
+
+
+static void _summary_add(whatif_summary_s *summary, float speed, long double dt);
+static void _summary_finish(whatif_summary_s *summary);
+static void _render_summary(FILE *fp, const char *name, const whatif_summary_s *summary);
+
+
+void whatif_run(
+	const control_params_s *params, const history_point_s *points, size_t count,
+	float *speeds, whatif_summary_s *predicted, whatif_summary_s *actual) {
+
+	*predicted = (whatif_summary_s){0};
+	*actual = (whatif_summary_s){0};
+
+	control_s control;
+	control_init(&control, -1);
+	unsigned pwm = 0;
+	for (size_t index = 0; index < count; ++index) {
+		const history_point_s *const point = &points[index];
+		const unsigned flags = control_step(params, &control, point->ts * NS_PER_SEC, point->temp.avg, -1, false);
+		if (flags & CONTROL_SPIN_UP) {
+			predicted->spin_ups += 1;
+		}
+		if (flags & CONTROL_SPEED_CHANGED) {
+			const unsigned new_pwm = control_get_pwm(control.speed, 0, 1024);
+			if (new_pwm != pwm) {
+				predicted->pwm_changes += 1;
+				pwm = new_pwm;
+			}
+		}
+		speeds[index] = control.speed;
+
+		if (point->speed.min != point->speed.max || (index > 0 && point->speed.avg != points[index - 1].speed.avg)) {
+			actual->pwm_changes += 1;
+		}
+		if (index > 0 && points[index - 1].speed.min <= 0 && point->speed.max > 0) {
+			actual->spin_ups += 1;
+		}
+
+		// The last point is still in progress, it has no duration
+		const long double dt = (index + 1 < count ? points[index + 1].ts - point->ts : 0);
+		_summary_add(predicted, control.speed, dt);
+		_summary_add(actual, point->speed.avg, dt);
+	}
+	_summary_finish(predicted);
+	_summary_finish(actual);
+}
+
+void whatif_render_json(FILE *fp, const control_params_s *params, unsigned res, const history_point_s *points, size_t count) {
+	float *speeds;
+	A_CALLOC(speeds, count + 1);
+	whatif_summary_s predicted;
+	whatif_summary_s actual;
+	whatif_run(params, points, count, speeds, &predicted, &actual);
+
+	fprintf(fp, "{\"ok\": true, \"result\": {\"res\": %u, \"params\": {"
+		"\"temp_rise\": %.2f, \"temp_fall\": %.2f, \"temp_low\": %.2f, \"temp_high\": %.2f,"
+		" \"speed_idle\": %.2f, \"speed_low\": %.2f, \"speed_high\": %.2f, \"speed_heat\": %.2f, \"speed_spin_up\": %.2f,"
+		" \"speed_dwell\": %.0f, \"speed_changes\": %.0f},",
+		res, params->temp_rise, params->temp_fall, params->temp_low, params->temp_high,
+		params->speed_idle, params->speed_low, params->speed_high, params->speed_heat, params->speed_spin_up,
+		params->speed_dwell, params->speed_changes);
+	_render_summary(fp, "predicted", &predicted);
+	_render_summary(fp, "actual", &actual);
+
+	// [ts, temp, actual speed, predicted speed]
+	fputs(" \"timeline\": [", fp);
+	for (size_t index = 0; index < count; ++index) {
+		fprintf(fp, "%s[%.0Lf, %.2f, %.2f, %.2f]", (index > 0 ? ", " : ""),
+			points[index].ts, points[index].temp.avg, points[index].speed.avg, speeds[index]);
+	}
+	fputs("]}}\n", fp);
+	free(speeds);
+}
+
+static void _summary_add(whatif_summary_s *summary, float speed, long double dt) {
+	summary->duration += dt;
+	summary->speed_avg += speed * dt; // Sum until _summary_finish()
+	summary->speed_max = fmaxf(summary->speed_max, speed);
+}
+
+static void _summary_finish(whatif_summary_s *summary) {
+	if (summary->duration > 0) {
+		summary->speed_avg /= summary->duration;
+	}
+}
+
+static void _render_summary(FILE *fp, const char *name, const whatif_summary_s *summary) {
+	fprintf(fp, " \"%s\": {\"duration\": %.0Lf, \"speed_avg\": %.2f, \"speed_max\": %.2f, \"pwm_changes\": %u, \"spin_ups\": %u},",
+		name, summary->duration, summary->speed_avg, summary->speed_max, summary->pwm_changes, summary->spin_ups);
+}
@@ -0,0 +1,49 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "tools.h"
+#include "control.h"
+#include "history.h"
+
+
+typedef struct {
+	long double	duration;
+	float		speed_avg;
+	float		speed_max;
+	unsigned	pwm_changes;
+	unsigned	spin_ups;
+} whatif_summary_s;
+
+
+void whatif_run(
+	const control_params_s *params, const history_point_s *points, size_t count,
+	float *speeds, whatif_summary_s *predicted, whatif_summary_s *actual);
+
+void whatif_render_json(FILE *fp, const control_params_s *params, unsigned res, const history_point_s *points, size_t count);
@@ -0,0 +1,155 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <execinfo.h>
+
+
+// LD_PRELOAD shim counting the heap allocations of the whole process
+// in a time window after the warm-up. The window is set by the environment:
+//   KVMD_FAN_ALLOC_AFTER=<ms>  - from the start of the process;
+//   KVMD_FAN_ALLOC_FOR=<ms>    - the window length.
+// The first allocations in the window are printed with the backtraces.
+// At exit, the process fails if there were any, or if it didn't live
+// through the whole window. Relies on the glibc __libc_* entry points.
+
+#define _BACKTRACES	5
+#define _DEPTH		16
+
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+
+static int64_t			_g_begin_ns = -1; // -1 while the shim is not configured
+static int64_t			_g_end_ns;
+static atomic_uint		_g_count;
+static _Thread_local bool	_g_inside;
+
+
+static int64_t _now_ns(void);
+static void _account(const char *func, size_t size);
+
+
+__attribute__((constructor)) static void _init(void) {
+	const char *const after = getenv("KVMD_FAN_ALLOC_AFTER");
+	const char *const len = getenv("KVMD_FAN_ALLOC_FOR");
+	if (after != NULL && len != NULL) {
+		// The first backtrace() loads libgcc_s with malloc(), do it in advance
+		void *frames[_DEPTH];
+		backtrace(frames, _DEPTH);
+		const int64_t now_ns = _now_ns();
+		_g_end_ns = now_ns + (atoll(after) + atoll(len)) * 1000000;
+		_g_begin_ns = now_ns + atoll(after) * 1000000;
+	}
+}
+
+__attribute__((destructor)) static void _fini(void) {
+	if (_g_begin_ns < 0) {
+		return;
+	}
+	if (_now_ns() < _g_end_ns) {
+		fprintf(stderr, "== alloc: the process exited before the end of the window\n");
+		_exit(1);
+	}
+	const unsigned count = atomic_load(&_g_count);
+	if (count > 0) {
+		fprintf(stderr, "== alloc: %u allocations in the steady state\n", count);
+		_exit(1);
+	}
+	fprintf(stderr, "== alloc: OK\n");
+}
+
+void *malloc(size_t size) {
+	_account("malloc", size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	_account("calloc", nmemb * size);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	_account("realloc", size);
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+	_account("memalign", size);
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	_account("aligned_alloc", size);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+	_account("posix_memalign", size);
+	void *const result = __libc_memalign(alignment, size);
+	if (result == NULL) {
+		return 12; // ENOMEM
+	}
+	*ptr = result;
+	return 0;
+}
+
+static int64_t _now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _account(const char *func, size_t size) {
+	if (_g_begin_ns < 0 || _g_inside) {
+		return;
+	}
+	const int64_t now_ns = _now_ns();
+	if (now_ns < _g_begin_ns) {
+		return;
+	}
+	if (now_ns >= _g_end_ns) {
+		return;
+	}
+	const unsigned count = atomic_fetch_add(&_g_count, 1);
+	if (count < _BACKTRACES) {
+		_g_inside = true;
+		char msg[128];
+		const int len = snprintf(msg, sizeof(msg), "== alloc: %s(%zu) in the steady state:\n", func, size);
+		const ssize_t written = write(STDERR_FILENO, msg, len);
+		(void)written;
+		void *frames[_DEPTH];
+		backtrace_symbols_fd(frames, backtrace(frames, _DEPTH), STDERR_FILENO);
+		_g_inside = false;
+	}
+}
@@ -0,0 +1,397 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "../src/tools.h"
+#include "../src/state.h"
+#include "../src/history.h"
+#include "../src/encode.h"
+
+#include "tests.h"
+
+
+// The round-trip of the binary encoding on the edge values,
+// and the size and CPU comparison with JSON on a full 10s ring.
+
+#define _FULL_RING 8640
+#define _BENCH_ROUNDS 20
+
+
+static void _test_state(const char *name, int64_t now_ns, const state_s *state);
+static void _test_state_truncated(void);
+static void _test_state_varints(void);
+static void _test_history(const char *name, unsigned res, const history_point_s *points, size_t count);
+static void _test_history_garbage(void);
+static void _bench(void);
+
+static history_point_s *_make_points(size_t count, unsigned res);
+static size_t _encode_history(bool binary, unsigned res, const history_point_s *points, size_t count, uint8_t **data);
+static size_t _put_varint(uint8_t *buf, uint64_t value);
+
+
+int main(void) {
+	{
+		const state_s state = {.last_fail_ns = -1};
+		_test_state("zero", 0, &state);
+	}
+	{
+		// Zigzag negatives, the sensors can report below zero and -1 is the "never" marker
+		const state_s state = {
+			.temp_real = -40.25, .temp_fixed = -0.01, .temp_health = TEMP_HEALTH_FAILED,
+			.speed = 0, .last_fail_ns = -1,
+		};
+		_test_state("negatives", -123456 * NS_PER_MS, &state);
+	}
+	{
+		// Every field is set to its max, up to the precision of the format
+		const state_s state = {
+			.temp_real = 999.99, .temp_fixed = 999.99, .temp_health = TEMP_HEALTH_HOLD,
+			.temp_errors = UINT_MAX, .speed = 100, .pwm = UINT_MAX, .rpm = UINT_MAX, .ok = true,
+			.last_fail_ns = INT64_MAX / NS_PER_MS * NS_PER_MS, .has_hall = true, .config_gen = UINT_MAX,
+			.startup_pwm_ns = INT64_MAX / 1000 * 1000, .startup_ready_ns = INT64_MAX / 1000 * 1000,
+			.has_throttle = true, .throttle_flags = UINT_MAX, .throttle_active = true,
+			.throttle_events = UINT_MAX, .throttle_ns = INT64_MAX / NS_PER_MS * NS_PER_MS,
+			.suppressed_dwell = UINT_MAX, .suppressed_budget = UINT_MAX,
+		};
+		_test_state("max", INT64_MAX / NS_PER_MS * NS_PER_MS, &state);
+	}
+	{
+		// Each field has its own value, so a shift of the fields can't pass unnoticed
+		const state_s state = {
+			.temp_real = 1.01, .temp_fixed = 2.02, .temp_health = TEMP_HEALTH_FALLBACK, .temp_errors = 3,
+			.speed = 4.04, .pwm = 5, .rpm = 6, .ok = true, .last_fail_ns = 7 * NS_PER_MS, .has_hall = false,
+			.config_gen = 8, .startup_pwm_ns = 9000, .startup_ready_ns = 10000, .has_throttle = true,
+			.throttle_flags = 11, .throttle_active = false, .throttle_events = 12, .throttle_ns = 13 * NS_PER_MS,
+			.suppressed_dwell = 14, .suppressed_budget = 15,
+		};
+		_test_state("distinct", 16 * NS_PER_MS, &state);
+	}
+	_test_state_truncated();
+	_test_state_varints();
+
+	{
+		const unsigned res = 10;
+		history_point_s *const points = _make_points(_FULL_RING, res);
+		// The history is requested in arbitrary slices, each one starts from zero deltas
+		const size_t chunks[] = {0, 1, 2, 127, 128, 1000, _FULL_RING};
+		for (unsigned index = 0; index < sizeof(chunks) / sizeof(chunks[0]); ++index) {
+			char name[32];
+			snprintf(name, sizeof(name), "history[%zu]", chunks[index]);
+			_test_history(name, res, points + (_FULL_RING - chunks[index]), chunks[index]);
+		}
+		free(points);
+	}
+	{
+		// Series crossing zero in both directions
+		history_point_s points[4] = {0};
+		const float temps[] = {-55.5, 0, 125.25, -0.01};
+		for (unsigned index = 0; index < 4; ++index) {
+			points[index].ts = 1000000 + index * 3600;
+			points[index].temp.min = points[index].temp.max = points[index].temp.avg = temps[index];
+			points[index].speed.min = points[index].speed.max = points[index].speed.avg = (index % 2 ? 100 : 0);
+			points[index].rpm.min = points[index].rpm.max = points[index].rpm.avg = (index % 2 ? 0 : 65535);
+		}
+		_test_history("history-negatives", 3600, points, 4);
+	}
+	_test_history_garbage();
+
+	_bench();
+	return TESTS_RESULT("encode");
+}
+
+static void _test_state(const char *name, int64_t now_ns, const state_s *state) {
+	uint8_t buf[ENCODE_STATE_MAX_SIZE];
+	const size_t size = encode_state_binary_buf(buf, ENCODE_STATE_MAX_SIZE, now_ns, state);
+	CHECK(decode_kind(buf, size) == ENCODE_KIND_STATE, "%s: kind", name);
+
+	int64_t got_ns = 0;
+	state_s got = {0};
+	CHECK(decode_state_binary(buf, size, &got_ns, &got) == 0, "%s: decode", name);
+
+	// The JSON must fit as well
+	char json[ENCODE_STATE_MAX_SIZE];
+	encode_state_json_buf(json, ENCODE_STATE_MAX_SIZE, now_ns, state);
+
+#	define CHECK_EQ(_field, _fmt) \
+		CHECK(got._field == state->_field, "%s: " #_field ": " _fmt " != " _fmt, name, got._field, state->_field)
+#	define CHECK_FIXED(_field) \
+		CHECK(fabsf(got._field - state->_field) < 0.006, "%s: " #_field ": %f != %f", name, got._field, state->_field)
+	CHECK(got_ns == now_ns, "%s: now_ns: %jd != %jd", name, (intmax_t)got_ns, (intmax_t)now_ns);
+	CHECK_FIXED(temp_real);
+	CHECK_FIXED(temp_fixed);
+	CHECK_EQ(temp_health, "%d");
+	CHECK_EQ(temp_errors, "%u");
+	CHECK_FIXED(speed);
+	CHECK_EQ(pwm, "%u");
+	CHECK_EQ(rpm, "%u");
+	CHECK_EQ(ok, "%d");
+	CHECK_EQ(last_fail_ns, "%jd");
+	CHECK_EQ(has_hall, "%d");
+	CHECK_EQ(config_gen, "%u");
+	CHECK_EQ(startup_pwm_ns, "%jd");
+	CHECK_EQ(startup_ready_ns, "%jd");
+	CHECK_EQ(has_throttle, "%d");
+	CHECK_EQ(throttle_flags, "%u");
+	CHECK_EQ(throttle_active, "%d");
+	CHECK_EQ(throttle_events, "%u");
+	CHECK_EQ(throttle_ns, "%jd");
+	CHECK_EQ(suppressed_dwell, "%u");
+	CHECK_EQ(suppressed_budget, "%u");
+#	undef CHECK_FIXED
+#	undef CHECK_EQ
+}
+
+static void _test_state_truncated(void) {
+	const state_s state = {.temp_real = 55.5, .speed = 42, .last_fail_ns = 3600 * NS_PER_SEC, .suppressed_budget = 7};
+	uint8_t buf[ENCODE_STATE_MAX_SIZE];
+	const size_t size = encode_state_binary_buf(buf, ENCODE_STATE_MAX_SIZE, 86400 * NS_PER_SEC, &state);
+
+	for (size_t len = 0; len < size; ++len) {
+		int64_t now_ns;
+		state_s got;
+		CHECK(decode_state_binary(buf, len, &now_ns, &got) < 0, "state-truncated: accepted %zu of %zu bytes", len, size);
+	}
+
+	uint8_t bad[ENCODE_STATE_MAX_SIZE];
+	memcpy(bad, buf, size);
+	bad[0] = 'X';
+	int64_t now_ns;
+	state_s got;
+	CHECK(decode_state_binary(bad, size, &now_ns, &got) < 0, "state-truncated: accepted a bad magic");
+	memcpy(bad, buf, size);
+	bad[4] = 0xFF;
+	CHECK(decode_state_binary(bad, size, &now_ns, &got) < 0, "state-truncated: accepted a bad version");
+	memcpy(bad, buf, size);
+	bad[5] = ENCODE_KIND_HISTORY;
+	CHECK(decode_state_binary(bad, size, &now_ns, &got) < 0, "state-truncated: accepted a wrong kind");
+}
+
+static void _test_state_varints(void) {
+	// The encoder never produces 10-byte varints for the state, but a newer one
+	// may add the fields with the full int64 range. They must be skipped.
+	const state_s state = {.temp_real = 12.34, .rpm = 1500, .last_fail_ns = -1, .suppressed_dwell = 3};
+	uint8_t buf[ENCODE_STATE_MAX_SIZE + 64];
+	size_t size = encode_state_binary_buf(buf, ENCODE_STATE_MAX_SIZE, 5 * NS_PER_SEC, &state);
+
+	// Rewrite nfields (1 byte for the current count) and append INT64_MIN, INT64_MAX and -1 zigzagged
+	CHECK(buf[6] < 0x80, "state-varints: nfields takes more than one byte");
+	buf[6] += 3;
+	size += _put_varint(buf + size, UINT64_MAX); // INT64_MIN
+	size += _put_varint(buf + size, UINT64_MAX - 1); // INT64_MAX
+	size += _put_varint(buf + size, 1); // -1
+
+	int64_t now_ns;
+	state_s got = {0};
+	CHECK(decode_state_binary(buf, size, &now_ns, &got) == 0, "state-varints: max varints are not skipped");
+	CHECK(now_ns == 5 * NS_PER_SEC && got.rpm == 1500 && got.suppressed_dwell == 3 && got.last_fail_ns == -1,
+		"state-varints: the known fields are damaged");
+
+	// 11 bytes is an overlong varint
+	size = encode_state_binary_buf(buf, ENCODE_STATE_MAX_SIZE, 0, &state);
+	buf[6] += 1;
+	memset(buf + size, 0xFF, 10);
+	buf[size + 10] = 0x01;
+	CHECK(decode_state_binary(buf, size + 11, &now_ns, &got) < 0, "state-varints: accepted an overlong varint");
+}
+
+static void _test_history(const char *name, unsigned res, const history_point_s *points, size_t count) {
+	uint8_t *data;
+	const size_t size = _encode_history(true, res, points, count, &data);
+	CHECK(decode_kind(data, size) == ENCODE_KIND_HISTORY, "%s: kind", name);
+
+	unsigned got_res = 0;
+	history_point_s *got = NULL;
+	size_t got_count = 0;
+	if (decode_history_binary(data, size, &got_res, &got, &got_count) < 0) {
+		CHECK(false, "%s: decode", name);
+		goto done;
+	}
+	CHECK(got_res == res, "%s: res: %u != %u", name, got_res, res);
+	CHECK(got_count == count, "%s: count: %zu != %zu", name, got_count, count);
+
+	unsigned bad = 0;
+	for (size_t index = 0; index < count && index < got_count; ++index) {
+		const history_point_s *const a = &got[index];
+		const history_point_s *const b = &points[index];
+		bad += (
+			fabsl(a->ts - b->ts) > 0.0006
+			|| fabsf(a->temp.min - b->temp.min) > 0.006 || fabsf(a->temp.max - b->temp.max) > 0.006
+			|| fabsf(a->temp.avg - b->temp.avg) > 0.006 || fabsf(a->speed.min - b->speed.min) > 0.006
+			|| fabsf(a->speed.max - b->speed.max) > 0.006 || fabsf(a->speed.avg - b->speed.avg) > 0.006
+			|| fabsf(a->rpm.min - b->rpm.min) > 0.6 || fabsf(a->rpm.max - b->rpm.max) > 0.6
+			|| fabsf(a->rpm.avg - b->rpm.avg) > 0.6
+		);
+	}
+	CHECK(bad == 0, "%s: %u points differ", name, bad);
+
+	// Any prefix is an error, not a crash or a partial result
+	if (count <= 128) {
+		for (size_t len = 0; len < size; ++len) {
+			history_point_s *tmp = NULL;
+			if (decode_history_binary(data, len, &got_res, &tmp, &got_count) == 0) {
+				CHECK(false, "%s: accepted %zu of %zu bytes", name, len, size);
+				free(tmp);
+			}
+		}
+	}
+
+	done:
+		free(got);
+		free(data);
+}
+
+static void _test_history_garbage(void) {
+	// A huge count must be rejected before the allocation
+	uint8_t buf[32] = {'K', 'F', 'A', 'N', 1, ENCODE_KIND_HISTORY};
+	size_t size = 6;
+	size += _put_varint(buf + size, 10);
+	size += _put_varint(buf + size, UINT64_MAX);
+	size += _put_varint(buf + size, 10);
+	unsigned res;
+	history_point_s *points = NULL;
+	size_t count;
+	CHECK(decode_history_binary(buf, size, &res, &points, &count) < 0, "history-garbage: accepted a huge count");
+	CHECK(points == NULL, "history-garbage: leaked the points");
+
+	// So does a huge number of the series without the points
+	size = 6;
+	size += _put_varint(buf + size, 10);
+	size += _put_varint(buf + size, 0);
+	size += _put_varint(buf + size, UINT64_MAX);
+	CHECK(decode_history_binary(buf, size, &res, &points, &count) < 0, "history-garbage: accepted a huge nseries");
+	CHECK(points == NULL, "history-garbage: leaked the points");
+
+	// Unknown extra series are skipped, version 1 has the plain deltas for the timestamps
+	size = 6;
+	size += _put_varint(buf + size, 10);
+	size += _put_varint(buf + size, 2);
+	size += _put_varint(buf + size, 12); // ts + 9 known series + 2 unknown
+	for (unsigned index = 0; index < 12 * 2; ++index) {
+		buf[size++] = 2; // +1 delta
+	}
+	if (decode_history_binary(buf, size, &res, &points, &count) == 0) {
+		CHECK(count == 2 && fabsl(points[1].ts - 0.002) < 0.0001 && fabsf(points[1].rpm.avg - 2) < 0.1,
+			"history-garbage: wrong values with the unknown series");
+		free(points);
+	} else {
+		CHECK(false, "history-garbage: unknown series are not skipped");
+	}
+}
+
+static void _bench(void) {
+	const unsigned res = 10;
+	history_point_s *const points = _make_points(_FULL_RING, res);
+
+	size_t sizes[2] = {0};
+	int64_t times_ns[2] = {0};
+	for (unsigned binary = 0; binary < 2; ++binary) {
+		const int64_t begin_ns = get_now_monotonic_ns();
+		for (unsigned round = 0; round < _BENCH_ROUNDS; ++round) {
+			uint8_t *data;
+			sizes[binary] = _encode_history(binary, res, points, _FULL_RING, &data);
+			free(data);
+		}
+		times_ns[binary] = (get_now_monotonic_ns() - begin_ns) / _BENCH_ROUNDS;
+	}
+	printf("-- history, %u points: JSON %zu bytes in %.2Lf ms, binary %zu bytes in %.2Lf ms (x%.1f smaller, x%.1f faster)\n",
+		_FULL_RING, sizes[0], ns_to_sec(times_ns[0]) * 1000, sizes[1], ns_to_sec(times_ns[1]) * 1000,
+		(double)sizes[0] / sizes[1], (double)times_ns[0] / times_ns[1]);
+	// The size is deterministic, the time is only reported
+	CHECK(sizes[1] * 6 < sizes[0], "bench: the binary history is not much smaller than JSON");
+	free(points);
+
+	const state_s state = {.temp_real = 51.23, .temp_fixed = 51, .speed = 37.5, .pwm = 384, .rpm = 2345, .ok = true, .last_fail_ns = -1};
+	const unsigned rounds = 100000;
+	char json[ENCODE_STATE_MAX_SIZE];
+	uint8_t bin[ENCODE_STATE_MAX_SIZE];
+	size_t json_size = 0;
+	size_t bin_size = 0;
+	int64_t begin_ns = get_now_monotonic_ns();
+	for (unsigned round = 0; round < rounds; ++round) {
+		json_size = encode_state_json_buf(json, ENCODE_STATE_MAX_SIZE, round * NS_PER_SEC, &state);
+	}
+	const int64_t json_ns = (get_now_monotonic_ns() - begin_ns) / rounds;
+	begin_ns = get_now_monotonic_ns();
+	for (unsigned round = 0; round < rounds; ++round) {
+		bin_size = encode_state_binary_buf(bin, ENCODE_STATE_MAX_SIZE, round * NS_PER_SEC, &state);
+	}
+	const int64_t bin_ns = (get_now_monotonic_ns() - begin_ns) / rounds;
+	printf("-- state: JSON %zu bytes in %jd ns, binary %zu bytes in %jd ns\n",
+		json_size, (intmax_t)json_ns, bin_size, (intmax_t)bin_ns);
+	CHECK(bin_size * 4 < json_size, "bench: the binary state is not much smaller than JSON");
+}
+
+static history_point_s *_make_points(size_t count, unsigned res) {
+	// A synthetic day: a slow daily wave, load bursts and the sensor noise
+	history_point_s *points;
+	A_CALLOC(points, count);
+	srand(1);
+	for (size_t index = 0; index < count; ++index) {
+		history_point_s *const point = &points[index];
+		point->ts = 1700000000 + (long double)index * res;
+		const float base = 50 + 8 * sinf(index * 2 * M_PI / count) + ((index / 60) % 5 == 0 ? 10 : 0);
+		const float noise = (float)(rand() % 200) / 100;
+		point->temp.min = base - noise;
+		point->temp.max = base + noise;
+		point->temp.avg = base + noise / 3;
+		point->speed.avg = (base < 45 ? 0 : (base - 45) * 100 / 30);
+		point->speed.min = point->speed.avg - (point->speed.avg > 1 ? 1 : 0);
+		point->speed.max = point->speed.avg;
+		point->rpm.avg = point->speed.avg * 50 + rand() % 20;
+		point->rpm.min = point->rpm.avg - rand() % 30;
+		point->rpm.max = point->rpm.avg + rand() % 30;
+	}
+	return points;
+}
+
+static size_t _encode_history(bool binary, unsigned res, const history_point_s *points, size_t count, uint8_t **data) {
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *const fp = open_memstream(&buf, &size);
+	assert(fp != NULL);
+	if (binary) {
+		encode_history_binary(fp, res, points, count);
+	} else {
+		encode_history_json(fp, res, points, count);
+	}
+	assert(!fclose(fp));
+	*data = (uint8_t *)buf;
+	return size;
+}
+
+static size_t _put_varint(uint8_t *buf, uint64_t value) {
+	size_t size = 0;
+	do {
+		buf[size] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+		value >>= 7;
+		++size;
+	} while (value);
+	return size;
+}
@@ -0,0 +1,262 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "../src/tools.h"
+#include "../src/logging.h"
+
+#include "tests.h"
+
+
+// The per-call cost of LOG_INFO() on the caller side, the ring against
+// the old inline path (a global mutex, fprintf() and fflush() to stderr).
+// The output goes to a file like to the journal, with one and several
+// threads logging at the same time, paced and back-to-back. The ring may
+// drop the messages when it's full, so all the messages must be written
+// or reported as dropped, and the lines must not be interleaved.
+
+#define _MAX_THREADS	4
+#define _CALLS			10000
+#define _PACE_NS		(50 * 1000) // The writer has the time to drain the ring
+
+
+typedef struct {
+	bool				ring;
+	unsigned			id;
+	int64_t				pace_ns;
+	int64_t				*lats_ns;
+	pthread_barrier_t	*barrier;
+} _worker_s;
+
+typedef struct {
+	unsigned	calls;
+	unsigned	written;
+	unsigned	dropped;
+	unsigned	broken;
+} _output_s;
+
+
+static pthread_mutex_t _g_old_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define _OLD_LOG_INFO(_class, _msg, ...) { \
+		A_MUTEX_LOCK(&_g_old_mutex); \
+		fprintf(stderr, "-- INFO  [%.03Lf %9s] -- " _msg, get_now_monotonic(), _class, ##__VA_ARGS__); \
+		fputc('\n', stderr); \
+		fflush(stderr); \
+		A_MUTEX_UNLOCK(&_g_old_mutex); \
+	}
+
+
+static void _run(FILE *out, bool ring, unsigned threads, int64_t pace_ns);
+static void _run_slow_pipe(FILE *out);
+static void *_worker_thread(void *v_worker);
+static void *_reader_thread(void *v_fds);
+static void _read_output(FILE *out, _output_s *output);
+static int _cmp_ns(const void *v_a, const void *v_b);
+
+
+int main(void) {
+	// The stderr is replaced by a temporary file for the runs
+	FILE *const out = tmpfile();
+	assert(out != NULL);
+
+	printf("-- logging, %ld CPUs, %u calls per thread\n", sysconf(_SC_NPROCESSORS_ONLN), _CALLS);
+	const unsigned threads[] = {1, _MAX_THREADS};
+	for (unsigned index = 0; index < 2; ++index) {
+		for (int64_t pace_ns = _PACE_NS; pace_ns >= 0; pace_ns -= _PACE_NS) {
+			_run(out, false, threads[index], pace_ns);
+			_run(out, true, threads[index], pace_ns);
+		}
+	}
+	_run_slow_pipe(out);
+	fclose(out);
+	return TESTS_RESULT("logging");
+}
+
+static void _run(FILE *out, bool ring, unsigned threads, int64_t pace_ns) {
+	int64_t *lats_ns;
+	A_CALLOC(lats_ns, threads * _CALLS);
+
+	assert(!ftruncate(fileno(out), 0));
+	assert(lseek(fileno(out), 0, SEEK_SET) == 0);
+	const int stderr_fd = dup(STDERR_FILENO);
+	assert(stderr_fd >= 0);
+	assert(dup2(fileno(out), STDERR_FILENO) == STDERR_FILENO);
+	if (ring) {
+		LOGGING_INIT;
+	}
+
+	pthread_barrier_t barrier;
+	assert(!pthread_barrier_init(&barrier, NULL, threads));
+	_worker_s workers[_MAX_THREADS];
+	pthread_t tids[_MAX_THREADS];
+	for (unsigned index = 0; index < threads; ++index) {
+		workers[index] = (_worker_s){
+			.ring = ring,
+			.id = index,
+			.pace_ns = pace_ns,
+			.lats_ns = lats_ns + index * _CALLS,
+			.barrier = &barrier,
+		};
+		A_THREAD_CREATE(&tids[index], _worker_thread, &workers[index]);
+	}
+	for (unsigned index = 0; index < threads; ++index) {
+		A_THREAD_JOIN(tids[index]);
+	}
+	assert(!pthread_barrier_destroy(&barrier));
+
+	if (ring) {
+		LOGGING_DESTROY; // Writes the rest and the drops
+	}
+	assert(dup2(stderr_fd, STDERR_FILENO) == STDERR_FILENO);
+	close(stderr_fd);
+
+	const size_t count = threads * _CALLS;
+	qsort(lats_ns, count, sizeof(int64_t), _cmp_ns);
+	int64_t sum_ns = 0;
+	for (size_t index = 0; index < count; ++index) {
+		sum_ns += lats_ns[index];
+	}
+	_output_s output = {.calls = count};
+	_read_output(out, &output);
+
+	printf("-- %s, %u thread(s), %-12s mean=%5jd ns, p50=%5jd ns, p99=%6jd ns, max=%8jd ns, dropped=%u\n",
+		(ring ? "ring " : "mutex"), threads, (pace_ns > 0 ? "paced:" : "back-to-back:"),
+		(intmax_t)(sum_ns / count), (intmax_t)lats_ns[count / 2], (intmax_t)lats_ns[count * 99 / 100],
+		(intmax_t)lats_ns[count - 1], output.dropped);
+
+	const char *const name = (ring ? "ring" : "mutex");
+	CHECK(output.written + output.dropped == output.calls,
+		"%s, %u threads: written %u + dropped %u != %u calls", name, threads, output.written, output.dropped, output.calls);
+	CHECK(output.broken == 0, "%s, %u threads: %u broken lines", name, threads, output.broken);
+	CHECK(ring || output.dropped == 0, "%s, %u threads: dropped %u messages", name, threads, output.dropped);
+	free(lats_ns);
+}
+
+static void _run_slow_pipe(FILE *out) {
+	// A non-blocking pipe with a small buffer and a slow reader, like an overloaded journald.
+	// writev() writes a part of the batch or nothing, the lines must stay intact anyway.
+	assert(!ftruncate(fileno(out), 0));
+	assert(lseek(fileno(out), 0, SEEK_SET) == 0);
+	int fds[3];
+	assert(!pipe(fds));
+	fcntl(fds[1], F_SETPIPE_SZ, 4096);
+	assert(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+	fds[2] = fileno(out);
+	pthread_t tid;
+	A_THREAD_CREATE(&tid, _reader_thread, fds);
+
+	const int stderr_fd = dup(STDERR_FILENO);
+	assert(stderr_fd >= 0);
+	assert(dup2(fds[1], STDERR_FILENO) == STDERR_FILENO);
+	close(fds[1]);
+	LOGGING_INIT;
+	const unsigned calls = 2000;
+	for (unsigned call = 0; call < calls; ++call) {
+		LOG_INFO("bench", "call=%u thread=0 temp=%.2f speed=%.2f", call, 55.5, 42.25);
+		if (call % 50 == 0) {
+			usleep(1000);
+		}
+	}
+	LOGGING_DESTROY;
+	assert(dup2(stderr_fd, STDERR_FILENO) == STDERR_FILENO); // Closes the pipe
+	close(stderr_fd);
+	A_THREAD_JOIN(tid);
+	close(fds[0]);
+
+	_output_s output = {.calls = calls};
+	_read_output(out, &output);
+	printf("-- ring , slow pipe: written=%u, dropped=%u\n", output.written, output.dropped);
+	CHECK(output.written + output.dropped == output.calls,
+		"slow pipe: written %u + dropped %u != %u calls", output.written, output.dropped, output.calls);
+	CHECK(output.broken == 0, "slow pipe: %u broken lines", output.broken);
+}
+
+static void *_worker_thread(void *v_worker) {
+	_worker_s *const worker = v_worker;
+	pthread_barrier_wait(worker->barrier);
+	for (unsigned call = 0; call < _CALLS; ++call) {
+		const int64_t begin_ns = get_now_monotonic_ns();
+		if (worker->ring) {
+			LOG_INFO("bench", "call=%u thread=%u temp=%.2f speed=%.2f", call, worker->id, 55.5, 42.25);
+		} else {
+			_OLD_LOG_INFO("bench", "call=%u thread=%u temp=%.2f speed=%.2f", call, worker->id, 55.5, 42.25);
+		}
+		const int64_t end_ns = get_now_monotonic_ns();
+		worker->lats_ns[call] = end_ns - begin_ns;
+		if (worker->pace_ns > 0) {
+			// Sleep, not spin, the writer may need the same CPU
+			const int64_t left_ns = begin_ns + worker->pace_ns - get_now_monotonic_ns();
+			if (left_ns > 0) {
+				const struct timespec ts = {.tv_sec = left_ns / NS_PER_SEC, .tv_nsec = left_ns % NS_PER_SEC};
+				nanosleep(&ts, NULL);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void *_reader_thread(void *v_fds) {
+	const int *const fds = v_fds;
+	char buf[100];
+	ssize_t size;
+	while ((size = read(fds[0], buf, sizeof(buf))) > 0) {
+		assert(write(fds[2], buf, size) == size);
+		usleep(20);
+	}
+	return NULL;
+}
+
+static void _read_output(FILE *out, _output_s *output) {
+	rewind(out);
+	char line[1024];
+	while (fgets(line, sizeof(line), out) != NULL) {
+		unsigned long dropped;
+		if (strncmp(line, "-- ", 3) || line[strlen(line) - 1] != '\n') {
+			++output->broken;
+		} else if (strstr(line, "] -- call=") != NULL && strstr(line + 3, "-- ") == strstr(line, "] -- ") + 2) {
+			++output->written;
+		} else if (sscanf(line, "-- ERROR [%*s %*s -- Dropped %lu messages", &dropped) == 1) {
+			output->dropped += dropped;
+		} else {
+			++output->broken;
+		}
+	}
+}
+
+static int _cmp_ns(const void *v_a, const void *v_b) {
+	const int64_t a = *(const int64_t *)v_a;
+	const int64_t b = *(const int64_t *)v_b;
+	return (a > b) - (a < b);
+}
@@ -0,0 +1,47 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdio.h>
+
+
+// Each test program checks everything it can and exits with 1 if anything failed
+
+static unsigned tests_failed = 0;
+
+#define CHECK(_cond, _msg, ...) { \
+		if (!(_cond)) { \
+			fprintf(stderr, "FAIL %s:%d: " _msg "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+			++tests_failed; \
+		} \
+	}
+
+#define TESTS_RESULT(_name) ({ \
+		if (tests_failed > 0) { \
+			fprintf(stderr, "== %s: %u checks failed\n", _name, tests_failed); \
+		} else { \
+			printf("== %s: OK\n", _name); \
+		} \
+		(tests_failed > 0 ? 1 : 0); \
+	})
@@ -0,0 +1,203 @@
+/*****************************************************************************
+#                                                                            #
+#    KVMD-FAN - A small fan controller daemon for PiKVM.                     #
+#                                                                            #
+#    Copyright (C) 2018-2023  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/thermal.h>
+
+#include "../src/tools.h"
+#include "../src/logging.h"
+#include "../src/thermal.h"
+
+#include "tests.h"
+
+
+// The parser is fed by a socketpair() instead of the kernel: the crafted
+// generic netlink messages, several of them in one datagram, the truncated
+// and the garbage frames. thermal_wait() must count only the relevant events.
+
+#define _FAMILY 0x1A
+#define _WAIT_NS (50 * NS_PER_MS)
+
+
+typedef struct {
+	uint8_t	data[1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+	size_t	size;
+} _frame_s;
+
+
+static void _add_msg(_frame_s *frame, unsigned type, unsigned cmd, const uint32_t *attrs, unsigned nattrs);
+static void _send(int fd, const void *data, size_t size);
+static void _expect(thermal_s *thermal, int fd, const _frame_s *frame, int expected, const char *name);
+
+
+int main(void) {
+	LOGGING_INIT;
+	log_level = LOG_LEVEL_VERBOSE;
+
+#	ifdef THERMAL_GENL_EVENT_GROUP_NAME
+	int fds[2];
+	assert(!socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds));
+	thermal_s *const thermal = thermal_init_fd(fds[0], _FAMILY);
+
+	{
+		const int64_t begin_ns = get_now_monotonic_ns();
+		CHECK(thermal_wait(thermal, _WAIT_NS) == 0, "timeout: got an event");
+		CHECK(get_now_monotonic_ns() - begin_ns >= _WAIT_NS - NS_PER_MS, "timeout: returned too early");
+	}
+	{
+		_frame_s frame = {0};
+		const uint32_t attrs[] = {THERMAL_GENL_ATTR_CDEV_ID, 3, THERMAL_GENL_ATTR_CDEV_CUR_STATE, 2};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_CDEV_STATE_UPDATE, attrs, 2);
+		_expect(thermal, fds[1], &frame, 1, "cdev-update");
+	}
+	{
+		_frame_s frame = {0};
+		const uint32_t attrs[] = {THERMAL_GENL_ATTR_TZ_ID, 0, THERMAL_GENL_ATTR_TZ_TRIP_ID, 1};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_TRIP_UP, attrs, 2);
+		_expect(thermal, fds[1], &frame, 1, "trip-up");
+	}
+	{
+		// Multipart: a crossing down, a zone creation which is not relevant, and a crossing up
+		_frame_s frame = {0};
+		const uint32_t attrs[] = {THERMAL_GENL_ATTR_TZ_ID, 0, THERMAL_GENL_ATTR_TZ_TRIP_ID, 0};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_TRIP_DOWN, attrs, 2);
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_CREATE, attrs, 1);
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_TRIP_UP, attrs, 2);
+		_expect(thermal, fds[1], &frame, 2, "multipart");
+	}
+	{
+		// Several datagrams are read at once
+		_frame_s frame = {0};
+		const uint32_t attrs[] = {THERMAL_GENL_ATTR_CDEV_ID, 0, THERMAL_GENL_ATTR_CDEV_CUR_STATE, 1};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_CDEV_STATE_UPDATE, attrs, 2);
+		_send(fds[1], frame.data, frame.size);
+		_send(fds[1], frame.data, frame.size);
+		_expect(thermal, fds[1], &frame, 3, "backlog");
+	}
+	{
+		_frame_s frame = {0};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_DISABLE, NULL, 0);
+		_expect(thermal, fds[1], &frame, 0, "irrelevant");
+	}
+	{
+		_frame_s frame = {0};
+		_add_msg(&frame, _FAMILY + 1, THERMAL_GENL_EVENT_TZ_TRIP_UP, NULL, 0);
+		_add_msg(&frame, NLMSG_NOOP, THERMAL_GENL_EVENT_TZ_TRIP_UP, NULL, 0);
+		_expect(thermal, fds[1], &frame, 0, "other-family");
+	}
+	{
+		// The datagram is shorter than nlmsg_len
+		_frame_s frame = {0};
+		const uint32_t attrs[] = {THERMAL_GENL_ATTR_TZ_ID, 0, THERMAL_GENL_ATTR_TZ_TRIP_ID, 1};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_TRIP_UP, attrs, 2);
+		frame.size -= 8;
+		_expect(thermal, fds[1], &frame, 0, "truncated-msg");
+	}
+	{
+		// No room for the genl header
+		_frame_s frame = {0};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_TRIP_UP, NULL, 0);
+		((struct nlmsghdr *)frame.data)->nlmsg_len = NLMSG_LENGTH(2);
+		_expect(thermal, fds[1], &frame, 0, "no-genl");
+	}
+	{
+		// The attribute claims more than the message has
+		_frame_s frame = {0};
+		const uint32_t attrs[] = {THERMAL_GENL_ATTR_CDEV_ID, 7, THERMAL_GENL_ATTR_CDEV_CUR_STATE, 1};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_CDEV_STATE_UPDATE, attrs, 2);
+		struct nlattr *const attr = (struct nlattr *)(frame.data + NLMSG_LENGTH(GENL_HDRLEN));
+		attr->nla_len = 200;
+		_expect(thermal, fds[1], &frame, 0, "truncated-attr");
+	}
+	{
+		// The required attributes are missing or too short
+		_frame_s frame = {0};
+		const uint32_t attrs[] = {THERMAL_GENL_ATTR_TZ_ID, 0};
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_CDEV_STATE_UPDATE, NULL, 0);
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_TRIP_UP, attrs, 1);
+		_add_msg(&frame, _FAMILY, THERMAL_GENL_EVENT_TZ_TRIP_DOWN, attrs, 1);
+		struct nlattr *const attr = (struct nlattr *)(frame.data + frame.size - NLA_HDRLEN - sizeof(uint32_t));
+		attr->nla_len = NLA_HDRLEN + 2;
+		_expect(thermal, fds[1], &frame, 0, "missing-attrs");
+	}
+	{
+		_frame_s frame = {.size = 333};
+		srand(1);
+		for (size_t index = 0; index < frame.size; ++index) {
+			frame.data[index] = rand();
+		}
+		_expect(thermal, fds[1], &frame, 0, "garbage");
+		frame.size = 3;
+		_expect(thermal, fds[1], &frame, 0, "short-garbage");
+	}
+	CHECK(thermal->events == 7, "events: %u != 7", thermal->events);
+
+	// The peer is gone, nothing to count and no busy loop
+	close(fds[1]);
+	CHECK(thermal_wait(thermal, _WAIT_NS) == 0, "closed: got an event");
+	thermal_destroy(thermal);
+
+#	else
+	printf("-- thermal: no THERMAL_GENL_EVENT_GROUP_NAME in the kernel headers, skipped\n");
+#	endif
+
+	LOGGING_DESTROY;
+	return TESTS_RESULT("thermal");
+}
+
+static void _add_msg(_frame_s *frame, unsigned type, unsigned cmd, const uint32_t *attrs, unsigned nattrs) {
+	// attrs are pairs of the type and the u32 value
+	struct nlmsghdr *const msg = (struct nlmsghdr *)(frame->data + frame->size);
+	size_t size = NLMSG_LENGTH(GENL_HDRLEN);
+	assert(frame->size + NLMSG_ALIGN(size + nattrs * NLA_HDRLEN * 2) <= sizeof(frame->data));
+	*msg = (struct nlmsghdr){.nlmsg_type = type, .nlmsg_seq = 1};
+	*(struct genlmsghdr *)NLMSG_DATA(msg) = (struct genlmsghdr){.cmd = cmd, .version = 1};
+	for (unsigned index = 0; index < nattrs; ++index) {
+		struct nlattr *const attr = (struct nlattr *)((uint8_t *)msg + size);
+		*attr = (struct nlattr){.nla_len = NLA_HDRLEN + sizeof(uint32_t), .nla_type = attrs[index * 2]};
+		memcpy((uint8_t *)attr + NLA_HDRLEN, &attrs[index * 2 + 1], sizeof(uint32_t));
+		size += NLA_ALIGN(attr->nla_len);
+	}
+	msg->nlmsg_len = size;
+	frame->size += NLMSG_ALIGN(size);
+}
+
+static void _send(int fd, const void *data, size_t size) {
+	assert(send(fd, data, size, 0) == (ssize_t)size);
+}
+
+static void _expect(thermal_s *thermal, int fd, const _frame_s *frame, int expected, const char *name) {
+	_send(fd, frame->data, frame->size);
+	const int count = thermal_wait(thermal, _WAIT_NS);
+	CHECK(count == expected, "%s: %d events != %d", name, count, expected);
+}